@@ -0,0 +1,45 @@
+#!/usr/bin/env python
+#
+# Generates a large script for measuring compilation time:
+#
+#   python compile.py > compile.pwn
+#   pawncc compile.pwn
+#
+# Then compare the compile time for different numbers of threads, either with
+# "jit_stats 1" and jit_threads in server.cfg or, without a server, with
+# amxjitc:
+#
+#   for n in 1 2 4 8; do amxjitc --time -j $n -o cache-$n compile.amx; done
+
+import sys
+
+# Each function compiles to roughly 100 AMX instructions, so the default
+# produces a script of about 1M instructions.
+NUM_FUNCTIONS = 10000
+NUM_STATEMENTS = 16
+
+def main():
+  num_functions = NUM_FUNCTIONS
+  if len(sys.argv) > 1:
+    num_functions = int(sys.argv[1])
+
+  out = sys.stdout
+  out.write('#include <a_samp>\n\n')
+  out.write('main() {\n\tprintf("%d", Func0(1, 2));\n}\n')
+
+  for i in range(num_functions):
+    out.write('\nforward Func%d(a, b);\n' % i)
+    out.write('public Func%d(a, b) {\n' % i)
+    out.write('\tnew c = 0;\n')
+    for j in range(NUM_STATEMENTS):
+      out.write('\tc = c * %d + a - b;\n' % (i + j + 2))
+    out.write('\tfor (new k = 0; k < %d; k++) {\n' % (i % 7 + 1))
+    out.write('\t\tif (c > b) {\n\t\t\tc -= a;\n\t\t}\n\t}\n')
+    if i > 0:
+      out.write('\tif (a > %d) {\n' % (i + 100))
+      out.write('\t\tc += Func%d(b, c);\n' % (i - 1))
+      out.write('\t}\n')
+    out.write('\treturn c;\n}\n')
+
+if __name__ == '__main__':
+  main()
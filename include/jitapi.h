@@ -0,0 +1,58 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef JITAPI_H
+#define JITAPI_H
+
+#include <amx/amx.h>
+#include "plugincommon.h"
+
+// Functions exported by the JIT plugin for use by other plugins. They are
+// looked up at run time, e.g. with GetProcAddress() or dlsym():
+//
+//   JIT_FindPublic_t JIT_FindPublic =
+//     (JIT_FindPublic_t)dlsym(jit_module, "JIT_FindPublic");
+//
+// A handle resolves the public once, so calling it doesn't involve a name
+// lookup, the amx_Push() functions or the amx_Exec() hook.
+
+typedef struct JITPublic JITPublic;
+
+// Returns a handle for the public function with the specified name or null
+// if there is no such function or the AMX wasn't loaded by the server. The
+// handle remains valid until the script is unloaded.
+typedef JITPublic *(PLUGIN_CALL *JIT_FindPublic_t)(AMX *amx,
+                                                   const char *name);
+
+// Calls the public function with argc arguments taken from argv (argv[0]
+// is the first argument) and stores the return value in retval (if it's
+// not null). Arguments that are passed by reference, such as strings,
+// must be allocated on the AMX heap by the caller. Returns an AMX error
+// code, like amx_Exec(), or AMX_ERR_NOTFOUND if the handle is null.
+typedef int (PLUGIN_CALL *JIT_CallPublic_t)(JITPublic *handle,
+                                            cell *retval,
+                                            int argc,
+                                            const cell *argv);
+
+#endif // !JITAPI_H
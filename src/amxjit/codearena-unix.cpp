@@ -0,0 +1,164 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "codearena.h"
+
+#ifndef MAP_NORESERVE
+  #define MAP_NORESERVE 0
+#endif
+
+namespace amxjit {
+
+namespace {
+
+// Creates an anonymous file to back the two views of the arena.
+int CreateMemoryFile() {
+  int fd = -1;
+  #ifdef __NR_memfd_create
+    fd = static_cast<int>(syscall(__NR_memfd_create, "amxjit", 0));
+    if (fd >= 0) {
+      return fd;
+    }
+  #endif
+  char path[] = "/dev/shm/amxjit-arena-XXXXXX";
+  fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  return fd;
+}
+
+// Reserves address space aligned as requested.
+void *ReserveAligned(std::size_t size, std::size_t alignment) {
+  std::size_t reserve_size = size + alignment;
+  void *p = mmap(0, reserve_size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(p);
+  uintptr_t aligned = (start + alignment - 1) / alignment * alignment;
+  if (aligned > start) {
+    munmap(p, aligned - start);
+  }
+  if (aligned + size < start + reserve_size) {
+    munmap(reinterpret_cast<void*>(aligned + size),
+           start + reserve_size - aligned - size);
+  }
+  return reinterpret_cast<void*>(aligned);
+}
+
+} // anonymous namespace
+
+bool CodeArena::MapMemory(std::size_t size, std::size_t alignment) {
+  if (alignment < GetPageSize()) {
+    alignment = GetPageSize();
+  }
+
+  int fd = CreateMemoryFile();
+  if (fd >= 0) {
+    void *code = 0;
+    void *writable = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+      code = ReserveAligned(size, alignment);
+    }
+    if (code != 0) {
+      // This fails if the file system is mounted with noexec.
+      if (mmap(code, size, PROT_READ | PROT_EXEC,
+               MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        writable = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+      if (writable == MAP_FAILED) {
+        munmap(code, size);
+      }
+    }
+    if (writable != MAP_FAILED) {
+      code_ = static_cast<unsigned char*>(code);
+      writable_ = static_cast<unsigned char*>(writable);
+      handle_ = fd;
+      return true;
+    }
+    close(fd);
+  }
+
+  // Fall back to plain RWX memory.
+  void *code = ReserveAligned(size, alignment);
+  if (code == 0
+      || mmap(code, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+              -1, 0) == MAP_FAILED) {
+    if (code != 0) {
+      munmap(code, size);
+    }
+    return false;
+  }
+  code_ = writable_ = static_cast<unsigned char*>(code);
+  handle_ = -1;
+  return true;
+}
+
+void CodeArena::UnmapMemory() {
+  if (writable_ != code_) {
+    munmap(writable_, size_);
+  }
+  munmap(code_, size_);
+  if (handle_ >= 0) {
+    close(static_cast<int>(handle_));
+  }
+  code_ = writable_ = 0;
+  handle_ = -1;
+}
+
+void CodeArena::ReleasePages(std::size_t offset, std::size_t size) {
+  if (handle_ >= 0) {
+    #ifdef MADV_REMOVE
+      madvise(writable_ + offset, size, MADV_REMOVE);
+    #endif
+  } else {
+    madvise(code_ + offset, size, MADV_DONTNEED);
+  }
+}
+
+void CodeArena::AdviseHugePages(std::size_t offset, std::size_t size) {
+  #ifdef MADV_HUGEPAGE
+    madvise(code_ + offset, size, MADV_HUGEPAGE);
+    if (writable_ != code_) {
+      madvise(writable_ + offset, size, MADV_HUGEPAGE);
+    }
+  #else
+    (void)offset;
+    (void)size;
+  #endif
+}
+
+std::size_t CodeArena::GetPageSize() {
+  return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+} // namespace amxjit
@@ -0,0 +1,102 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "codearena.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+namespace amxjit {
+
+bool CodeArena::MapMemory(std::size_t size, std::size_t alignment) {
+  // Large pages require a special privilege that servers normally don't
+  // have, so the alignment (only needed for huge pages) is ignored.
+  (void)alignment;
+
+  HANDLE mapping = CreateFileMapping(INVALID_HANDLE_VALUE,
+                                     0,
+                                     PAGE_EXECUTE_READWRITE,
+                                     0,
+                                     static_cast<DWORD>(size),
+                                     0);
+  if (mapping != 0) {
+    void *code = MapViewOfFile(mapping,
+                               FILE_MAP_READ | FILE_MAP_EXECUTE,
+                               0, 0, size);
+    void *writable = 0;
+    if (code != 0) {
+      writable = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+      if (writable == 0) {
+        UnmapViewOfFile(code);
+      }
+    }
+    if (writable != 0) {
+      code_ = static_cast<unsigned char*>(code);
+      writable_ = static_cast<unsigned char*>(writable);
+      handle_ = reinterpret_cast<intptr_t>(mapping);
+      return true;
+    }
+    CloseHandle(mapping);
+  }
+
+  // Fall back to plain RWX memory.
+  void *code = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT,
+                            PAGE_EXECUTE_READWRITE);
+  if (code == 0) {
+    return false;
+  }
+  code_ = writable_ = static_cast<unsigned char*>(code);
+  handle_ = -1;
+  return true;
+}
+
+void CodeArena::UnmapMemory() {
+  if (handle_ != -1) {
+    UnmapViewOfFile(writable_);
+    UnmapViewOfFile(code_);
+    CloseHandle(reinterpret_cast<HANDLE>(handle_));
+  } else {
+    VirtualFree(code_, 0, MEM_RELEASE);
+  }
+  code_ = writable_ = 0;
+  handle_ = -1;
+}
+
+void CodeArena::ReleasePages(std::size_t offset, std::size_t size) {
+  // The pages stay committed but their contents can be discarded.
+  VirtualAlloc(writable_ + offset, size, MEM_RESET, PAGE_NOACCESS);
+}
+
+void CodeArena::AdviseHugePages(std::size_t offset, std::size_t size) {
+  (void)offset;
+  (void)size;
+}
+
+std::size_t CodeArena::GetPageSize() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+}
+
+} // namespace amxjit
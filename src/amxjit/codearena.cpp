@@ -0,0 +1,204 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cassert>
+#include "codearena.h"
+
+namespace amxjit {
+
+namespace {
+
+// Blocks are aligned on a cache line boundary.
+const std::size_t kBlockAlignment = 64;
+
+std::size_t RoundUp(std::size_t x, std::size_t alignment) {
+  return (x + alignment - 1) / alignment * alignment;
+}
+
+std::size_t RoundDown(std::size_t x, std::size_t alignment) {
+  return x / alignment * alignment;
+}
+
+} // anonymous namespace
+
+CodeArena::CodeArena():
+  code_(),
+  writable_(),
+  size_(),
+  handle_(-1),
+  used_size_()
+{
+}
+
+CodeArena::~CodeArena() {
+  if (code_ != 0) {
+    UnmapMemory();
+  }
+}
+
+bool CodeArena::Init(std::size_t size, bool huge_pages) {
+  ScopedLock lock(mutex_);
+
+  if (code_ != 0 || size == 0) {
+    return false;
+  }
+
+  size = RoundUp(size, GetPageSize());
+  std::size_t hot_size = size >= 2 * kHotSize ? kHotSize : 0;
+  if (!MapMemory(size, huge_pages && hot_size > 0 ? kHotSize : 0)) {
+    return false;
+  }
+  size_ = size;
+
+  hot_.start = hot_.top = 0;
+  hot_.end = hot_size;
+  cold_.start = cold_.top = hot_size;
+  cold_.end = size;
+
+  if (huge_pages && hot_size > 0) {
+    AdviseHugePages(0, hot_size);
+  }
+  return true;
+}
+
+void *CodeArena::Alloc(std::size_t size, bool hot) {
+  ScopedLock lock(mutex_);
+
+  if (code_ == 0 || size == 0) {
+    return 0;
+  }
+
+  size = RoundUp(size, kBlockAlignment);
+  std::size_t offset;
+  if (!(hot && AllocIn(hot_, size, offset)) && !AllocIn(cold_, size, offset)) {
+    return 0;
+  }
+
+  blocks_[offset] = size;
+  used_size_ += size;
+  return code_ + offset;
+}
+
+bool CodeArena::Free(void *p) {
+  ScopedLock lock(mutex_);
+
+  unsigned char *ptr = static_cast<unsigned char*>(p);
+  if (code_ == 0 || ptr < code_ || ptr >= code_ + size_) {
+    return false;
+  }
+
+  std::size_t offset = ptr - code_;
+  std::map<std::size_t, std::size_t>::iterator it = blocks_.find(offset);
+  assert(it != blocks_.end());
+  if (it == blocks_.end()) {
+    return true;
+  }
+
+  std::size_t size = it->second;
+  blocks_.erase(it);
+  used_size_ -= size;
+  FreeIn(offset < hot_.end ? hot_ : cold_, offset, size);
+
+  return true;
+}
+
+void *CodeArena::GetWritable(void *p) const {
+  unsigned char *ptr = static_cast<unsigned char*>(p);
+  if (code_ == 0 || ptr < code_ || ptr >= code_ + size_) {
+    return p;
+  }
+  return writable_ + (ptr - code_);
+}
+
+bool CodeArena::IsWriteProtected() const {
+  ScopedLock lock(mutex_);
+  return code_ != 0 && code_ != writable_;
+}
+
+std::size_t CodeArena::GetUsedSize() const {
+  ScopedLock lock(mutex_);
+  return used_size_;
+}
+
+bool CodeArena::AllocIn(Region &region,
+                        std::size_t size,
+                        std::size_t &offset) {
+  // First fit from the free list, then from the top of the region.
+  for (std::map<std::size_t, std::size_t>::iterator it =
+         region.free_blocks.begin(); it != region.free_blocks.end(); it++) {
+    if (it->second >= size) {
+      offset = it->first;
+      std::size_t remainder = it->second - size;
+      region.free_blocks.erase(it);
+      if (remainder > 0) {
+        region.free_blocks[offset + size] = remainder;
+      }
+      return true;
+    }
+  }
+
+  if (region.end - region.top < size) {
+    return false;
+  }
+  offset = region.top;
+  region.top += size;
+  return true;
+}
+
+void CodeArena::FreeIn(Region &region, std::size_t offset, std::size_t size) {
+  std::size_t start = offset;
+  std::size_t end = offset + size;
+
+  // Merge with the neighbouring free blocks.
+  std::map<std::size_t, std::size_t>::iterator next =
+    region.free_blocks.lower_bound(offset);
+  if (next != region.free_blocks.end() && next->first == end) {
+    end += next->second;
+    region.free_blocks.erase(next++);
+  }
+  if (next != region.free_blocks.begin()) {
+    std::map<std::size_t, std::size_t>::iterator prev = next;
+    prev--;
+    if (prev->first + prev->second == start) {
+      start = prev->first;
+      region.free_blocks.erase(prev);
+    }
+  }
+
+  if (end == region.top) {
+    region.top = start;
+  } else {
+    region.free_blocks[start] = end - start;
+  }
+
+  // Give back the pages that no longer hold any code.
+  std::size_t page_size = GetPageSize();
+  std::size_t first_page = RoundUp(start, page_size);
+  std::size_t last_page = RoundDown(end, page_size);
+  if (first_page < last_page) {
+    ReleasePages(first_page, last_page - first_page);
+  }
+}
+
+} // namespace amxjit
@@ -0,0 +1,113 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_CODEARENA_H
+#define AMXJIT_CODEARENA_H
+
+#include <cstddef>
+#include <map>
+#include "cstdint.h"
+#include "macros.h"
+#include "thread.h"
+
+namespace amxjit {
+
+// CodeArena is a single large block of executable memory from which the
+// compiled code of all scripts is allocated.
+//
+// Where possible the memory is mapped twice: once as read-only executable
+// and once as writable, so no page is ever both writable and executable
+// (W^X). Code is written through GetWritable() and run from the original
+// address.
+//
+// The first kHotSize bytes form a separate region for hot code (runtime
+// helpers and optimized functions) which can be backed by huge pages to
+// reduce iTLB misses. Freed blocks are coalesced and pages that become
+// completely free are returned to the system, so unloading a script
+// leaves no holes behind for the next one.
+class CodeArena {
+ public:
+  static const std::size_t kHotSize = 2 * 1024 * 1024;
+
+  CodeArena();
+  ~CodeArena();
+
+  // Reserves size bytes for the arena. Can only be done once, until then
+  // all allocations fail.
+  bool Init(std::size_t size, bool huge_pages);
+
+  // Allocates a block of code. Hot blocks go to the hot region as long as
+  // there is space for them. Returns null if the arena is full.
+  void *Alloc(std::size_t size, bool hot);
+
+  // Frees a block. Returns false if the block is not from this arena.
+  bool Free(void *p);
+
+  // Returns the address through which the code at p can be modified. If
+  // p is not in the arena it's returned as is.
+  void *GetWritable(void *p) const;
+
+  // Returns true if the arena enforces W^X.
+  bool IsWriteProtected() const;
+
+  // Returns the number of bytes currently allocated.
+  std::size_t GetUsedSize() const;
+
+ private:
+  struct Region {
+    Region(): start(), end(), top() {}
+    std::size_t start;
+    std::size_t end;
+    std::size_t top;
+    std::map<std::size_t, std::size_t> free_blocks;
+  };
+
+  bool AllocIn(Region &region, std::size_t size, std::size_t &offset);
+  void FreeIn(Region &region, std::size_t offset, std::size_t size);
+
+  // These are implemented in codearena-<platform>.cpp.
+  bool MapMemory(std::size_t size, std::size_t alignment);
+  void UnmapMemory();
+  void ReleasePages(std::size_t offset, std::size_t size);
+  void AdviseHugePages(std::size_t offset, std::size_t size);
+  static std::size_t GetPageSize();
+
+ private:
+  mutable Mutex mutex_;
+  unsigned char *code_;
+  unsigned char *writable_;
+  std::size_t size_;
+  intptr_t handle_;
+  Region hot_;
+  Region cold_;
+  std::map<std::size_t, std::size_t> blocks_;
+  std::size_t used_size_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(CodeArena);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_CODEARENA_H
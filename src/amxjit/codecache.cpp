@@ -0,0 +1,540 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstdio>
+#include <cstring>
+#include "codecache.h"
+#include "disasm.h"
+#include "function.h"
+
+namespace amxjit {
+namespace {
+
+const uint32_t kMagic = 0x54494a41; // "AJIT"
+
+// Must be increased whenever the file format changes.
+const uint32_t kFormatVersion = 1;
+
+// Anything bigger than this is certainly not a valid cache file.
+const long kMaxFileSize = 256 * 1024 * 1024;
+
+// 64-bit FNV-1a hash.
+class Hash {
+ public:
+  Hash(): value_(14695981039346656037ULL) {}
+
+  void Update(const void *data, std::size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i < size; i++) {
+      value_ ^= bytes[i];
+      value_ *= 1099511628211ULL;
+    }
+  }
+
+  void Update(cell value) {
+    Update(&value, sizeof(value));
+  }
+
+  void Update(const char *s) {
+    Update(s, std::strlen(s) + 1);
+  }
+
+  uint64_t value() const { return value_; }
+
+ private:
+  uint64_t value_;
+};
+
+class Writer {
+ public:
+  void Put(uint32_t value) {
+    Put(&value, sizeof(value));
+  }
+
+  void Put(const void *data, std::size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + size);
+  }
+
+  const std::vector<unsigned char> &buffer() const { return buffer_; }
+
+ private:
+  std::vector<unsigned char> buffer_;
+};
+
+class Reader {
+ public:
+  Reader(const unsigned char *data, std::size_t size):
+    data_(data), size_(size), pos_(0) {}
+
+  bool Get(uint32_t &value) {
+    return Get(&value, sizeof(value));
+  }
+
+  bool Get(int32_t &value) {
+    return Get(&value, sizeof(value));
+  }
+
+  bool Get(void *data, std::size_t size) {
+    if (size > size_ - pos_) {
+      return false;
+    }
+    std::memcpy(data, data_ + pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+  const unsigned char *current() const { return data_ + pos_; }
+  std::size_t remaining() const { return size_ - pos_; }
+
+ private:
+  const unsigned char *data_;
+  std::size_t size_;
+  std::size_t pos_;
+};
+
+int32_t GetInt32(const std::vector<unsigned char> &code,
+                 std::ptrdiff_t offset) {
+  int32_t value;
+  std::memcpy(&value, &code[offset], sizeof(value));
+  return value;
+}
+
+void SetInt32(std::vector<unsigned char> &code,
+              std::ptrdiff_t offset,
+              int32_t value) {
+  std::memcpy(&code[offset], &value, sizeof(value));
+}
+
+bool IsValidOffset(const std::vector<unsigned char> &code,
+                   std::ptrdiff_t offset) {
+  return offset >= 0
+      && static_cast<std::size_t>(offset) + sizeof(int32_t) <= code.size();
+}
+
+bool ReadFile(const std::string &path, std::vector<unsigned char> &buffer) {
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == 0) {
+    return false;
+  }
+
+  bool ok = false;
+  if (std::fseek(file, 0, SEEK_END) == 0) {
+    long size = std::ftell(file);
+    if (size > 0 && size <= kMaxFileSize
+        && std::fseek(file, 0, SEEK_SET) == 0) {
+      buffer.resize(size);
+      ok = std::fread(&buffer[0], 1, size, file)
+        == static_cast<std::size_t>(size);
+    }
+  }
+
+  std::fclose(file);
+  return ok;
+}
+
+bool WriteFile(const std::string &path,
+               const std::vector<unsigned char> &buffer) {
+  // Write to a temporary file first so that other processes never see a
+  // partially written file.
+  std::string temp_path = path + ".tmp";
+  std::FILE *file = std::fopen(temp_path.c_str(), "wb");
+  if (file == 0) {
+    return false;
+  }
+
+  bool ok = std::fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+  ok = std::fclose(file) == 0 && ok;
+
+  if (ok) {
+    std::remove(path.c_str());
+    ok = std::rename(temp_path.c_str(), path.c_str()) == 0;
+  }
+  if (!ok) {
+    std::remove(temp_path.c_str());
+  }
+  return ok;
+}
+
+bool ReadImage(Reader &reader,
+               const FunctionTable &functions,
+               const std::vector<intptr_t> &symbols,
+               intptr_t data,
+               std::size_t data_size,
+               int index,
+               CodeImage &image) {
+  int32_t image_index;
+  int32_t start;
+  uint32_t code_size;
+  if (!reader.Get(image_index)
+      || !reader.Get(start)
+      || !reader.Get(code_size)
+      || image_index != index
+      || code_size == 0
+      || code_size > reader.remaining()) {
+    return false;
+  }
+
+  image.index = index;
+  image.start = start;
+  image.code.resize(code_size);
+  reader.Get(&image.code[0], code_size);
+  if (start < 0 || static_cast<uint32_t>(start) >= code_size) {
+    return false;
+  }
+
+  // The range of AMX addresses covered by the image.
+  cell min_address = 0;
+  cell max_address;
+  if (index >= 0) {
+    min_address = functions.GetFunction(index).address();
+    max_address = functions.GetFunction(index).end_address();
+  } else {
+    max_address = functions.GetFunction(0).address();
+  }
+
+  uint32_t count;
+  if (!reader.Get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t offset;
+    if (!reader.Get(offset) || !IsValidOffset(image.code, offset)) {
+      return false;
+    }
+    int32_t value = GetInt32(image.code, offset);
+    if (value < 0 || static_cast<uint32_t>(value) > code_size) {
+      return false;
+    }
+    image.abs_relocs.push_back(offset);
+  }
+
+  if (!reader.Get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t offset;
+    int32_t symbol;
+    if (!reader.Get(offset)
+        || !reader.Get(symbol)
+        || !IsValidOffset(image.code, offset)
+        || symbol < -1
+        || symbol >= static_cast<int32_t>(symbols.size())) {
+      return false;
+    }
+    int32_t value = GetInt32(image.code, offset);
+    if (value != -static_cast<int32_t>(offset + sizeof(int32_t))) {
+      return false;
+    }
+    if (symbol >= 0) {
+      SetInt32(image.code, offset, value + symbols[symbol]);
+    }
+    image.rel_relocs.push_back(offset);
+  }
+
+  if (!reader.Get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t offset;
+    if (!reader.Get(offset) || !IsValidOffset(image.code, offset)) {
+      return false;
+    }
+    int32_t value = GetInt32(image.code, offset);
+    if (value < 0
+        || static_cast<std::size_t>(value) + sizeof(int32_t) > data_size) {
+      return false;
+    }
+    SetInt32(image.code, offset, value + data);
+    image.data_relocs.push_back(offset);
+  }
+
+  if (!reader.Get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t address;
+    int32_t offset;
+    if (!reader.Get(address)
+        || !reader.Get(offset)
+        || address < min_address
+        || address >= max_address
+        || offset < 0
+        || static_cast<uint32_t>(offset) >= code_size) {
+      return false;
+    }
+    image.instr_map[address] = offset;
+  }
+
+  if (!reader.Get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t offset;
+    int32_t callee;
+    if (!reader.Get(offset)
+        || !reader.Get(callee)
+        || !IsValidOffset(image.code,
+                           offset - static_cast<int32_t>(sizeof(int32_t)))
+        || callee < 0
+        || callee >= functions.num_functions()) {
+      return false;
+    }
+    image.call_sites.push_back(CallSite(offset, callee));
+  }
+
+  return true;
+}
+
+bool WriteImage(Writer &writer,
+                const CodeImage &image,
+                const std::vector<intptr_t> &symbols,
+                intptr_t data,
+                std::size_t data_size) {
+  // Replace the addresses that will be different next time with offsets.
+  std::vector<unsigned char> code = image.code;
+  std::vector<int32_t> rel_symbols;
+
+  for (std::size_t i = 0; i < image.rel_relocs.size(); i++) {
+    std::ptrdiff_t offset = image.rel_relocs[i];
+    int32_t value = GetInt32(code, offset);
+    intptr_t target = value + static_cast<int32_t>(offset + sizeof(int32_t));
+    int32_t symbol = -1;
+    if (target != 0) {
+      for (std::size_t j = 0; j < symbols.size(); j++) {
+        if (symbols[j] == target) {
+          symbol = static_cast<int32_t>(j);
+          break;
+        }
+      }
+      if (symbol < 0) {
+        return false;
+      }
+    }
+    SetInt32(code, offset, value - target);
+    rel_symbols.push_back(symbol);
+  }
+
+  for (std::size_t i = 0; i < image.data_relocs.size(); i++) {
+    std::ptrdiff_t offset = image.data_relocs[i];
+    int32_t value = GetInt32(code, offset) - data;
+    if (value < 0
+        || static_cast<std::size_t>(value) + sizeof(int32_t) > data_size) {
+      return false;
+    }
+    SetInt32(code, offset, value);
+  }
+
+  writer.Put(static_cast<uint32_t>(image.index));
+  writer.Put(static_cast<uint32_t>(image.start));
+  writer.Put(static_cast<uint32_t>(code.size()));
+  writer.Put(&code[0], code.size());
+
+  writer.Put(static_cast<uint32_t>(image.abs_relocs.size()));
+  for (std::size_t i = 0; i < image.abs_relocs.size(); i++) {
+    writer.Put(static_cast<uint32_t>(image.abs_relocs[i]));
+  }
+  writer.Put(static_cast<uint32_t>(image.rel_relocs.size()));
+  for (std::size_t i = 0; i < image.rel_relocs.size(); i++) {
+    writer.Put(static_cast<uint32_t>(image.rel_relocs[i]));
+    writer.Put(static_cast<uint32_t>(rel_symbols[i]));
+  }
+  writer.Put(static_cast<uint32_t>(image.data_relocs.size()));
+  for (std::size_t i = 0; i < image.data_relocs.size(); i++) {
+    writer.Put(static_cast<uint32_t>(image.data_relocs[i]));
+  }
+
+  writer.Put(static_cast<uint32_t>(image.instr_map.size()));
+  for (std::map<cell, std::ptrdiff_t>::const_iterator it =
+         image.instr_map.begin(); it != image.instr_map.end(); it++) {
+    writer.Put(static_cast<uint32_t>(it->first));
+    writer.Put(static_cast<uint32_t>(it->second));
+  }
+  writer.Put(static_cast<uint32_t>(image.call_sites.size()));
+  for (std::size_t i = 0; i < image.call_sites.size(); i++) {
+    writer.Put(static_cast<uint32_t>(image.call_sites[i].first));
+    writer.Put(static_cast<uint32_t>(image.call_sites[i].second));
+  }
+
+  return true;
+}
+
+} // anonymous namespace
+
+CodeCache::CodeCache(const std::string &dir, const std::string &version):
+  dir_(dir),
+  version_(version),
+  key_()
+{
+}
+
+bool CodeCache::Open(AMXRef amx) {
+  Hash hash;
+  hash.Update(version_.c_str());
+  hash.Update(static_cast<cell>(amx.code_size()));
+
+  // Code addresses in the instructions are absolute (relative to the
+  // start of the code in memory), so they must be converted back.
+  cell code = reinterpret_cast<cell>(amx.code());
+
+  Disassembler disasm(amx);
+  Instruction instr;
+  bool error = false;
+
+  while (disasm.Decode(instr, error)) {
+    Opcode opcode = instr.opcode();
+    if (opcode.GetId() == OP_SYSREQ_D) {
+      // Native function addresses are different each time.
+      return false;
+    }
+
+    bool relocated = (opcode.IsJump() && opcode.GetId() != OP_JREL)
+                  || opcode.GetId() == OP_CALL
+                  || opcode.GetId() == OP_SWITCH;
+
+    hash.Update(static_cast<cell>(opcode.GetId()));
+    const std::vector<cell> &operands = instr.operands();
+    for (std::size_t i = 0; i < operands.size(); i++) {
+      cell operand = operands[i];
+      if (relocated || (opcode.GetId() == OP_CASETBL && i % 2 == 1)) {
+        operand -= code;
+      }
+      hash.Update(operand);
+    }
+  }
+  if (error) {
+    return false;
+  }
+
+  // Calls to some natives are replaced with inline code.
+  for (int i = 0; i < amx.num_natives(); i++) {
+    hash.Update(amx.GetNativeName(i));
+  }
+
+  key_ = hash.value();
+
+  char name[32];
+  std::sprintf(name, "%08x%08x",
+               static_cast<unsigned int>(key_ >> 32),
+               static_cast<unsigned int>(key_ & 0xffffffffu));
+  name_ = name;
+  path_ = dir_ + "/" + name_ + ".bin";
+
+  return true;
+}
+
+bool CodeCache::Load(const FunctionTable &functions,
+                     const std::vector<intptr_t> &symbols,
+                     intptr_t data,
+                     std::size_t data_size,
+                     std::vector<CodeImage> &images) const {
+  std::vector<unsigned char> buffer;
+  if (path_.empty()
+      || functions.num_functions() == 0
+      || !ReadFile(path_, buffer)) {
+    return false;
+  }
+
+  Reader reader(&buffer[0], buffer.size());
+  uint32_t magic;
+  uint32_t format_version;
+  uint32_t key[2];
+  uint32_t payload_size;
+  uint32_t checksum[2];
+  if (!reader.Get(magic)
+      || !reader.Get(format_version)
+      || !reader.Get(key[0])
+      || !reader.Get(key[1])
+      || !reader.Get(payload_size)
+      || !reader.Get(checksum[0])
+      || !reader.Get(checksum[1])
+      || magic != kMagic
+      || format_version != kFormatVersion
+      || key[0] != static_cast<uint32_t>(key_ & 0xffffffffu)
+      || key[1] != static_cast<uint32_t>(key_ >> 32)
+      || payload_size != reader.remaining()) {
+    return false;
+  }
+
+  Hash hash;
+  hash.Update(reader.current(), payload_size);
+  if (checksum[0] != static_cast<uint32_t>(hash.value() & 0xffffffffu)
+      || checksum[1] != static_cast<uint32_t>(hash.value() >> 32)) {
+    return false;
+  }
+
+  uint32_t num_images;
+  if (!reader.Get(num_images)
+      || num_images != static_cast<uint32_t>(functions.num_functions() + 1)) {
+    return false;
+  }
+
+  std::vector<CodeImage> result(num_images);
+  for (uint32_t i = 0; i < num_images; i++) {
+    if (!ReadImage(reader, functions, symbols, data, data_size,
+                   static_cast<int>(i) - 1, result[i])) {
+      return false;
+    }
+  }
+  if (reader.remaining() != 0) {
+    return false;
+  }
+
+  images.swap(result);
+  return true;
+}
+
+bool CodeCache::Save(const std::vector<CodeImage> &images,
+                     const std::vector<intptr_t> &symbols,
+                     intptr_t data,
+                     std::size_t data_size) const {
+  if (path_.empty()) {
+    return false;
+  }
+
+  Writer payload;
+  payload.Put(static_cast<uint32_t>(images.size()));
+  for (std::size_t i = 0; i < images.size(); i++) {
+    if (!WriteImage(payload, images[i], symbols, data, data_size)) {
+      return false;
+    }
+  }
+
+  Hash hash;
+  hash.Update(&payload.buffer()[0], payload.buffer().size());
+
+  Writer file;
+  file.Put(kMagic);
+  file.Put(kFormatVersion);
+  file.Put(static_cast<uint32_t>(key_ & 0xffffffffu));
+  file.Put(static_cast<uint32_t>(key_ >> 32));
+  file.Put(static_cast<uint32_t>(payload.buffer().size()));
+  file.Put(static_cast<uint32_t>(hash.value() & 0xffffffffu));
+  file.Put(static_cast<uint32_t>(hash.value() >> 32));
+  file.Put(&payload.buffer()[0], payload.buffer().size());
+
+  return WriteFile(path_, file.buffer());
+}
+
+} // namespace amxjit
@@ -0,0 +1,114 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_CODECACHE_H
+#define AMXJIT_CODECACHE_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "amxref.h"
+#include "cstdint.h"
+#include "macros.h"
+
+namespace amxjit {
+
+class FunctionTable;
+
+// Calls to other functions are emitted as direct calls to their stubs and
+// patched once the callee is compiled. This is the offset of the end of
+// such call instruction and the index of the callee.
+typedef std::pair<std::ptrdiff_t, int> CallSite;
+
+// The code of a function (or of the code that precedes the first function
+// if index is -1) compiled separately from the rest of the script, as if it
+// was placed at address zero. The relocations are the offsets of 32-bit
+// values to which the actual address must be added (absolute addresses)
+// or from which it must be subtracted (references to code outside of it).
+// Data relocations point to absolute addresses of the runtime data that
+// the code uses; they are only needed for caching.
+struct CodeImage {
+  int index;
+  std::vector<unsigned char> code;
+  std::vector<std::ptrdiff_t> abs_relocs;
+  std::vector<std::ptrdiff_t> rel_relocs;
+  std::vector<std::ptrdiff_t> data_relocs;
+  std::ptrdiff_t start;
+  std::map<cell, std::ptrdiff_t> instr_map;
+  std::vector<CallSite> call_sites;
+};
+
+// CodeCache stores compiled code on disk so that it doesn't have to be
+// compiled again the next time the same script is loaded. Entries are
+// identified by a hash of the script's code, the names of its natives and
+// a version string that should change whenever the generated code does.
+//
+// Addresses that differ between runs are saved in a position-independent
+// form: the targets of outside references must be among the symbols and
+// data relocations must point inside of the data block. Cache files are
+// checksummed and checked against the script when loaded, anything that
+// doesn't match is ignored.
+class CodeCache {
+ public:
+  CodeCache(const std::string &dir, const std::string &version);
+
+  // Computes the cache key of the script. Returns false if the script
+  // can't be cached.
+  bool Open(AMXRef amx);
+
+  // Returns the cache key in text form (valid after Open()).
+  const std::string &name() const { return name_; }
+
+  // Returns the name of the cache file.
+  const std::string &path() const { return path_; }
+
+  // Loads code compiled for the specified symbols and data block.
+  bool Load(const FunctionTable &functions,
+            const std::vector<intptr_t> &symbols,
+            intptr_t data,
+            std::size_t data_size,
+            std::vector<CodeImage> &images) const;
+
+  // Saves code that refers to the specified symbols and data block.
+  bool Save(const std::vector<CodeImage> &images,
+            const std::vector<intptr_t> &symbols,
+            intptr_t data,
+            std::size_t data_size) const;
+
+ private:
+  std::string dir_;
+  std::string version_;
+  std::string name_;
+  std::string path_;
+  uint64_t key_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(CodeCache);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_CODECACHE_H
@@ -22,11 +22,13 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstring>
 #include <string>
+#include "codearena.h"
 #include "compiler-asmjit.h"
 #include "cstdint.h"
 #include "disasm.h"
@@ -53,116 +55,1504 @@ using asmjit::x86::esp;
 using asmjit::x86::fp0;
 using asmjit::x86::fp1;
 
-namespace amxjit {
-namespace {
+namespace amxjit {
+
+// The runtime info block holds the state shared by the helper functions
+// and the compiled code. Its address is known at compile time so it can be
+// accessed from any piece of code.
+struct RuntimeInfoBlock {
+  intptr_t exec;
+  intptr_t amx;
+  intptr_t ebp;
+  intptr_t esp;
+  intptr_t reset_ebp;
+  intptr_t reset_esp;
+  intptr_t halted;
+  intptr_t exec_helper;
+  intptr_t call_helper;
+  intptr_t halt_helper;
+  intptr_t jump_helper;
+  intptr_t sysreq_c_helper;
+  intptr_t sysreq_d_helper;
+  intptr_t code_write_helper;
+  intptr_t optimize_helper;
+  intptr_t osr_helper;
+  CompileOutputAsmjit *output;
+  // Used by the fast path of Exec. data is known after the first call and
+  // public_starts caches GetPublicStart() (main is at index 0).
+  intptr_t data;
+  intptr_t public_starts;
+  intptr_t num_public_starts;
+};
+
+namespace {
+
+// The runtime is only used for code that doesn't fit in the arena.
+asmjit::JitRuntime jit_runtime;
+CodeArena code_arena;
+
+// The helper functions are shared by all scripts and are emitted only once.
+// They find the state of the running script through current_rib, which is
+// switched by Exec and by CompileOutputAsmjit::Call().
+struct SharedRuntime {
+  void *code;
+  intptr_t exec;
+  intptr_t exec_helper;
+  intptr_t call_helper;
+  intptr_t halt_helper;
+  intptr_t jump_helper;
+  intptr_t sysreq_c_helper;
+  intptr_t sysreq_d_helper;
+  intptr_t interp_helper;
+  intptr_t recompile_helper;
+  intptr_t code_write_helper;
+};
+
+SharedRuntime shared_runtime;
+Mutex shared_runtime_mutex;
+RuntimeInfoBlock *current_rib = 0;
+
+// Same as current_rib->amx. Code that is not shared with other processes
+// reads the AMX pointer from here, so that it can run for any script (see
+// UseCurrentAmx()).
+intptr_t current_amx = 0;
+
+// Functions that are identical in several scripts are kept only once.
+// Entries are referenced by the scripts that use them and by the pooled
+// functions that call them.
+struct PooledFunction {
+  std::string key;
+  unsigned char *code;
+  int refs;
+  std::vector<uint64_t> callees;
+};
+
+typedef std::map<uint64_t, PooledFunction> FunctionPool;
+FunctionPool function_pool;
+Mutex function_pool_mutex;
+
+// Layout of the local area of shared code: jumps to the helper functions
+// followed by a copy of the runtime info block.
+const std::size_t kLocalJumpSize = 8;
+const std::size_t kLocalDataOffset = 128;
+
+// A loop iteration counts as this fraction of a call when deciding whether
+// a function should be compiled.
+const int kBackEdgesPerCall = 100;
+
+// Compiled functions are sent to the optimizing tier after they have been
+// entered or looped this many times the tier-up threshold.
+const int kHotnessPerCall = 100;
+
+typedef cell (AMXJIT_CDECL *CallHelper)(void *address);
+
+asmjit::X86Mem AbsPtr(const void *address) {
+  return dword_ptr_abs(reinterpret_cast<asmjit::Ptr>(address));
+}
+
+asmjit::Ptr CodePtr(intptr_t address) {
+  return static_cast<asmjit::Ptr>(static_cast<uintptr_t>(address));
+}
+
+// Refers to a field of the runtime info block pointed to by reg.
+asmjit::X86Mem RibPtr(const asmjit::X86GpReg &reg, std::size_t offset) {
+  return dword_ptr(reg, static_cast<int32_t>(offset));
+}
+
+void *AMXJIT_CDECL GetInstrStartPtr(cell address, RuntimeInfoBlock *rib) {
+  return rib->output->GetInstrStart(address);
+}
+
+void *AMXJIT_CDECL GetPublicStartPtr(int index, RuntimeInfoBlock *rib) {
+  return rib->output->GetPublicStart(index);
+}
+
+void *AMXJIT_CDECL Tier0Entry(RuntimeInfoBlock *rib, int index) {
+  return rib->output->EnterFunction(index);
+}
+
+void *AMXJIT_CDECL InterpEntry(RuntimeInfoBlock *rib, int index) {
+  return rib->output->RunInInterpreter(
+    AMXRef(reinterpret_cast<AMX*>(rib->amx)), index);
+}
+
+void *AMXJIT_CDECL RecompileEntry(RuntimeInfoBlock *rib, int index) {
+  return rib->output->EnterModifiedFunction(
+    AMXRef(reinterpret_cast<AMX*>(rib->amx)), index);
+}
+
+void AMXJIT_CDECL CodeWriteEntry(RuntimeInfoBlock *rib,
+                                 cell address,
+                                 cell size) {
+  rib->output->OnCodeWrite(address, size);
+}
+
+void AMXJIT_CDECL RequestOptimization(RuntimeInfoBlock *rib, int index) {
+  rib->output->RequestOptimization(index);
+}
+
+void *AMXJIT_CDECL EnterOptimizedCode(RuntimeInfoBlock *rib,
+                                      int index,
+                                      cell address) {
+  return rib->output->EnterOptimizedCode(index, address);
+}
+
+class AsmJitLoggerAdapter: public asmjit::Logger {
+ public:
+  AsmJitLoggerAdapter(amxjit::Logger *logger):
+    logger_(logger) {}
+  virtual void logString(uint32_t style,
+                         const char* buf,
+                         size_t len = asmjit::kInvalidIndex) {
+    assert(logger_ != 0);
+    if (len == asmjit::kInvalidIndex) {
+      logger_->Write(buf);
+    } else {
+      std::string tmp_buf(buf, len);
+      logger_->Write(tmp_buf.c_str());
+    }
+  }
+ private:
+  amxjit::Logger *logger_;
+};
+
+void *AllocCode(std::size_t size, bool hot) {
+  void *code = code_arena.Alloc(size, hot);
+  if (code == 0) {
+    code = jit_runtime.getMemMgr()->alloc(size);
+  }
+  return code;
+}
+
+void FreeCode(void *code) {
+  if (!code_arena.Free(code)) {
+    jit_runtime.release(code);
+  }
+}
+
+// Code in the arena is not writable at its own address (W^X).
+template<typename T>
+T *GetWritable(T *code) {
+  return static_cast<T*>(code_arena.GetWritable(code));
+}
+
+// Same as Assembler::make() but hot code goes to the hot region of the
+// arena.
+void *MakeCode(asmjit::X86Assembler &as, bool hot) {
+  std::size_t size = as.getCodeSize();
+  if (size == 0) {
+    return 0;
+  }
+
+  void *code = AllocCode(size, hot);
+  if (code == 0) {
+    return 0;
+  }
+
+  asmjit::Ptr base =
+    static_cast<asmjit::Ptr>(reinterpret_cast<uintptr_t>(code));
+  as.setBaseAddress(base);
+  std::size_t reloc_size = as.relocCode(GetWritable(code), base);
+  as.resetBaseAddress();
+
+  if (reloc_size == 0) {
+    FreeCode(code);
+    return 0;
+  }
+  return code;
+}
+
+// Adds a value to a 32-bit integer stored in code.
+void AddToInt32(unsigned char *ptr, intptr_t value) {
+  int32_t x;
+  std::memcpy(&x, ptr, sizeof(x));
+  x += static_cast<int32_t>(value);
+  std::memcpy(GetWritable(ptr), &x, sizeof(x));
+}
+
+// Overwrites the code at ptr with a jump to target.
+void PatchJump(unsigned char *ptr, void *target) {
+  unsigned char jump[5];
+  int32_t offset = static_cast<int32_t>(
+    static_cast<unsigned char*>(target) - (ptr + sizeof(jump)));
+  jump[0] = 0xE9; // jmp rel32
+  std::memcpy(jump + 1, &offset, sizeof(offset));
+  std::memcpy(GetWritable(ptr), jump, sizeof(jump));
+}
+
+// Copies the image to its final location and relocates it.
+void CopyImage(const CodeImage &image, unsigned char *base) {
+  intptr_t address = reinterpret_cast<intptr_t>(base);
+  std::memcpy(GetWritable(base), &image.code[0], image.code.size());
+  for (std::size_t i = 0; i < image.abs_relocs.size(); i++) {
+    AddToInt32(base + image.abs_relocs[i], address);
+  }
+  for (std::size_t i = 0; i < image.rel_relocs.size(); i++) {
+    AddToInt32(base + image.rel_relocs[i], -address);
+  }
+}
+
+// Makes the code at the specified data relocations read the AMX pointer
+// from current_amx instead of the RIB.
+void UseCurrentAmx(unsigned char *code,
+                   const std::vector<std::ptrdiff_t> &data_relocs,
+                   const RuntimeInfoBlock *rib) {
+  for (std::size_t i = 0; i < data_relocs.size(); i++) {
+    AddToInt32(code + data_relocs[i],
+               reinterpret_cast<intptr_t>(&current_amx)
+               - reinterpret_cast<intptr_t>(&rib->amx));
+  }
+}
+
+template<typename T>
+void AppendToKey(std::string &key, T value) {
+  key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// 64-bit FNV-1a hash.
+uint64_t HashKey(const std::string &key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (std::size_t i = 0; i < key.size(); i++) {
+    hash ^= static_cast<unsigned char>(key[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Must be called with function_pool_mutex locked.
+void ReleasePooledFunction(uint64_t hash) {
+  FunctionPool::iterator it = function_pool.find(hash);
+  assert(it != function_pool.end());
+  if (--it->second.refs > 0) {
+    return;
+  }
+  std::vector<uint64_t> callees;
+  callees.swap(it->second.callees);
+  FreeCode(it->second.code);
+  function_pool.erase(it);
+  for (std::size_t i = 0; i < callees.size(); i++) {
+    ReleasePooledFunction(callees[i]);
+  }
+}
+
+bool IsSameImage(const CodeImage &a, const CodeImage &b) {
+  return a.index == b.index
+      && a.code == b.code
+      && a.abs_relocs == b.abs_relocs
+      && a.rel_relocs == b.rel_relocs
+      && a.data_relocs == b.data_relocs
+      && a.start == b.start
+      && a.instr_map == b.instr_map
+      && a.call_sites == b.call_sites;
+}
+
+struct CompileImageTaskArgs {
+  CompileOutputAsmjit *output;
+  std::vector<CompilerAsmjit*> *compilers;
+  std::vector<CodeImage> *images;
+  std::vector<char> *results;
+};
+
+} // anonymous namespace
+
+CompileOutputAsmjit::CompileOutputAsmjit(AMXRef amx,
+                                         const FunctionTable &functions):
+  amx_(amx),
+  functions_(functions),
+  rib_(new RuntimeInfoBlock()),
+  runtime_(),
+  shared_(),
+  linked_(false),
+  from_cache_(false),
+  fallback_exec_(),
+  code_size_(),
+  map_all_instrs_(false),
+  reads_code_address_(false),
+  check_code_writes_(false),
+  num_instrs_(),
+  num_shared_(),
+  bytes_saved_(),
+  refs_(1),
+  compiler_(),
+  interpreter_(),
+  threshold_(),
+  optimizer_(),
+  optimizing_compiler_(),
+  hotness_limit_(),
+  background_optimization_(true),
+  num_optimized_(),
+  worker_(),
+  stop_(false)
+{
+  rib_->amx = reinterpret_cast<intptr_t>(amx.raw());
+  rib_->output = this;
+  public_starts_.resize(amx.num_publics() + 1);
+  rib_->public_starts = reinterpret_cast<intptr_t>(&public_starts_[0]);
+  rib_->num_public_starts = static_cast<intptr_t>(public_starts_.size());
+  FindTableTargets();
+  FindConstantPublics();
+}
+
+CompileOutputAsmjit::~CompileOutputAsmjit() {
+  if (worker_ != 0) {
+    {
+      ScopedLock lock(mutex_);
+      stop_ = true;
+    }
+    work_event_.Set();
+    worker_->Join();
+    delete worker_;
+  }
+  for (std::size_t i = 0; i < finished_.size(); i++) {
+    FreeCode(finished_[i]->code);
+    delete finished_[i];
+  }
+  delete optimizing_compiler_;
+  delete optimizer_;
+  delete interpreter_;
+  delete compiler_;
+  for (std::size_t i = 0; i < code_.size(); i++) {
+    FreeCode(code_[i]);
+  }
+  if (runtime_ != 0) {
+    FreeCode(runtime_);
+  }
+  if (!pooled_.empty()) {
+    ScopedLock lock(function_pool_mutex);
+    for (std::size_t i = 0; i < pooled_.size(); i++) {
+      ReleasePooledFunction(pooled_[i]);
+    }
+  }
+  delete shared_;
+  delete rib_;
+}
+
+void *CompileOutputAsmjit::GetCode() const {
+  return runtime_;
+}
+
+std::size_t CompileOutputAsmjit::GetCodeSize() const {
+  return code_size_;
+}
+
+EntryPoint CompileOutputAsmjit::GetEntryPoint() const {
+  return reinterpret_cast<EntryPoint>(rib_->exec);
+}
+
+bool CompileOutputAsmjit::IsFromCache() const {
+  return from_cache_;
+}
+
+void CompileOutputAsmjit::GetInstrTableSize(std::size_t &size,
+                                            std::size_t &full_size) const {
+  size = instr_table_.capacity() * sizeof(InstrTableEntry)
+       + table_targets_.capacity() / 8;
+  full_size = num_instrs_ * sizeof(InstrTableEntry);
+}
+
+void CompileOutputAsmjit::GetDedupeStats(int &num_shared,
+                                         int &num_functions,
+                                         std::size_t &bytes_saved) const {
+  num_shared = num_shared_;
+  num_functions = functions_.num_functions();
+  bytes_saved = bytes_saved_;
+}
+
+void CompileOutputAsmjit::GetTierStats(int &num_interpreted,
+                                       int &num_compiled,
+                                       int &num_optimized) const {
+  num_interpreted = num_compiled = num_optimized = 0;
+  if (compiler_ == 0) {
+    return;
+  }
+  num_interpreted = interpreter_->GetNumInterpreted();
+  num_optimized = num_optimized_;
+  for (std::size_t i = 0; i < compiled_.size(); i++) {
+    if (compiled_[i] != 0) {
+      num_compiled++;
+    }
+  }
+}
+
+bool CompileOutputAsmjit::GetConstantResult(int index, cell &value) const {
+  if (index < AMX_EXEC_MAIN
+      || index + 1 >= static_cast<int>(constant_publics_.size())
+      || constant_publics_[index + 1] < 0) {
+    return false;
+  }
+  value = functions_.GetFunction(constant_publics_[index + 1])
+            .constant_value();
+  return true;
+}
+
+CompileOutput *CompileOutputAsmjit::Clone(AMXRef amx) {
+  // Tiered code and code shared with other processes refer to the state
+  // of this script.
+  if (compiler_ != 0 || shared_ != 0) {
+    return 0;
+  }
+  CloneOutputAsmjit *clone = new CloneOutputAsmjit(this, amx);
+  if (!clone->Init()) {
+    delete clone;
+    return 0;
+  }
+  return clone;
+}
+
+void CompileOutputAsmjit::Delete() {
+  if (--refs_ == 0) {
+    delete this;
+  }
+}
+
+void *CompileOutputAsmjit::GetInstrStart(cell address) {
+  if (compiler_ != 0) {
+    int index = functions_.FindFunction(address);
+    if (index < 0 || CompileFunction(index) == 0) {
+      return 0;
+    }
+  }
+
+  return FindInstrStart(address);
+}
+
+void *CompileOutputAsmjit::GetFunctionStart(cell address) {
+  if (compiler_ == 0) {
+    return GetInstrStart(address);
+  }
+
+  // This is called on each Exec, before any code runs.
+  InstallOptimizedCode();
+
+  int index = functions_.FindFunction(address);
+  if (index < 0 || functions_.GetFunction(index).address() != address) {
+    return 0;
+  }
+  return entry_table_[index];
+}
+
+void *CompileOutputAsmjit::GetPublicStart(int index) {
+  cell address = amx_.GetPublicAddress(index);
+  if (address == 0) {
+    return 0;
+  }
+
+  void *start = GetFunctionStart(address);
+
+  // In tiered mode each Exec must go through GetFunctionStart() to install
+  // optimized code.
+  if (start != 0 && compiler_ == 0) {
+    public_starts_[index + 1] = start;
+  }
+  return start;
+}
+
+void *CompileOutputAsmjit::EnterFunction(int index) {
+  calls_[index]++;
+
+  void *start = compiled_[index];
+  if (start == 0 && ShouldCompile(index)) {
+    start = CompileFunction(index);
+  }
+  if (start != 0) {
+    return start;
+  }
+
+  cell return_address;
+  int error = interpreter_->Call(index, return_address);
+  if (return_address == 0) {
+    amx_.raw()->error = error;
+    return 0;
+  }
+  return reinterpret_cast<void*>(return_address);
+}
+
+void *CompileOutputAsmjit::RunInInterpreter(AMXRef amx, int index) {
+  AMX *raw = amx.raw();
+  unsigned char *data = amx.data();
+  const Function &function = functions_.GetFunction(index);
+
+  // Pop the native return address pushed by the caller.
+  cell stk = raw->stk;
+  cell return_address = *reinterpret_cast<cell*>(data + stk);
+  stk += sizeof(cell);
+
+  // Compiled code doesn't push the argument size before calling a private
+  // function, but RETN needs it.
+  if (function.is_private()) {
+    stk -= sizeof(cell);
+    *reinterpret_cast<cell*>(data + stk) = function.arg_size();
+  }
+  cell stk_after = stk + sizeof(cell) + *reinterpret_cast<cell*>(data + stk);
+
+  // The function returns to address 0, which holds HALT 0, and the
+  // interpreter returns from amx_Exec() at that point.
+  stk -= sizeof(cell);
+  *reinterpret_cast<cell*>(data + stk) = 0;
+
+  raw->stk = stk;
+  raw->cip = function.address();
+  raw->reset_stk = stk_after;
+  raw->reset_hea = raw->hea;
+
+  cell retval = 0;
+  int error = fallback_exec_(raw, &retval, AMX_EXEC_CONT);
+  raw->pri = retval;
+  raw->stk = stk_after;
+
+  // HALT 0 elsewhere in the code (e.g. exit) ends the script.
+  if (error != AMX_ERR_NONE
+      || raw->cip != static_cast<cell>(2 * sizeof(cell))) {
+    raw->error = error;
+    return 0;
+  }
+  return reinterpret_cast<void*>(return_address);
+}
+
+void CompileOutputAsmjit::OnCodeWrite(cell address, cell size) {
+  // Convert the address to an offset into the code section.
+  cell start = address + static_cast<cell>(amx_.data() - amx_.code());
+  cell end = start + size;
+  if (end <= 0 || start >= static_cast<cell>(amx_.code_size())) {
+    return;
+  }
+
+  int index = functions_.FindFunction(start > 0 ? start : 0);
+  if (index < 0) {
+    index = 0; // before the first function
+  }
+  for (; index < functions_.num_functions()
+         && functions_.GetFunction(index).address() < end; index++) {
+    InvalidateFunction(index);
+  }
+}
+
+void CompileOutputAsmjit::InvalidateFunction(int index) {
+  std::size_t num_functions = functions_.num_functions();
+  if (modified_.empty()) {
+    modified_.resize(num_functions, kUnmodified);
+    entries_.resize(num_functions);
+    recompile_stubs_.resize(num_functions, 0);
+  }
+  if (modified_[index] == kModified) {
+    return;
+  }
+
+  if (entries_[index].empty()) {
+    void *start = FindInstrStart(functions_.GetFunction(index).address());
+    if (start == 0) {
+      return;
+    }
+    entries_[index].push_back(static_cast<unsigned char*>(start));
+  }
+
+  if (recompile_stubs_[index] == 0) {
+    asmjit::X86Assembler as(&jit_runtime);
+    as.mov(edx, index);
+    as.jmp(CodePtr(shared_runtime.recompile_helper));
+    void *stub = MakeCode(as, false);
+    if (stub == 0) {
+      return;
+    }
+    code_.push_back(stub);
+    recompile_stubs_[index] = stub;
+  }
+
+  // The function may still be running: the rest of its old code stays
+  // intact, only the next call goes to the new code.
+  const std::vector<unsigned char*> &entries = entries_[index];
+  for (std::size_t i = 0; i < entries.size(); i++) {
+    PatchJump(entries[i], recompile_stubs_[index]);
+  }
+  modified_[index] = kModified;
+}
+
+void *CompileOutputAsmjit::EnterModifiedFunction(AMXRef amx, int index) {
+  if (modified_[index] == kModified) {
+    void *start = RecompileFunction(index);
+    if (start != 0) {
+      return start;
+    }
+    modified_[index] = kInterpreted;
+  }
+  if (fallback_exec_ != 0) {
+    return RunInInterpreter(amx, index);
+  }
+  amx.raw()->error = AMX_ERR_INVINSTR;
+  return 0;
+}
+
+void *CompileOutputAsmjit::RecompileFunction(int index) {
+  CompilerAsmjit compiler;
+  CodeImage image;
+
+  stubs_.resize(functions_.num_functions(), static_cast<void*>(0));
+  bool ok = compiler.CompileImage(this, index, image);
+  stubs_.clear();
+  if (!ok) {
+    return 0;
+  }
+
+  unsigned char *code =
+    static_cast<unsigned char*>(AllocCode(image.code.size(), false));
+  if (code == 0) {
+    return 0;
+  }
+  CopyImage(image, code);
+  UseCurrentAmx(code, image.data_relocs, rib_);
+
+  for (std::size_t i = 0; i < image.call_sites.size(); i++) {
+    const CallSite &site = image.call_sites[i];
+    void *callee =
+      FindInstrStart(functions_.GetFunction(site.second).address());
+    if (callee == 0) {
+      FreeCode(code);
+      return 0;
+    }
+    PatchCall(code + site.first, callee);
+  }
+
+  // Jumps and returns through the instruction table go to the new code.
+  const Function &f = functions_.GetFunction(index);
+  std::vector<InstrTableEntry>::iterator first =
+    std::lower_bound(instr_table_.begin(), instr_table_.end(),
+                     InstrTableEntry(f.address()));
+  std::vector<InstrTableEntry>::iterator last =
+    std::lower_bound(first, instr_table_.end(),
+                     InstrTableEntry(f.end_address()));
+  instr_table_.erase(first, last);
+  code_.push_back(code);
+  AddCode(code, image.code.size(), image.instr_map);
+
+  unsigned char *start = code + image.start;
+  std::vector<unsigned char*> &entries = entries_[index];
+  for (std::size_t i = 0; i < entries.size(); i++) {
+    PatchJump(entries[i], start);
+  }
+  entries.push_back(start);
+  modified_[index] = kUnmodified;
+
+  return start;
+}
+
+void CompileOutputAsmjit::EnableTiering(CompilerAsmjit *compiler,
+                                        int threshold,
+                                        bool background_optimization) {
+  compiler_ = compiler;
+  threshold_ = threshold;
+  background_optimization_ = background_optimization;
+
+  interpreter_ = new Interpreter(amx_, functions_, this);
+  interpreter_->SetErrorHandler(compiler->GetErrorHandler());
+  interpreter_->SetOSRThreshold(threshold * kBackEdgesPerCall);
+
+  std::size_t num_functions = functions_.num_functions();
+  compiled_.resize(num_functions, 0);
+  call_sites_.resize(num_functions);
+  calls_.resize(num_functions, 0);
+  failed_.resize(num_functions, false);
+
+  optimizer_ = new Optimizer(amx_, functions_);
+  if (optimizer_->CanOptimize()) {
+    optimizing_compiler_ = new CompilerAsmjit;
+    hotness_.resize(num_functions, 0);
+    ready_.resize(num_functions, 0);
+    hotness_limit_ = threshold * kHotnessPerCall;
+  }
+}
+
+void CompileOutputAsmjit::AddCode(
+    void *code,
+    std::size_t size,
+    const std::map<cell, std::ptrdiff_t> &instr_map) {
+  code_size_ += size;
+
+  std::size_t old_size = instr_table_.size();
+  for (std::map<cell, std::ptrdiff_t>::const_iterator it = instr_map.begin();
+       it != instr_map.end(); it++) {
+    if (!IsTableTarget(it->first)) {
+      continue;
+    }
+    InstrTableEntry entry(it->first);
+    entry.start = static_cast<unsigned char*>(code) + it->second;
+    instr_table_.push_back(entry);
+  }
+
+  std::inplace_merge(instr_table_.begin(),
+                     instr_table_.begin() + old_size,
+                     instr_table_.end());
+}
+
+void CompileOutputAsmjit::FindTableTargets() {
+  unsigned char *code = amx_.code();
+  table_targets_.assign(amx_.code_size() / sizeof(cell) + 1, false);
+
+  Disassembler disasm(amx_);
+  Instruction instr;
+  std::vector<cell> targets;
+
+  while (disasm.Decode(instr)) {
+    num_instrs_++;
+    switch (instr.opcode().GetId()) {
+      case OP_PROC:
+        targets.push_back(instr.address());
+        break;
+      case OP_CALL:
+        // Interpreted code may return to the compiled caller.
+        targets.push_back(instr.address() + instr.size());
+        targets.push_back(instr.operand() - reinterpret_cast<cell>(code));
+        break;
+      case OP_CALL_PRI:
+        targets.push_back(instr.address() + instr.size());
+        break;
+      case OP_CONST_PRI:
+      case OP_CONST_ALT:
+      case OP_PUSH_C:
+        // Code addresses taken with #emit.
+        targets.push_back(instr.operand());
+        break;
+      case OP_PUSH2_C:
+      case OP_PUSH3_C:
+      case OP_PUSH4_C:
+      case OP_PUSH5_C:
+        targets.insert(targets.end(), instr.operands().begin(),
+                       instr.operands().end());
+        break;
+      case OP_CONST:
+      case OP_CONST_S:
+        // The value stored to a variable may be a code address too.
+        targets.push_back(instr.operand(1));
+        break;
+      case OP_LCTRL:
+        // The CIP can be used to compute anything, so map everything. So
+        // can COD and DAT: the script may scan its own code and jump to
+        // what it finds there.
+        if (instr.operand() == 6) {
+          map_all_instrs_ = true;
+        }
+        if (instr.operand() == 0 || instr.operand() == 1) {
+          reads_code_address_ = true;
+          map_all_instrs_ = true;
+        }
+        break;
+      case OP_SWITCH: {
+        CaseTable case_table(amx_, instr.operand());
+        targets.push_back(case_table.GetDefaultAddress());
+        for (int i = 0; i < case_table.num_cases(); i++) {
+          targets.push_back(case_table.GetCaseAddress(i));
+        }
+        break;
+      }
+      case OP_JUMP_PRI:
+        break;
+      default:
+        // Loop headers are entered from the interpreter and by on-stack
+        // replacement.
+        if (instr.opcode().IsJump()) {
+          targets.push_back(GetJumpTarget(amx_, instr));
+        }
+    }
+  }
+
+  for (std::size_t i = 0; i < targets.size(); i++) {
+    cell address = targets[i];
+    if (address >= 0
+        && address % sizeof(cell) == 0
+        && static_cast<std::size_t>(address) < amx_.code_size()) {
+      table_targets_[address / sizeof(cell)] = true;
+    }
+  }
+  if (map_all_instrs_) {
+    std::vector<bool>().swap(table_targets_);
+  }
+}
+
+bool CompileOutputAsmjit::IsTableTarget(cell address) const {
+  if (map_all_instrs_) {
+    return true;
+  }
+  std::size_t index = static_cast<std::size_t>(address) / sizeof(cell);
+  return address >= 0
+      && index < table_targets_.size()
+      && table_targets_[index];
+}
+
+void CompileOutputAsmjit::FindConstantPublics() {
+  constant_publics_.assign(amx_.num_publics() + 1, -1);
+
+  // A write to the code section could change what the function returns.
+  if (reads_code_address_) {
+    return;
+  }
+  for (int i = AMX_EXEC_MAIN; i < amx_.num_publics(); i++) {
+    cell address = amx_.GetPublicAddress(i);
+    if (address == 0) {
+      continue;
+    }
+    int index = functions_.FindFunction(address);
+    if (index >= 0
+        && functions_.GetFunction(index).address() == address
+        && functions_.GetFunction(index).returns_constant()) {
+      constant_publics_[i + 1] = index;
+    }
+  }
+}
+
+bool CompileOutputAsmjit::Link(const std::vector<CodeImage> &images,
+                               bool dedupe) {
+  std::vector<unsigned char*> bases(images.size(),
+                                    static_cast<unsigned char*>(0));
+  if (dedupe) {
+    PoolImages(images, bases);
+  }
+
+  std::vector<std::size_t> offsets;
+  std::size_t size = LayOutImages(images, bases, offsets);
+
+  unsigned char *code = 0;
+  if (size > 0) {
+    code = static_cast<unsigned char*>(AllocCode(size, false));
+    if (code == 0) {
+      return false;
+    }
+    code_.push_back(code);
+  }
+
+  std::vector<bool> pooled(images.size());
+  for (std::size_t i = 0; i < images.size(); i++) {
+    pooled[i] = bases[i] != 0;
+  }
+
+  LinkImages(images, offsets, code, bases);
+  for (std::size_t i = 0; i < images.size(); i++) {
+    if (!pooled[i]) {
+      UseCurrentAmx(bases[i], images[i].data_relocs, rib_);
+    }
+    AddCode(bases[i], images[i].code.size(), images[i].instr_map);
+  }
+
+  linked_ = true;
+  return true;
+}
+
+bool CompileOutputAsmjit::LinkShared(const std::vector<CodeImage> &images,
+                                     SharedCode *shared) {
+  std::vector<unsigned char*> bases(images.size(),
+                                    static_cast<unsigned char*>(0));
+  std::vector<std::size_t> offsets;
+  std::size_t size = LayOutImages(images, bases, offsets);
+  if (!shared->Create(size)) {
+    return false;
+  }
+
+  unsigned char *code = shared->code();
+  unsigned char *local = shared->local();
+  LinkImages(images, offsets, code, bases);
+
+  // The code must look the same in every process, so anything outside of
+  // it is accessed through the local area, which is at the same address
+  // everywhere but has different contents.
+  std::vector<intptr_t> symbols = GetSymbols();
+  intptr_t data = reinterpret_cast<intptr_t>(rib_);
+
+  for (std::size_t i = 0; i < images.size(); i++) {
+    const CodeImage &image = images[i];
+    unsigned char *base = code + offsets[i];
+
+    for (std::size_t j = 0; j < image.rel_relocs.size(); j++) {
+      unsigned char *ptr = base + image.rel_relocs[j];
+      int32_t value;
+      std::memcpy(&value, ptr, sizeof(value));
+      unsigned char *target = ptr + sizeof(value) + value;
+      if (target >= code && target < code + size) {
+        continue; // a call to another function
+      }
+      std::vector<intptr_t>::const_iterator it =
+        std::find(symbols.begin(), symbols.end(),
+                  reinterpret_cast<intptr_t>(target));
+      if (it == symbols.end()) {
+        return false;
+      }
+      unsigned char *jump = local + (it - symbols.begin()) * kLocalJumpSize;
+      AddToInt32(ptr, jump - target);
+    }
+
+    for (std::size_t j = 0; j < image.data_relocs.size(); j++) {
+      unsigned char *ptr = base + image.data_relocs[j];
+      int32_t value;
+      std::memcpy(&value, ptr, sizeof(value));
+      if (value < data
+          || value >= data + static_cast<intptr_t>(sizeof(*rib_))) {
+        return false;
+      }
+      AddToInt32(ptr, reinterpret_cast<intptr_t>(local)
+                      + kLocalDataOffset - data);
+    }
+  }
+
+  if (!SetUpLocalArea(shared)) {
+    return false;
+  }
+
+  std::vector<unsigned char> metadata;
+  for (std::size_t i = 0; i < images.size(); i++) {
+    const CodeImage &image = images[i];
+    for (std::map<cell, std::ptrdiff_t>::const_iterator it =
+           image.instr_map.begin(); it != image.instr_map.end(); it++) {
+      int32_t entry[2] = {
+        static_cast<int32_t>(it->first),
+        static_cast<int32_t>(offsets[i] + it->second)
+      };
+      const unsigned char *bytes =
+        reinterpret_cast<const unsigned char*>(entry);
+      metadata.insert(metadata.end(), bytes, bytes + sizeof(entry));
+    }
+    AddCode(code + offsets[i], image.code.size(), image.instr_map);
+  }
+
+  // Even if it can't be published the code is still good for this process.
+  shared->Publish(metadata);
+  shared_ = shared;
+
+  return true;
+}
+
+bool CompileOutputAsmjit::AttachShared(SharedCode *shared) {
+  std::vector<unsigned char> metadata;
+  if (!shared->Attach(metadata)
+      || metadata.size() % (2 * sizeof(int32_t)) != 0) {
+    return false;
+  }
+
+  std::map<cell, std::ptrdiff_t> instr_map;
+  for (std::size_t i = 0; i < metadata.size(); i += 2 * sizeof(int32_t)) {
+    int32_t entry[2];
+    std::memcpy(entry, &metadata[i], sizeof(entry));
+    if (entry[1] < 0
+        || static_cast<std::size_t>(entry[1]) >= shared->size()) {
+      return false;
+    }
+    instr_map[entry[0]] = entry[1];
+  }
+
+  if (!SetUpLocalArea(shared)) {
+    return false;
+  }
+
+  AddCode(shared->code(), shared->size(), instr_map);
+  shared_ = shared;
+
+  return true;
+}
+
+std::size_t CompileOutputAsmjit::LayOutImages(
+    const std::vector<CodeImage> &images,
+    const std::vector<unsigned char*> &bases,
+    std::vector<std::size_t> &offsets) const {
+  offsets.assign(images.size(), 0);
+  std::size_t size = 0;
+  for (std::size_t i = 0; i < images.size(); i++) {
+    if (bases[i] != 0) {
+      continue;
+    }
+    size = (size + 15) & ~static_cast<std::size_t>(15);
+    offsets[i] = size;
+    size += images[i].code.size();
+  }
+  return size;
+}
+
+void CompileOutputAsmjit::LinkImages(const std::vector<CodeImage> &images,
+                                     const std::vector<std::size_t> &offsets,
+                                     unsigned char *code,
+                                     std::vector<unsigned char*> &bases) {
+  std::vector<bool> linked(images.size(), false);
+  for (std::size_t i = 0; i < images.size(); i++) {
+    if (bases[i] == 0) {
+      bases[i] = code + offsets[i];
+      CopyImage(images[i], bases[i]);
+      linked[i] = true;
+    }
+  }
+
+  std::vector<void*> starts(functions_.num_functions(),
+                           static_cast<void*>(0));
+  for (std::size_t i = 0; i < images.size(); i++) {
+    if (images[i].index >= 0) {
+      starts[images[i].index] = bases[i] + images[i].start;
+    }
+  }
+
+  // Pooled code has already been linked with its callees.
+  for (std::size_t i = 0; i < images.size(); i++) {
+    const CodeImage &image = images[i];
+    for (std::size_t j = 0; linked[i] && j < image.call_sites.size(); j++) {
+      const CallSite &site = image.call_sites[j];
+      assert(starts[site.second] != 0);
+      PatchCall(bases[i] + site.first, starts[site.second]);
+    }
+  }
+}
+
+bool CompileOutputAsmjit::SetUpLocalArea(SharedCode *shared) const {
+  unsigned char *local = shared->local();
+  std::vector<intptr_t> symbols = GetSymbols();
+  assert(symbols.size() * kLocalJumpSize <= kLocalDataOffset);
+  assert(kLocalDataOffset + sizeof(*rib_) <= SharedCode::kLocalSize);
+
+  for (std::size_t i = 0; i < symbols.size(); i++) {
+    unsigned char *jump = local + i * kLocalJumpSize;
+    int32_t offset = static_cast<int32_t>(
+      symbols[i] - reinterpret_cast<intptr_t>(jump + 5));
+    jump[0] = 0xE9; // jmp rel32
+    std::memcpy(jump + 1, &offset, sizeof(offset));
+  }
+
+  // Shared code only reads the AMX pointer (see EmitLoadAmx()).
+  RuntimeInfoBlock *data =
+    reinterpret_cast<RuntimeInfoBlock*>(local + kLocalDataOffset);
+  data->amx = rib_->amx;
+
+  return shared->ProtectLocal();
+}
+
+void CompileOutputAsmjit::PoolImages(const std::vector<CodeImage> &images,
+                                     std::vector<unsigned char*> &bases) {
+  int num_images = static_cast<int>(images.size());
+  std::vector<int> image_index(functions_.num_functions(), -1);
+  for (int i = 0; i < num_images; i++) {
+    if (images[i].index >= 0) {
+      image_index[images[i].index] = i;
+    }
+  }
+
+  std::vector<std::string> keys(num_images);
+  std::vector<uint64_t> hashes(num_images);
+  std::vector<int> state(num_images, 0);
+  std::vector<int> order;
+  for (int i = 0; i < num_images; i++) {
+    GetPoolKey(images, image_index, i, keys, hashes, state, order);
+  }
+
+  ScopedLock lock(function_pool_mutex);
+
+  for (std::size_t k = 0; k < order.size(); k++) {
+    int i = order[k];
+    const CodeImage &image = images[i];
+
+    // Pooled code can only call pooled code.
+    bool ok = !keys[i].empty();
+    for (std::size_t j = 0; ok && j < image.call_sites.size(); j++) {
+      ok = bases[image_index[image.call_sites[j].second]] != 0;
+    }
+    if (!ok) {
+      continue;
+    }
+
+    FunctionPool::iterator it = function_pool.find(hashes[i]);
+    if (it != function_pool.end()) {
+      if (it->second.key != keys[i]) {
+        continue; // hash collision
+      }
+      it->second.refs++;
+      num_shared_++;
+      bytes_saved_ += image.code.size();
+    } else {
+      unsigned char *code =
+        static_cast<unsigned char*>(AllocCode(image.code.size(), false));
+      if (code == 0) {
+        continue;
+      }
+      CopyImage(image, code);
+
+      UseCurrentAmx(code, image.data_relocs, rib_);
+
+      PooledFunction &function = function_pool[hashes[i]];
+      function.key = keys[i];
+      function.code = code;
+      function.refs = 1;
+      for (std::size_t j = 0; j < image.call_sites.size(); j++) {
+        const CallSite &site = image.call_sites[j];
+        int callee = image_index[site.second];
+        PatchCall(code + site.first, bases[callee] + images[callee].start);
+        function.callees.push_back(hashes[callee]);
+        function_pool[hashes[callee]].refs++;
+      }
+      it = function_pool.find(hashes[i]);
+    }
+
+    bases[i] = it->second.code;
+    pooled_.push_back(hashes[i]);
+  }
+}
+
+void CompileOutputAsmjit::GetPoolKey(const std::vector<CodeImage> &images,
+                                     const std::vector<int> &image_index,
+                                     int index,
+                                     std::vector<std::string> &keys,
+                                     std::vector<uint64_t> &hashes,
+                                     std::vector<int> &state,
+                                     std::vector<int> &order) const {
+  enum { kNotVisited, kVisiting, kVisited };
+
+  if (state[index] != kNotVisited) {
+    return;
+  }
+  state[index] = kVisiting;
+
+  const CodeImage &image = images[index];
+  bool ok = image.index >= 0;
+  std::string key;
+
+  if (ok) {
+    key.assign(image.code.begin(), image.code.end());
+
+    // References to the RIB become offsets within it.
+    intptr_t data = reinterpret_cast<intptr_t>(rib_);
+    for (std::size_t i = 0; ok && i < image.data_relocs.size(); i++) {
+      int32_t value;
+      std::memcpy(&value, &key[image.data_relocs[i]], sizeof(value));
+      ok = value == reinterpret_cast<intptr_t>(&rib_->amx);
+      value -= static_cast<int32_t>(data);
+      std::memcpy(&key[image.data_relocs[i]], &value, sizeof(value));
+      AppendToKey(key, image.data_relocs[i]);
+    }
+
+    // Calls are identified by the keys of the callees (recursive functions
+    // can't be shared).
+    for (std::size_t i = 0; ok && i < image.call_sites.size(); i++) {
+      const CallSite &site = image.call_sites[i];
+      int callee = image_index[site.second];
+      ok = callee >= 0;
+      if (ok) {
+        GetPoolKey(images, image_index, callee, keys, hashes, state, order);
+        ok = state[callee] == kVisited && !keys[callee].empty();
+      }
+      if (ok) {
+        std::memset(&key[site.first - sizeof(int32_t)], 0, sizeof(int32_t));
+        AppendToKey(key, site.first);
+        AppendToKey(key, hashes[callee]);
+      }
+    }
 
-asmjit::JitRuntime jit_runtime;
+    for (std::size_t i = 0; i < image.abs_relocs.size(); i++) {
+      AppendToKey(key, image.abs_relocs[i]);
+    }
+    for (std::size_t i = 0; i < image.rel_relocs.size(); i++) {
+      AppendToKey(key, image.rel_relocs[i]);
+    }
 
-struct RuntimeInfoBlock {
-  intptr_t exec;
-  intptr_t amx;
-  intptr_t ebp;
-  intptr_t esp;
-  intptr_t reset_ebp;
-  intptr_t reset_esp;
-  intptr_t instr_table;
-  intptr_t instr_table_size;
-};
+    // The instruction table must look the same relative to the function.
+    cell address = functions_.GetFunction(image.index).address();
+    for (std::map<cell, std::ptrdiff_t>::const_iterator it =
+           image.instr_map.begin(); it != image.instr_map.end(); it++) {
+      AppendToKey(key, it->first - address);
+      AppendToKey(key, it->second);
+    }
+    AppendToKey(key, image.start);
+  }
+
+  if (ok) {
+    keys[index].swap(key);
+    hashes[index] = HashKey(keys[index]);
+  }
+  state[index] = kVisited;
+  order.push_back(index);
+}
+
+std::vector<intptr_t> CompileOutputAsmjit::GetSymbols() const {
+  std::vector<intptr_t> symbols;
+  symbols.push_back(rib_->exec_helper);
+  symbols.push_back(rib_->call_helper);
+  symbols.push_back(rib_->halt_helper);
+  symbols.push_back(rib_->jump_helper);
+  symbols.push_back(rib_->sysreq_c_helper);
+  symbols.push_back(rib_->sysreq_d_helper);
+  symbols.push_back(rib_->code_write_helper);
+  return symbols;
+}
+
+void CompileOutputAsmjit::Install(CompiledFunction *function) {
+  const Function &f = functions_.GetFunction(function->index);
+
+  // Forget about the previous version of the function's code, if any.
+  std::vector<InstrTableEntry>::iterator first =
+    std::lower_bound(instr_table_.begin(), instr_table_.end(),
+                     InstrTableEntry(f.address()));
+  std::vector<InstrTableEntry>::iterator last =
+    std::lower_bound(first, instr_table_.end(),
+                     InstrTableEntry(f.end_address()));
+  instr_table_.erase(first, last);
+
+  code_.push_back(function->code);
+  AddCode(function->code, function->size, function->instr_map);
+  compiled_[function->index] = function->start;
+  entry_table_[function->index] = function->start;
+  if (!ready_.empty()) {
+    ready_[function->index] = 0;
+  }
+
+  // Link the new code with the already compiled functions and make
+  // everything that called the old version call the new one.
+  for (std::size_t i = 0; i < function->call_sites.size(); i++) {
+    const CallSite &site = function->call_sites[i];
+    unsigned char *call_end =
+      static_cast<unsigned char*>(function->code) + site.first;
+    call_sites_[site.second].push_back(call_end);
+    if (compiled_[site.second] != 0) {
+      PatchCall(call_end, compiled_[site.second]);
+    }
+  }
+  const std::vector<unsigned char*> &callers = call_sites_[function->index];
+  for (std::size_t i = 0; i < callers.size(); i++) {
+    PatchCall(callers[i], function->start);
+  }
 
-cell AMXJIT_CDECL GetPublicAddress(AMX *amx, int index) {
-  return AMXRef(amx).GetPublicAddress(index);
+  delete function;
 }
 
-cell AMXJIT_CDECL GetNativeAddress(AMX *amx, int index) {
-  return AMXRef(amx).GetNativeAddress(index);
+void CompileOutputAsmjit::PatchCall(unsigned char *call_end, void *target) {
+  // This is the rel32 operand of a CALL instruction. The write is safe
+  // because code only runs on the thread that is doing it.
+  int32_t offset = static_cast<int32_t>(
+    static_cast<unsigned char*>(target) - call_end);
+  std::memcpy(GetWritable(call_end - sizeof(offset)),
+              &offset,
+              sizeof(offset));
 }
 
-class InstrTableEntry {
- public:
-  InstrTableEntry(): address(), start() {}
-  InstrTableEntry(cell address): address(address), start() {}
-  bool operator<(const InstrTableEntry &other) const {
-    return address < other.address;
+void *CompileOutputAsmjit::CompileFunction(int index) {
+  if (compiled_[index] == 0 && !failed_[index]) {
+    CompiledFunction *function = compiler_->CompileFunction(this, index,
+                                                            false);
+    if (function != 0) {
+      Install(function);
+    } else {
+      // Keep running it in the interpreter.
+      failed_[index] = true;
+    }
   }
- public:
-  cell address;
-  void *start;
-};
-
-void *AMXJIT_CDECL GetInstrStartPtr(cell address, RuntimeInfoBlock *rib) {
-  assert(rib->instr_table != 0);
-  assert(rib->instr_table_size > 0);
+  return compiled_[index];
+}
 
-  InstrTableEntry *instr_table =
-    reinterpret_cast<InstrTableEntry*>(rib->instr_table);
+void *CompileOutputAsmjit::FindInstrStart(cell address) const {
   InstrTableEntry target(address);
-
-  std::pair<InstrTableEntry*, InstrTableEntry*> result =
-    std::equal_range(instr_table, instr_table + rib->instr_table_size, target);
+  std::pair<std::vector<InstrTableEntry>::const_iterator,
+            std::vector<InstrTableEntry>::const_iterator> result =
+    std::equal_range(instr_table_.begin(), instr_table_.end(), target);
   if (result.first != result.second) {
     return result.first->start;
   }
   return 0;
 }
 
-class AsmJitLoggerAdapter: public asmjit::Logger {
- public:
-  AsmJitLoggerAdapter(amxjit::Logger *logger):
-    logger_(logger) {}
-  virtual void logString(uint32_t style,
-                         const char* buf,
-                         size_t len = asmjit::kInvalidIndex) {
-    assert(logger_ != 0);
-    if (len == asmjit::kInvalidIndex) {
-      logger_->Write(buf);
-    } else {
-      std::string tmp_buf(buf, len);
-      logger_->Write(tmp_buf.c_str());
+bool CompileOutputAsmjit::ShouldCompile(int index) const {
+  return !failed_[index]
+      && (calls_[index] >= threshold_
+          || interpreter_->GetBackEdgeCount(index)
+               >= threshold_ * kBackEdgesPerCall);
+}
+
+void CompileOutputAsmjit::RequestOptimization(int index) {
+  if (!background_optimization_) {
+    // The code is installed at the same points as with the worker thread:
+    // on the next Exec or when a loop checks ready_.
+    CompiledFunction *function =
+      optimizing_compiler_->CompileFunction(this, index, true);
+    if (function != 0) {
+      finished_.push_back(function);
+      ready_[index] = 1;
     }
+    return;
   }
- private:
-  amxjit::Logger *logger_;
-};
 
-} // anonymous namespace
+  ScopedLock lock(mutex_);
+  if (worker_ == 0) {
+    worker_ = new Thread(RunWorker, this);
+  }
+  queue_.push_back(index);
+  work_event_.Set();
+}
+
+void CompileOutputAsmjit::InstallOptimizedCode() {
+  if (worker_ == 0 && finished_.empty()) {
+    return;
+  }
+
+  std::vector<CompiledFunction*> finished;
+  {
+    ScopedLock lock(mutex_);
+    finished.swap(finished_);
+  }
+
+  for (std::size_t i = 0; i < finished.size(); i++) {
+    Install(finished[i]);
+  }
+  num_optimized_ += static_cast<int>(finished.size());
+}
+
+void *CompileOutputAsmjit::EnterOptimizedCode(int index, cell address) {
+  InstallOptimizedCode();
+  return FindInstrStart(address);
+}
 
-CompileOutputAsmjit::CompileOutputAsmjit(void *code):
-  code_(code)
+void CompileOutputAsmjit::RunWorker(void *arg) {
+  static_cast<CompileOutputAsmjit*>(arg)->OptimizeFunctions();
+}
+
+void CompileOutputAsmjit::OptimizeFunctions() {
+  for (;;) {
+    int index = -1;
+    {
+      ScopedLock lock(mutex_);
+      if (stop_) {
+        break;
+      }
+      if (!queue_.empty()) {
+        index = queue_.front();
+        queue_.pop_front();
+      }
+    }
+
+    if (index < 0) {
+      work_event_.Wait();
+      continue;
+    }
+
+    // If this fails the function simply stays at the baseline tier.
+    CompiledFunction *function =
+      optimizing_compiler_->CompileFunction(this, index, true);
+    if (function != 0) {
+      ScopedLock lock(mutex_);
+      finished_.push_back(function);
+      ready_[index] = 1;
+    }
+  }
+}
+
+void *CompileOutputAsmjit::GetCompiledCode(cell address) {
+  return GetInstrStart(address);
+}
+
+bool CompileOutputAsmjit::Call(int index, bool &halted) {
+  calls_[index]++;
+
+  void *start = compiled_[index];
+  if (start == 0 && ShouldCompile(index)) {
+    start = CompileFunction(index);
+  }
+  if (start == 0) {
+    return false;
+  }
+
+  CallHelper call_helper = reinterpret_cast<CallHelper>(rib_->call_helper);
+  RuntimeInfoBlock *prev_rib = current_rib;
+  intptr_t prev_amx = current_amx;
+  current_rib = rib_;
+  current_amx = rib_->amx;
+  rib_->halted = 0;
+  amx_.raw()->pri = call_helper(start);
+  halted = rib_->halted != 0;
+  current_rib = prev_rib;
+  current_amx = prev_amx;
+
+  return true;
+}
+
+CloneOutputAsmjit::CloneOutputAsmjit(CompileOutputAsmjit *output,
+                                     AMXRef amx):
+  output_(output),
+  rib_(new RuntimeInfoBlock(*output->rib_)),
+  exec_()
 {
-  assert(code_ != 0);
+  output_->refs_++;
+
+  // The helpers are the same, and instruction lookups still go to the
+  // output that owns the code.
+  rib_->amx = reinterpret_cast<intptr_t>(amx.raw());
+  rib_->ebp = 0;
+  rib_->esp = 0;
+  rib_->reset_ebp = 0;
+  rib_->reset_esp = 0;
+  rib_->halted = 0;
+  rib_->data = 0;
+}
+
+CloneOutputAsmjit::~CloneOutputAsmjit() {
+  if (exec_ != 0) {
+    FreeCode(exec_);
+  }
+  delete rib_;
+  output_->Delete();
 }
 
-CompileOutputAsmjit::~CompileOutputAsmjit() {
-  jit_runtime.release(code_);
+bool CloneOutputAsmjit::Init() {
+  asmjit::X86Assembler as(&jit_runtime);
+  as.mov(eax, asmjit::imm_ptr(rib_));
+  as.jmp(CodePtr(shared_runtime.exec));
+
+  exec_ = MakeCode(as, true);
+  if (exec_ == 0) {
+    return false;
+  }
+  rib_->exec = reinterpret_cast<intptr_t>(exec_);
+  return true;
 }
 
-void *CompileOutputAsmjit::GetCode() const {
-  return code_;
+void *CloneOutputAsmjit::GetCode() const {
+  return output_->GetCode();
 }
 
-EntryPoint CompileOutputAsmjit::GetEntryPoint() const {
-  return (EntryPoint)*reinterpret_cast<void**>(GetCode());
+std::size_t CloneOutputAsmjit::GetCodeSize() const {
+  return output_->GetCodeSize();
 }
 
-void CompileOutputAsmjit::Delete() {
+EntryPoint CloneOutputAsmjit::GetEntryPoint() const {
+  return reinterpret_cast<EntryPoint>(rib_->exec);
+}
+
+bool CloneOutputAsmjit::IsFromCache() const {
+  return output_->IsFromCache();
+}
+
+void CloneOutputAsmjit::GetInstrTableSize(std::size_t &size,
+                                          std::size_t &full_size) const {
+  output_->GetInstrTableSize(size, full_size);
+}
+
+void CloneOutputAsmjit::GetDedupeStats(int &num_shared,
+                                       int &num_functions,
+                                       std::size_t &bytes_saved) const {
+  output_->GetDedupeStats(num_shared, num_functions, bytes_saved);
+}
+
+CompileOutput *CloneOutputAsmjit::Clone(AMXRef amx) {
+  return output_->Clone(amx);
+}
+
+void CloneOutputAsmjit::GetTierStats(int &num_interpreted,
+                                     int &num_compiled,
+                                     int &num_optimized) const {
+  output_->GetTierStats(num_interpreted, num_compiled, num_optimized);
+}
+
+bool CloneOutputAsmjit::GetConstantResult(int index, cell &value) const {
+  return output_->GetConstantResult(index, value);
+}
+
+void CloneOutputAsmjit::Delete() {
   delete this;
 }
 
 CompilerAsmjit::CompilerAsmjit():
+  functions_(),
+  output_(),
+  rib_(),
+  function_(-1),
+  optimize_(false),
+  error_(false),
+  cip_(0),
   asm_(&jit_runtime),
-  rib_start_label_(asm_.newLabel()),
-  exec_ptr_label_(asm_.newLabel()),
-  amx_ptr_label_(asm_.newLabel()),
-  ebp_label_(asm_.newLabel()),
-  esp_label_(asm_.newLabel()),
-  reset_ebp_label_(asm_.newLabel()),
-  reset_esp_label_(asm_.newLabel()),
-  exec_label_(asm_.newLabel()),
-  exec_helper_label_(asm_.newLabel()),
-  halt_helper_label_(asm_.newLabel()),
-  jump_helper_label_(asm_.newLabel()),
-  sysreq_c_helper_label_(asm_.newLabel()),
-  sysreq_d_helper_label_(asm_.newLabel()),
   logger_()
 {
 }
@@ -170,29 +1560,368 @@ CompilerAsmjit::CompilerAsmjit():
 CompilerAsmjit::~CompilerAsmjit() {
 }
 
-bool CompilerAsmjit::Prepare(AMXRef amx) {
-  amx_ = amx;
+bool CompilerAsmjit::SetUpCodeArena(std::size_t size, bool huge_pages) {
+  return code_arena.Init(size, huge_pages);
+}
 
-  EmitRuntimeInfo();
-  EmitInstrTable();
-  EmitExec();
-  EmitExecHelper();
-  EmitHaltHelper();
-  EmitJumpHelper();
-  EmitSysreqCHelper();
-  EmitSysreqDHelper();
+CompiledFunction *CompilerAsmjit::CompileFunction(
+    CompileOutputAsmjit *output,
+    int index,
+    bool optimize) {
+  void *code = 0;
+  if (EmitFunction(output, index, optimize)) {
+    code = MakeCode(asm_, optimize);
+  }
 
-  if (GetLogger() != 0) {
-    logger_ = new AsmJitLoggerAdapter(GetLogger());
-    logger_->setIndentation("\t");
-    logger_->setOption(asmjit::kLoggerOptionHexImmediate, true);
-    logger_->setOption(asmjit::kLoggerOptionHexDisplacement, true);
-    asm_.setLogger(logger_);
+  CompiledFunction *result = 0;
+  if (code != 0) {
+    const Function &function = functions_->GetFunction(index);
+    result = new CompiledFunction;
+    result->index = index;
+    result->code = code;
+    result->start = static_cast<unsigned char*>(code)
+                  + instr_map_[function.address()];
+    result->size = asm_.getCodeSize();
+    result->instr_map.swap(instr_map_);
+    result->call_sites.swap(call_sites_);
+  }
+
+  TearDownLogger();
+  amx_.Reset();
+
+  return result;
+}
+
+bool CompilerAsmjit::CompileImage(CompileOutputAsmjit *output,
+                                  int index,
+                                  CodeImage &image) {
+  bool ok = EmitFunction(output, index, false)
+         && asm_.getError() == asmjit::kErrorOk;
+
+  // All jumps must stay within the image.
+  for (std::map<cell, Label>::const_iterator it = label_map_.begin();
+       ok && it != label_map_.end(); it++) {
+    ok = asm_.isLabelBound(it->second);
+  }
+
+  ok = ok && MakeImage(index, image);
+
+  TearDownLogger();
+  amx_.Reset();
+
+  return ok;
+}
+
+bool CompilerAsmjit::CompileInterpImage(CompileOutputAsmjit *output,
+                                        int index,
+                                        CodeImage &image) {
+  BeginFunction(output, index, false);
+
+  const Function &function = functions_->GetFunction(index);
+  instr_map_[function.address()] = asm_.getCodeSize();
+  asm_.mov(edx, index);
+  asm_.jmp(CodePtr(shared_runtime.interp_helper));
+
+  image = CodeImage();
+  bool ok = asm_.getError() == asmjit::kErrorOk && MakeImage(index, image);
+
+  TearDownLogger();
+  amx_.Reset();
+
+  return ok;
+}
+
+// Copies the code from asm_ into the image, along with the information
+// needed to relocate it.
+bool CompilerAsmjit::MakeImage(int index, CodeImage &image) {
+  bool ok = true;
+
+  image.index = index;
+  image.code.resize(asm_.getCodeSize());
+  asm_.setBaseAddress(0);
+  image.code.resize(asm_.relocCode(&image.code[0], 0));
+  asm_.resetBaseAddress();
+
+  for (std::size_t i = 0; ok && i < asm_._relocList.getLength(); i++) {
+    const asmjit::RelocData &reloc = asm_._relocList[i];
+    switch (reloc.type) {
+      case asmjit::kRelocAbsToAbs:
+        break;
+      case asmjit::kRelocRelToAbs:
+        image.abs_relocs.push_back(static_cast<std::ptrdiff_t>(reloc.from));
+        break;
+      case asmjit::kRelocAbsToRel:
+        image.rel_relocs.push_back(static_cast<std::ptrdiff_t>(reloc.from));
+        break;
+      default:
+        ok = false;
+    }
+  }
+
+  image.start = 0;
+  if (index >= 0) {
+    image.start = instr_map_[functions_->GetFunction(index).address()];
+  }
+  image.instr_map.swap(instr_map_);
+  image.call_sites.swap(call_sites_);
+  image.data_relocs.swap(data_relocs_);
+
+  return ok && !image.code.empty();
+}
+
+void CompilerAsmjit::BeginFunction(CompileOutputAsmjit *output,
+                                   int index,
+                                   bool optimize) {
+  amx_ = output->amx_;
+  functions_ = &output->functions_;
+  output_ = output;
+  rib_ = output->rib_;
+  function_ = index;
+  optimize_ = optimize;
+  error_ = false;
+
+  asm_.reset();
+  label_map_.clear();
+  instr_map_.clear();
+  loop_headers_.clear();
+  call_sites_.clear();
+  data_relocs_.clear();
+  SetUpLogger();
+}
+
+bool CompilerAsmjit::EmitFunction(CompileOutputAsmjit *output,
+                                  int index,
+                                  bool optimize) {
+  BeginFunction(output, index, optimize);
+
+  bool ok;
+  if (index < 0) {
+    cell end = functions_->num_functions() > 0
+      ? functions_->GetFunction(0).address()
+      : static_cast<cell>(amx_.code_size());
+    ok = CompileRange(amx_, *functions_, 0, end);
+  } else {
+    const Function &function = functions_->GetFunction(index);
+    if (!optimize && !output->ready_.empty()) {
+      FindLoopHeaders(function);
+    }
+    if (optimize) {
+      std::vector<Instruction> instrs;
+      ok = output->optimizer_->Optimize(index, instrs)
+        && CompileInstructions(amx_, *functions_, instrs);
+    } else {
+      ok = CompileRange(amx_, *functions_, function.address(),
+                        function.end_address());
+    }
+  }
+
+  if (!ok || error_) {
+    return false;
+  }
+
+  // Every function should end with a RETN, there is nothing to fall
+  // through to.
+  asm_.mov(edi, AMX_ERR_INVINSTR);
+  asm_.jmp(CodePtr(rib_->halt_helper));
+
+  return true;
+}
+
+bool CompilerAsmjit::CompileScript(AMXRef amx,
+                                   const FunctionTable &functions) {
+  // The log must follow the order of instructions, so it's only possible
+  // to compile functions separately when there's no log.
+  if (GetLogger() == 0 && functions.num_functions() > 0) {
+    CodeCache cache(GetCacheDir(), GetCacheVersion());
+    bool cacheable = cache.Open(amx);
+    const CodeCache *cache_ptr =
+      cacheable && !GetCacheDir().empty() ? &cache : 0;
+    std::vector<CodeImage> images;
+    bool have_images = false;
+
+    // Code that may be patched at run time can't be shared.
+    bool dedupe = GetDedupe() && !output_->check_code_writes_;
+
+    if (cacheable && GetShareCode() && !output_->check_code_writes_) {
+      // Another process may have compiled the same script already. The
+      // lock makes the others wait until the first one is done.
+      SharedCode *shared = new SharedCode(cache.name());
+      if (shared->Lock()) {
+        bool ok = output_->AttachShared(shared);
+        if (!ok) {
+          have_images = GetImages(cache_ptr, images);
+          ok = have_images && output_->LinkShared(images, shared);
+        }
+        shared->Unlock();
+        if (ok) {
+          return true;
+        }
+      }
+      delete shared;
+    }
+
+    if (cache_ptr != 0 || GetNumThreads() > 1 || dedupe) {
+      if ((have_images || GetImages(cache_ptr, images))
+          && output_->Link(images, dedupe)) {
+        return true;
+      }
+    }
+  }
+
+  // If anything goes wrong (e.g. a function jumps into another one) the
+  // script is compiled as a whole.
+  if (Compiler::CompileScript(amx, functions)) {
+    return true;
   }
+  if (GetFallbackExec() == 0 || functions.num_functions() == 0) {
+    return false;
+  }
+
+  // Some instructions are not supported: run only the functions that
+  // contain them in the interpreter.
+  std::vector<CodeImage> images;
+  return CompileImages(images, true)
+      && output_->Link(images, GetDedupe() && !output_->check_code_writes_);
+}
+
+bool CompilerAsmjit::GetImages(const CodeCache *cache,
+                               std::vector<CodeImage> &images) {
+  std::vector<intptr_t> symbols = output_->GetSymbols();
+  intptr_t data = reinterpret_cast<intptr_t>(rib_);
 
+  if (cache != 0
+      && cache->Load(*functions_, symbols, data, sizeof(*rib_), images)) {
+    output_->from_cache_ = true;
+    return true;
+  }
+  if (!CompileImages(images)) {
+    return false;
+  }
+  if (cache != 0) {
+    // Whether it gets saved or not doesn't really matter.
+    cache->Save(images, symbols, data, sizeof(*rib_));
+  }
   return true;
 }
 
+bool CompilerAsmjit::CompileToCache(AMXRef amx) {
+  FunctionTable functions(amx);
+  CodeCache cache(GetCacheDir(), GetCacheVersion());
+
+  bool ok = !GetCacheDir().empty()
+         && functions.num_functions() > 0
+         && cache.Open(amx)
+         && Prepare(amx, functions);
+
+  if (ok) {
+    std::vector<CodeImage> images;
+    ok = CompileImages(images)
+      && cache.Save(images,
+                    output_->GetSymbols(),
+                    reinterpret_cast<intptr_t>(rib_),
+                    sizeof(*rib_));
+  }
+
+  // The code is never run, so throw it away.
+  Finish(true);
+  return ok;
+}
+
+bool CompilerAsmjit::VerifyCache(AMXRef amx) {
+  FunctionTable functions(amx);
+  CodeCache cache(GetCacheDir(), GetCacheVersion());
+
+  bool ok = !GetCacheDir().empty()
+         && functions.num_functions() > 0
+         && cache.Open(amx)
+         && Prepare(amx, functions);
+
+  if (ok) {
+    std::vector<CodeImage> cached_images;
+    std::vector<CodeImage> images;
+    ok = cache.Load(functions,
+                    output_->GetSymbols(),
+                    reinterpret_cast<intptr_t>(rib_),
+                    sizeof(*rib_),
+                    cached_images)
+      && CompileImages(images)
+      && images.size() == cached_images.size();
+    for (std::size_t i = 0; ok && i < images.size(); i++) {
+      ok = IsSameImage(images[i], cached_images[i]);
+    }
+  }
+
+  Finish(true);
+  return ok;
+}
+
+bool CompilerAsmjit::CompileImages(std::vector<CodeImage> &images,
+                                   bool interp_failed) {
+  CompileOutputAsmjit *output = output_;
+  int num_functions = output->functions_.num_functions();
+
+  // Calls between functions go to these (null) stubs until they are
+  // resolved by the linker.
+  output->stubs_.resize(num_functions, static_cast<void*>(0));
+
+  ThreadPool pool(GetNumThreads());
+  std::vector<CompilerAsmjit*> compilers;
+  for (int i = 0; i < pool.num_threads(); i++) {
+    compilers.push_back(new CompilerAsmjit);
+  }
+
+  // The first image holds the code that precedes the first function. The
+  // resulting layout is always the same regardless of the number of
+  // threads and of the order in which the images are compiled.
+  images.clear();
+  images.resize(num_functions + 1);
+  std::vector<char> results(images.size(), 0);
+  CompileImageTaskArgs args = {output, &compilers, &images, &results};
+  pool.Run(CompileImageTask, &args, static_cast<int>(images.size()));
+
+  if (interp_failed) {
+    for (std::size_t i = 1; i < images.size(); i++) {
+      if (!results[i]) {
+        results[i] = compilers[0]->CompileInterpImage(
+          output, static_cast<int>(i) - 1, images[i]);
+      }
+    }
+  }
+
+  for (std::size_t i = 0; i < compilers.size(); i++) {
+    delete compilers[i];
+  }
+  output->stubs_.clear();
+
+  return std::find(results.begin(), results.end(), 0) == results.end();
+}
+
+void CompilerAsmjit::CompileImageTask(void *arg, int thread, int task) {
+  CompileImageTaskArgs *args = static_cast<CompileImageTaskArgs*>(arg);
+  CompilerAsmjit *compiler = (*args->compilers)[thread];
+  (*args->results)[task] =
+    compiler->CompileImage(args->output, task - 1, (*args->images)[task]);
+}
+
+bool CompilerAsmjit::Prepare(AMXRef amx, const FunctionTable &functions) {
+  amx_ = amx;
+  functions_ = &functions;
+  output_ = new CompileOutputAsmjit(amx, functions);
+  rib_ = output_->rib_;
+
+  output_->fallback_exec_ = GetFallbackExec();
+
+  // Writes to the code section can't be detected in code compiled on
+  // demand, so scripts that may write to it are compiled up front.
+  if (output_->reads_code_address_) {
+    SetTierUpThreshold(0);
+  }
+  output_->check_code_writes_ = output_->reads_code_address_;
+
+  SetUpLogger();
+  return EmitRuntime();
+}
+
 bool CompilerAsmjit::Process(const Instruction &instr) {
   cell cip = instr.address();
 
@@ -203,6 +1932,7 @@ bool CompilerAsmjit::Process(const Instruction &instr) {
 
   asm_.bind(GetLabel(cip));
   instr_map_[cip] = asm_.getCodeSize();
+  cip_ = cip;
 
   if (logger_ != 0) {
     logger_->logFormat(asmjit::kLoggerStyleComment,
@@ -213,40 +1943,93 @@ bool CompilerAsmjit::Process(const Instruction &instr) {
                        instr.ToString().c_str());
   }
 
+  // Long-running loops switch to optimized code as soon as it's ready.
+  if (loop_headers_.find(cip) != loop_headers_.end()) {
+    EmitOSRCheck();
+  }
+
+  // Count function entries and loop iterations in baseline code to find
+  // functions worth optimizing.
+  switch (instr.opcode().GetId()) {
+    case OP_PROC:
+      EmitHotnessCheck();
+      break;
+    case OP_JUMP_PRI:
+      break;
+    default:
+      if (instr.opcode().IsJump() && GetJumpTarget(amx_, instr) <= cip) {
+        EmitHotnessCheck();
+      }
+  }
+
   return true;
 }
 
 CompileOutput *CompilerAsmjit::Finish(bool error) {
-  CompileOutput *output = 0;
+  CompileOutputAsmjit *output = output_;
 
   if (!error) {
-    void *code = asm_.make();
-    RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(code);
-
-    rib->amx = reinterpret_cast<intptr_t>(amx_.raw());
-    rib->exec += reinterpret_cast<intptr_t>(code);
-    rib->instr_table += reinterpret_cast<intptr_t>(code);
-
-    InstrTableEntry *ite =
-      reinterpret_cast<InstrTableEntry*>(rib->instr_table);
-    for (std::map<cell, std::ptrdiff_t>::const_iterator it = instr_map_.begin();
-         it != instr_map_.end(); it++) {
-      ite->address = it->first;
-      ite->start = static_cast<unsigned char*>(code) + it->second;
-      ite++;
+    if (GetTierUpThreshold() > 0) {
+      // Functions will be compiled on demand by a copy of this compiler.
+      CompilerAsmjit *compiler = new CompilerAsmjit;
+      compiler->SetLogger(GetLogger());
+      compiler->SetErrorHandler(GetErrorHandler());
+      compiler->SetTierUpThreshold(GetTierUpThreshold());
+      output->EnableTiering(compiler,
+                            GetTierUpThreshold(),
+                            GetBackgroundOptimization());
+    } else if (!output->linked_ && output->shared_ == 0) {
+      // Unless the functions were compiled and linked separately.
+      void *code = MakeCode(asm_, false);
+      if (code != 0) {
+        UseCurrentAmx(static_cast<unsigned char*>(code), data_relocs_, rib_);
+        output->code_.push_back(code);
+        output->AddCode(code, asm_.getCodeSize(), instr_map_);
+      } else {
+        error = true;
+      }
+    }
+  }
+
+  if (!error && GetTierUpThreshold() <= 0) {
+    // No more code will be added.
+    std::vector<InstrTableEntry>(output->instr_table_)
+      .swap(output->instr_table_);
+    if (!output->check_code_writes_) {
+      std::vector<bool>().swap(output->table_targets_);
     }
+  }
 
-    output = new CompileOutputAsmjit(code);
+  if (error) {
+    delete output;
+    output = 0;
   }
 
+  output_ = 0;
+  rib_ = 0;
+  functions_ = 0;
   amx_.Reset();
+  TearDownLogger();
 
-  if (asm_.getLogger() != 0) {
-    delete logger_;
-    asm_.setLogger(0);
+  return output;
+}
+
+void CompilerAsmjit::SetUpLogger() {
+  if (GetLogger() != 0 && logger_ == 0) {
+    logger_ = new AsmJitLoggerAdapter(GetLogger());
+    logger_->setIndentation("\t");
+    logger_->setOption(asmjit::kLoggerOptionHexImmediate, true);
+    logger_->setOption(asmjit::kLoggerOptionHexDisplacement, true);
+    asm_.setLogger(logger_);
   }
+}
 
-  return output;
+void CompilerAsmjit::TearDownLogger() {
+  if (logger_ != 0) {
+    asm_.setLogger(0);
+    delete logger_;
+    logger_ = 0;
+  }
 }
 
 void CompilerAsmjit::load_pri(cell address) {
@@ -331,6 +2114,17 @@ void CompilerAsmjit::const_alt(cell value) {
   }
 }
 
+void CompilerAsmjit::const_(cell address, cell value) {
+  // [address] = value
+  asm_.mov(dword_ptr(ebx, address), value);
+  EmitCodeWriteCheck(address, sizeof(cell));
+}
+
+void CompilerAsmjit::const_s(cell offset, cell value) {
+  // [FRM + offset] = value
+  asm_.mov(dword_ptr(ebp, offset), value);
+}
+
 void CompilerAsmjit::addr_pri(cell offset) {
   // PRI = FRM + offset
   asm_.lea(eax, dword_ptr(ebp, offset));
@@ -346,11 +2140,13 @@ void CompilerAsmjit::addr_alt(cell offset) {
 void CompilerAsmjit::stor_pri(cell address) {
   // [address] = PRI
   asm_.mov(dword_ptr(ebx, address), eax);
+  EmitCodeWriteCheck(address, sizeof(cell));
 }
 
 void CompilerAsmjit::stor_alt(cell address) {
   // [address] = ALT
   asm_.mov(dword_ptr(ebx, address), ecx);
+  EmitCodeWriteCheck(address, sizeof(cell));
 }
 
 void CompilerAsmjit::stor_s_pri(cell offset) {
@@ -367,29 +2163,34 @@ void CompilerAsmjit::sref_pri(cell address) {
   // [ [address] ] = PRI
   asm_.mov(edx, dword_ptr(ebx, address));
   asm_.mov(dword_ptr(ebx, edx), eax);
+  EmitCodeWriteCheck(edx, sizeof(cell));
 }
 
 void CompilerAsmjit::sref_alt(cell address) {
   // [ [address] ] = ALT
   asm_.mov(edx, dword_ptr(ebx, address));
   asm_.mov(dword_ptr(ebx, edx), ecx);
+  EmitCodeWriteCheck(edx, sizeof(cell));
 }
 
 void CompilerAsmjit::sref_s_pri(cell offset) {
   // [ [FRM + offset] ] = PRI
   asm_.mov(edx, dword_ptr(ebp, offset));
   asm_.mov(dword_ptr(ebx, edx), eax);
+  EmitCodeWriteCheck(edx, sizeof(cell));
 }
 
 void CompilerAsmjit::sref_s_alt(cell offset) {
   // [ [FRM + offset] ] = ALT
   asm_.mov(edx, dword_ptr(ebp, offset));
   asm_.mov(dword_ptr(ebx, edx), ecx);
+  EmitCodeWriteCheck(edx, sizeof(cell));
 }
 
 void CompilerAsmjit::stor_i() {
   // [ALT] = PRI (full cell)
   asm_.mov(dword_ptr(ebx, ecx), eax);
+  EmitCodeWriteCheck(ecx, sizeof(cell));
 }
 
 void CompilerAsmjit::strb_i(cell number) {
@@ -405,6 +2206,7 @@ void CompilerAsmjit::strb_i(cell number) {
       asm_.mov(dword_ptr(ebx, ecx), eax);
       break;
   }
+  EmitCodeWriteCheck(ecx, number);
 }
 
 void CompilerAsmjit::lidx() {
@@ -456,7 +2258,7 @@ void CompilerAsmjit::lctrl(cell index, cell cip) {
     case 1:
     case 2:
     case 3:
-      asm_.mov(eax, dword_ptr(amx_ptr_label_));
+      EmitLoadAmx(eax);
       switch (index) {
         case 0:
           asm_.mov(eax, dword_ptr(eax, offsetof(AMX, base)));
@@ -497,7 +2299,7 @@ void CompilerAsmjit::sctrl(cell index) {
   // 6=CIP
   switch (index) {
     case 2:
-      asm_.mov(edx, dword_ptr(amx_ptr_label_));
+      EmitLoadAmx(edx);
       asm_.mov(dword_ptr(edx, offsetof(AMX, hea)), eax);
       break;
     case 4:
@@ -507,7 +2309,7 @@ void CompilerAsmjit::sctrl(cell index) {
       asm_.lea(ebp, dword_ptr(ebx, eax));
       break;
     case 6:
-      asm_.call(jump_helper_label_);
+      asm_.call(CodePtr(rib_->jump_helper));
       break;
   }
 }
@@ -537,6 +2339,22 @@ void CompilerAsmjit::push_alt() {
   asm_.push(ecx);
 }
 
+void CompilerAsmjit::push_r(cell value) {
+  // Repeat value: [STK] = PRI, STK = STK - cell size
+  if (value <= 4) {
+    for (cell i = 0; i < value; i++) {
+      asm_.push(eax);
+    }
+  } else {
+    Label loop_label = asm_.newLabel();
+      asm_.mov(edx, value);
+    asm_.bind(loop_label);
+      asm_.push(eax);
+      asm_.dec(edx);
+      asm_.jnz(loop_label);
+  }
+}
+
 void CompilerAsmjit::push_c(cell value) {
   // [STK] = value, STK = STK - cell size
   asm_.push(value);
@@ -575,7 +2393,7 @@ void CompilerAsmjit::stack(cell value) {
 
 void CompilerAsmjit::heap(cell value) {
   // ALT = HEA, HEA = HEA + value
-  asm_.mov(edx, dword_ptr(amx_ptr_label_));
+  EmitLoadAmx(edx);
   asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, hea)));
   if (value >= 0) {
     asm_.add(dword_ptr(edx, offsetof(AMX, hea)), value);
@@ -613,6 +2431,18 @@ void CompilerAsmjit::retn() {
   asm_.ret(4);
 }
 
+void CompilerAsmjit::retn_c(cell num_bytes) {
+  // Same as RETN but the size of the arguments is known at compile time
+  // and is not pushed onto the stack by the caller (see FunctionTable).
+  asm_.pop(ebp);
+  asm_.add(ebp, ebx);
+  if (num_bytes > 0) {
+    asm_.ret(num_bytes);
+  } else {
+    asm_.ret();
+  }
+}
+
 void CompilerAsmjit::call(cell address) {
   // [STK] = CIP + 5, STK = STK - cell size
   // CIP = CIP + offset
@@ -620,12 +2450,41 @@ void CompilerAsmjit::call(cell address) {
   // address of the next sequential instruction on the stack.
   // The address jumped to is relative to the current CIP,
   // but the address on the stack is an absolute address.
+  if (function_ >= 0) {
+    int index = functions_->FindFunction(address);
+    if (index != function_
+        && index >= 0
+        && functions_->GetFunction(index).address() == address) {
+      // The callee may be not compiled yet. Call its stub for now, the call
+      // is patched when the callee gets compiled.
+      asm_.call(reinterpret_cast<asmjit::Ptr>(output_->stubs_[index]));
+      call_sites_.push_back(CallSite(asm_.getCodeSize(), index));
+      return;
+    }
+  }
   asm_.call(GetLabel(address));
 }
 
+void CompilerAsmjit::call_pri() {
+  // [STK] = CIP, STK = STK - cell size
+  // CIP = PRI (indirect call)
+  // The jump helper discards its own return address, so the call goes
+  // through a local thunk that leaves the address of the next instruction
+  // on the stack for the callee.
+  Label thunk_label = asm_.newLabel();
+  Label exit_label = asm_.newLabel();
+    asm_.call(thunk_label);
+    asm_.jmp(exit_label);
+  asm_.bind(thunk_label);
+    asm_.call(CodePtr(rib_->jump_helper));
+    // Invalid address: return from the thunk and continue.
+    asm_.ret();
+  asm_.bind(exit_label);
+}
+
 void CompilerAsmjit::jump_pri() {
   // CIP = PRI (indirect jump)
-  asm_.call(jump_helper_label_);
+  asm_.call(CodePtr(rib_->jump_helper));
 }
 
 void CompilerAsmjit::jump(cell address) {
@@ -737,8 +2596,8 @@ void CompilerAsmjit::shr_c_pri(cell value) {
 }
 
 void CompilerAsmjit::shr_c_alt(cell value) {
-  // PRI = PRI >> value (without sign extension)
-  asm_.shl(ecx, static_cast<unsigned char>(value));
+  // ALT = ALT >> value (without sign extension)
+  asm_.shr(ecx, static_cast<unsigned char>(value));
 }
 
 void CompilerAsmjit::smul() {
@@ -861,6 +2720,7 @@ void CompilerAsmjit::zero_alt() {
 void CompilerAsmjit::zero(cell address) {
   // [address] = 0
   asm_.mov(dword_ptr(ebx, address), 0);
+  EmitCodeWriteCheck(address, sizeof(cell));
 }
 
 void CompilerAsmjit::zero_s(cell offset) {
@@ -975,6 +2835,7 @@ void CompilerAsmjit::inc_alt() {
 void CompilerAsmjit::inc(cell address) {
   // [address] = [address] + 1
   asm_.inc(dword_ptr(ebx, address));
+  EmitCodeWriteCheck(address, sizeof(cell));
 }
 
 void CompilerAsmjit::inc_s(cell offset) {
@@ -985,6 +2846,7 @@ void CompilerAsmjit::inc_s(cell offset) {
 void CompilerAsmjit::inc_i() {
   // [PRI] = [PRI] + 1
   asm_.inc(dword_ptr(ebx, eax));
+  EmitCodeWriteCheck(eax, sizeof(cell));
 }
 
 void CompilerAsmjit::dec_pri() {
@@ -1000,6 +2862,7 @@ void CompilerAsmjit::dec_alt() {
 void CompilerAsmjit::dec(cell address) {
   // [address] = [address] - 1
   asm_.dec(dword_ptr(ebx, address));
+  EmitCodeWriteCheck(address, sizeof(cell));
 }
 
 void CompilerAsmjit::dec_s(cell offset) {
@@ -1010,6 +2873,7 @@ void CompilerAsmjit::dec_s(cell offset) {
 void CompilerAsmjit::dec_i() {
   // [PRI] = [PRI] - 1
   asm_.dec(dword_ptr(ebx, eax));
+  EmitCodeWriteCheck(eax, sizeof(cell));
 }
 
 void CompilerAsmjit::movs(cell num_bytes) {
@@ -1030,6 +2894,7 @@ void CompilerAsmjit::movs(cell num_bytes) {
     asm_.rep_movsb();
   }
   asm_.pop(ecx);
+  EmitCodeWriteCheck(ecx, num_bytes);
 }
 
 void CompilerAsmjit::cmps(cell num_bytes) {
@@ -1069,13 +2934,14 @@ void CompilerAsmjit::fill(cell num_bytes) {
   asm_.mov(ecx, num_bytes / sizeof(cell));
   asm_.rep_stosd();
   asm_.pop(ecx);
+  EmitCodeWriteCheck(ecx, num_bytes);
 }
 
 void CompilerAsmjit::halt(cell error_code) {
   // Abort execution (exit value in PRI), parameters other than 0
   // have a special meaning.
   asm_.mov(edi, error_code);
-  asm_.jmp(halt_helper_label_);
+  asm_.jmp(CodePtr(rib_->halt_helper));
 }
 
 void CompilerAsmjit::bounds(cell value) {
@@ -1089,20 +2955,20 @@ void CompilerAsmjit::bounds(cell value) {
     asm_.jmp(exit_label);
   asm_.bind(halt_label);
     asm_.mov(edi, AMX_ERR_BOUNDS);
-    asm_.jmp(halt_helper_label_);
+    asm_.jmp(CodePtr(rib_->halt_helper));
   asm_.bind(exit_label);
 }
 
 void CompilerAsmjit::sysreq_pri() {
   // call system service, service number in PRI
-  asm_.call(sysreq_c_helper_label_);
+  asm_.call(CodePtr(rib_->sysreq_c_helper));
 }
 
 void CompilerAsmjit::sysreq_c(cell index, const char *name) {
   // call system service
   if (!EmitIntrinsic(name)) {
     asm_.mov(eax, index);
-    asm_.call(sysreq_c_helper_label_);
+    asm_.call(CodePtr(rib_->sysreq_c_helper));
   }
 }
 
@@ -1110,7 +2976,7 @@ void CompilerAsmjit::sysreq_d(cell address, const char *name) {
   // call system service
   if (!EmitIntrinsic(name)) {
     asm_.mov(eax, address);
-    asm_.call(sysreq_d_helper_label_);
+    asm_.call(CodePtr(rib_->sysreq_d_helper));
   }
 }
 
@@ -1304,55 +3170,143 @@ bool CompilerAsmjit::EmitIntrinsic(const char *name) {
 
   return false;
 }
+bool CompilerAsmjit::EmitRuntime() {
+  if (!EmitSharedRuntime()) {
+    return false;
+  }
+
+  exec_label_ = asm_.newLabel();
+  tier0_helper_label_ = asm_.newLabel();
+  optimize_helper_label_ = asm_.newLabel();
+  osr_helper_label_ = asm_.newLabel();
+
+  rib_->exec_helper = shared_runtime.exec_helper;
+  rib_->call_helper = shared_runtime.call_helper;
+  rib_->halt_helper = shared_runtime.halt_helper;
+  rib_->jump_helper = shared_runtime.jump_helper;
+  rib_->sysreq_c_helper = shared_runtime.sysreq_c_helper;
+  rib_->sysreq_d_helper = shared_runtime.sysreq_d_helper;
+  rib_->code_write_helper = shared_runtime.code_write_helper;
+
+  // The entry point passes this script's RIB to the shared Exec.
+  asm_.bind(exec_label_);
+    asm_.mov(eax, asmjit::imm_ptr(rib_));
+    asm_.jmp(CodePtr(shared_runtime.exec));
+
+  // In tiered mode functions are called through the entry table which
+  // initially points to stubs that call the interpreter.
+  std::vector<Label> stub_labels;
+  if (GetTierUpThreshold() > 0) {
+    EmitTier0Helper();
+    EmitOptimizeHelper();
+    EmitOSRHelper();
+    output_->stubs_.resize(functions_->num_functions());
+    for (int i = 0; i < functions_->num_functions(); i++) {
+      stub_labels.push_back(asm_.newLabel());
+      asm_.bind(stub_labels.back());
+        asm_.mov(edx, i);
+        asm_.jmp(tier0_helper_label_);
+    }
+  }
+
+  // The helpers are called all the time.
+  void *runtime = MakeCode(asm_, true);
+  if (runtime == 0) {
+    return false;
+  }
+
+  intptr_t base = reinterpret_cast<intptr_t>(runtime);
+  output_->runtime_ = runtime;
+  output_->code_size_ = asm_.getCodeSize();
+  rib_->exec = base + asm_.getLabelOffset(exec_label_);
+  if (GetTierUpThreshold() > 0) {
+    rib_->optimize_helper = base + asm_.getLabelOffset(optimize_helper_label_);
+    rib_->osr_helper = base + asm_.getLabelOffset(osr_helper_label_);
+  }
+
+  for (std::size_t i = 0; i < stub_labels.size(); i++) {
+    output_->stubs_[i] =
+      reinterpret_cast<void*>(base + asm_.getLabelOffset(stub_labels[i]));
+  }
+  output_->entry_table_ = output_->stubs_;
+
+  // The compiled code goes into a separate block.
+  asm_.reset();
 
-void CompilerAsmjit::EmitRuntimeInfo() {
-  asm_.bind(rib_start_label_);
-  asm_.bind(exec_ptr_label_);
-    asm_.dd(0); // rib->exec
-  asm_.bind(amx_ptr_label_);
-    asm_.dd(0); // rib->amx_ptr
-  asm_.bind(ebp_label_);
-    asm_.dd(0); // rib->ebp
-  asm_.bind(esp_label_);
-    asm_.dd(0); // rib->esp
-  asm_.bind(reset_ebp_label_);
-    asm_.dd(0); // rib->reset_ebp
-  asm_.bind(reset_esp_label_);
-    asm_.dd(0); // rib->reset_esp
-    asm_.dd(0); // rib->instr_map
-    asm_.dd(0); // rib->instr_map_size
+  return true;
 }
 
-void CompilerAsmjit::EmitInstrTable() {
-  int num_entries = 0;
+// Emits the helpers shared by all scripts unless this was already done.
+// They are never freed.
+bool CompilerAsmjit::EmitSharedRuntime() {
+  ScopedLock lock(shared_runtime_mutex);
 
-  Instruction instr;
-  Disassembler disasm(amx_);
-  while (disasm.Decode(instr)) {
-    num_entries++;
+  if (shared_runtime.code != 0) {
+    return true;
   }
 
-  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
-  rib->instr_table = asm_.getCodeSize();
-  rib->instr_table_size = num_entries;
+  exec_label_ = asm_.newLabel();
+  exec_helper_label_ = asm_.newLabel();
+  call_helper_label_ = asm_.newLabel();
+  halt_helper_label_ = asm_.newLabel();
+  jump_helper_label_ = asm_.newLabel();
+  sysreq_c_helper_label_ = asm_.newLabel();
+  sysreq_d_helper_label_ = asm_.newLabel();
+  interp_helper_label_ = asm_.newLabel();
+  recompile_helper_label_ = asm_.newLabel();
+  code_write_helper_label_ = asm_.newLabel();
 
-  InstrTableEntry dummy;
-  for (int i = 0; i < num_entries; i++) {
-    asm_.dstruct(dummy);
+  EmitExec();
+  EmitExecHelper();
+  EmitCallHelper();
+  EmitHaltHelper();
+  EmitJumpHelper();
+  EmitSysreqCHelper();
+  EmitSysreqDHelper();
+  EmitInterpHelper();
+  EmitRecompileHelper();
+  EmitCodeWriteHelper();
+
+  void *code = MakeCode(asm_, true);
+  if (code == 0) {
+    asm_.reset();
+    return false;
   }
+
+  intptr_t base = reinterpret_cast<intptr_t>(code);
+  shared_runtime.exec = base + asm_.getLabelOffset(exec_label_);
+  shared_runtime.exec_helper = base + asm_.getLabelOffset(exec_helper_label_);
+  shared_runtime.call_helper = base + asm_.getLabelOffset(call_helper_label_);
+  shared_runtime.halt_helper = base + asm_.getLabelOffset(halt_helper_label_);
+  shared_runtime.jump_helper = base + asm_.getLabelOffset(jump_helper_label_);
+  shared_runtime.sysreq_c_helper =
+    base + asm_.getLabelOffset(sysreq_c_helper_label_);
+  shared_runtime.sysreq_d_helper =
+    base + asm_.getLabelOffset(sysreq_d_helper_label_);
+  shared_runtime.interp_helper =
+    base + asm_.getLabelOffset(interp_helper_label_);
+  shared_runtime.recompile_helper =
+    base + asm_.getLabelOffset(recompile_helper_label_);
+  shared_runtime.code_write_helper =
+    base + asm_.getLabelOffset(code_write_helper_label_);
+  shared_runtime.code = code;
+
+  asm_.reset();
+
+  return true;
 }
 
-// int AMXJIT_CDECL Exec(cell index, cell *retval);
+// int AMXJIT_CDECL Exec(cell index, cell *retval) with the RIB in eax.
 void CompilerAsmjit::EmitExec() {
-  RuntimeInfoBlock *rib = reinterpret_cast<RuntimeInfoBlock*>(asm_.getBuffer());
-  rib->exec = asm_.getCodeSize();
-
+  Label slow_path_label = asm_.newLabel();
   Label null_data_label = asm_.newLabel();
+  Label call_label = asm_.newLabel();
   Label stack_heap_overflow_label = asm_.newLabel();
   Label heap_underflow_label = asm_.newLabel();
   Label stack_underflow_label = asm_.newLabel();
   Label native_not_found_label = asm_.newLabel();
   Label public_not_found_label = asm_.newLabel();
+  Label no_error_label = asm_.newLabel();
   Label finish_label = asm_.newLabel();
   Label return_label = asm_.newLabel();
 
@@ -1361,93 +3315,97 @@ void CompilerAsmjit::EmitExec() {
   int var_address = -4;
   int var_reset_ebp = -8;
   int var_reset_esp = -12;
+  int var_stk = -16;
+  int var_hea = -20;
+  int var_prev_rib = -24;
+  int var_prev_amx = -28;
 
   asm_.bind(exec_label_);
     asm_.push(ebp);
     asm_.mov(ebp, esp);
 
     // Allocate space for the local variables.
-    asm_.sub(esp, 12);
+    asm_.sub(esp, 28);
 
-    asm_.push(esi);
-    asm_.mov(esi, dword_ptr(amx_ptr_label_));
+    // Make the script's RIB current. The previous one is restored on return
+    // as natives may call into other scripts.
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.mov(dword_ptr(ebp, var_prev_rib), edx);
+    asm_.mov(edx, AbsPtr(&current_amx));
+    asm_.mov(dword_ptr(ebp, var_prev_amx), edx);
+    asm_.mov(AbsPtr(&current_rib), eax);
 
-    // Set ebx to point to the AMX data section.
+    asm_.push(esi);
+    asm_.mov(esi, RibPtr(eax, offsetof(RuntimeInfoBlock, amx)));
+    asm_.mov(AbsPtr(&current_amx), esi);
     asm_.push(ebx);
-    asm_.mov(ebx, dword_ptr(esi, offsetof(AMX, data)));
-    asm_.test(ebx, ebx);
-    asm_.jnz(null_data_label);
-    asm_.mov(ebx, dword_ptr(esi, offsetof(AMX, base)));
-    asm_.mov(eax, dword_ptr(ebx, offsetof(AMX_HEADER, dat)));
-    asm_.add(ebx, eax);
-
-  asm_.bind(null_data_label);
-
-    // Check for a stack/heap collision (stack/heap overflow).
-    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, hea)));
-    asm_.mov(edx, dword_ptr(esi, offsetof(AMX, stk)));
-    asm_.cmp(ecx, edx);
-    asm_.jge(stack_heap_overflow_label);
-
-    // Check for a stack underflow.
-    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, stk)));
-    asm_.mov(edx, dword_ptr(esi, offsetof(AMX, stp)));
-    asm_.cmp(ecx, edx);
-    asm_.jg(stack_underflow_label);
-
-    // Check for a heap underflow.
-    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, hea)));
-    asm_.mov(edx, dword_ptr(esi, offsetof(AMX, hlw)));
-    asm_.cmp(ecx, edx);
-    asm_.jl(heap_underflow_label);
-
-    // Make sure that all natives functions have been registered.
-    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, flags)));
-    asm_.test(ecx, AMX_FLAG_NTVREG);
-    asm_.jz(native_not_found_label);
 
+    // Fast path: a call to a public function that was already called
+    // before. The data pointer and the natives have been checked by then,
+    // and neither can change. This includes re-entry from a native called
+    // by this script (CallLocalFunction(), timers and so on): the function
+    // simply runs on top of the current AMX stack.
+    asm_.mov(ebx, RibPtr(eax, offsetof(RuntimeInfoBlock, data)));
+    asm_.test(ebx, ebx);
+    asm_.jz(slow_path_label);
+    asm_.mov(ecx, dword_ptr(ebp, arg_index));
+    asm_.inc(ecx);
+    asm_.cmp(ecx, RibPtr(eax, offsetof(RuntimeInfoBlock, num_public_starts)));
+    asm_.jae(slow_path_label);
+    asm_.mov(edx, RibPtr(eax, offsetof(RuntimeInfoBlock, public_starts)));
+    asm_.mov(edx, dword_ptr(edx, ecx, 2));
+    asm_.test(edx, edx);
+    asm_.jz(slow_path_label);
+    asm_.mov(dword_ptr(ebp, var_address), edx);
+
+    // Save the reset_ebp and reset_esp of the outer call, if any (both are
+    // zero at top level).
+    asm_.mov(edx, RibPtr(eax, offsetof(RuntimeInfoBlock, reset_ebp)));
+    asm_.mov(dword_ptr(ebp, var_reset_ebp), edx);
+    asm_.mov(edx, RibPtr(eax, offsetof(RuntimeInfoBlock, reset_esp)));
+    asm_.mov(dword_ptr(ebp, var_reset_esp), edx);
+
+    // STK and HEA may be changed by amx_Push() and friends.
+    EmitExecChecks(stack_heap_overflow_label,
+                   stack_underflow_label,
+                   heap_underflow_label);
+
+  asm_.bind(call_label);
     // Reset the error code.
     asm_.mov(dword_ptr(esi, offsetof(AMX, error)), AMX_ERR_NONE);
 
-    // Get the address of the public function.
-    asm_.push(dword_ptr(ebp, arg_index));
-    asm_.mov(eax, dword_ptr(amx_ptr_label_));
-    asm_.push(eax);
-    asm_.call(reinterpret_cast<asmjit::Ptr>(&GetPublicAddress));
-    asm_.add(esp, 8);
-
-    // Check if the function was actually found.
-    asm_.test(eax, eax);
-    asm_.jz(public_not_found_label);
-
-    // Get the function's start address.
-    asm_.lea(ecx, dword_ptr(rib_start_label_));
-    asm_.push(ecx);
-    asm_.push(eax);
-    asm_.call(reinterpret_cast<asmjit::Ptr>(&GetInstrStartPtr));
-    asm_.add(esp, 8);
-    asm_.mov(dword_ptr(ebp, var_address), eax);
-
-    // Push the size of the arguments and reset the parameter count.
+    // Remember where STK and HEA should be after the call.
     asm_.mov(eax, dword_ptr(esi, offsetof(AMX, paramcount)));
     asm_.imul(eax, eax, sizeof(cell));
     asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, stk)));
+    asm_.lea(edx, dword_ptr(ecx, eax));
+    asm_.mov(dword_ptr(ebp, var_stk), edx);
+    asm_.mov(edx, dword_ptr(esi, offsetof(AMX, hea)));
+    asm_.mov(dword_ptr(ebp, var_hea), edx);
+
+    // Push the size of the arguments and reset the parameter count.
     asm_.sub(ecx, sizeof(cell));
     asm_.mov(dword_ptr(ebx, ecx), eax);
     asm_.mov(dword_ptr(esi, offsetof(AMX, stk)), ecx);
     asm_.mov(dword_ptr(esi, offsetof(AMX, paramcount)), 0);
 
-    // Save the old reset_ebp and reset_esp on the stack.
-    asm_.mov(eax, dword_ptr(reset_ebp_label_));
-    asm_.mov(dword_ptr(ebp, var_reset_ebp), eax);
-    asm_.mov(eax, dword_ptr(reset_esp_label_));
-    asm_.mov(dword_ptr(ebp, var_reset_esp), eax);
-
     // Call the function.
     asm_.push(dword_ptr(ebp, var_address));
     asm_.call(exec_helper_label_);
     asm_.add(esp, 4);
 
+    // The arguments are popped even if the function was aborted. On error
+    // the heap is restored as well.
+    asm_.mov(edx, dword_ptr(ebp, var_stk));
+    asm_.mov(dword_ptr(esi, offsetof(AMX, stk)), edx);
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.mov(RibPtr(edx, offsetof(RuntimeInfoBlock, halted)), 0);
+    asm_.cmp(dword_ptr(esi, offsetof(AMX, error)), AMX_ERR_NONE);
+    asm_.je(no_error_label);
+    asm_.mov(edx, dword_ptr(ebp, var_hea));
+    asm_.mov(dword_ptr(esi, offsetof(AMX, hea)), edx);
+  asm_.bind(no_error_label);
+
     // Copy the return value to retval (if it's not null).
     asm_.mov(ecx, dword_ptr(ebp, arg_retval));
     asm_.test(ecx, ecx);
@@ -1456,22 +3414,68 @@ void CompilerAsmjit::EmitExec() {
 
   asm_.bind(finish_label);
     // Restore reset_ebp and reset_esp from the stack.
+    asm_.mov(edx, AbsPtr(&current_rib));
     asm_.mov(eax, dword_ptr(ebp, var_reset_ebp));
-    asm_.mov(dword_ptr(reset_ebp_label_), eax);
+    asm_.mov(RibPtr(edx, offsetof(RuntimeInfoBlock, reset_ebp)), eax);
     asm_.mov(eax, dword_ptr(ebp, var_reset_esp));
-    asm_.mov(dword_ptr(reset_esp_label_), eax);
+    asm_.mov(RibPtr(edx, offsetof(RuntimeInfoBlock, reset_esp)), eax);
 
     // Copy amx->error for return and reset it.
     asm_.mov(eax, AMX_ERR_NONE);
     asm_.xchg(eax, dword_ptr(esi, offsetof(AMX, error)));
 
   asm_.bind(return_label);
+    asm_.mov(edx, dword_ptr(ebp, var_prev_rib));
+    asm_.mov(AbsPtr(&current_rib), edx);
+    asm_.mov(edx, dword_ptr(ebp, var_prev_amx));
+    asm_.mov(AbsPtr(&current_amx), edx);
     asm_.pop(ebx);
     asm_.pop(esi);
     asm_.mov(esp, ebp);
     asm_.pop(ebp);
     asm_.ret();
 
+  // The first call and calls with an invalid index.
+  asm_.bind(slow_path_label);
+    // Set ebx to point to the AMX data section.
+    asm_.mov(ebx, dword_ptr(esi, offsetof(AMX, data)));
+    asm_.test(ebx, ebx);
+    asm_.jnz(null_data_label);
+    asm_.mov(ebx, dword_ptr(esi, offsetof(AMX, base)));
+    asm_.mov(eax, dword_ptr(ebx, offsetof(AMX_HEADER, dat)));
+    asm_.add(ebx, eax);
+  asm_.bind(null_data_label);
+
+    EmitExecChecks(stack_heap_overflow_label,
+                   stack_underflow_label,
+                   heap_underflow_label);
+
+    // Make sure that all natives functions have been registered.
+    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, flags)));
+    asm_.test(ecx, AMX_FLAG_NTVREG);
+    asm_.jz(native_not_found_label);
+
+    // From now on the fast path can be used.
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.mov(RibPtr(edx, offsetof(RuntimeInfoBlock, data)), ebx);
+
+    // Get the function's start address.
+    asm_.push(edx);
+    asm_.push(dword_ptr(ebp, arg_index));
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&GetPublicStartPtr));
+    asm_.add(esp, 8);
+    asm_.test(eax, eax);
+    asm_.jz(public_not_found_label);
+    asm_.mov(dword_ptr(ebp, var_address), eax);
+
+    // Save the old reset_ebp and reset_esp on the stack.
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.mov(eax, RibPtr(edx, offsetof(RuntimeInfoBlock, reset_ebp)));
+    asm_.mov(dword_ptr(ebp, var_reset_ebp), eax);
+    asm_.mov(eax, RibPtr(edx, offsetof(RuntimeInfoBlock, reset_esp)));
+    asm_.mov(dword_ptr(ebp, var_reset_esp), eax);
+    asm_.jmp(call_label);
+
   asm_.bind(stack_heap_overflow_label);
     asm_.mov(eax, AMX_ERR_STACKERR);
     asm_.jmp(return_label);
@@ -1493,6 +3497,24 @@ void CompilerAsmjit::EmitExec() {
     asm_.jmp(return_label);
 }
 
+void CompilerAsmjit::EmitExecChecks(const Label &stack_heap_overflow_label,
+                                    const Label &stack_underflow_label,
+                                    const Label &heap_underflow_label) {
+  // Check for a stack/heap collision (stack/heap overflow).
+  asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, hea)));
+  asm_.mov(edx, dword_ptr(esi, offsetof(AMX, stk)));
+  asm_.cmp(ecx, edx);
+  asm_.jge(stack_heap_overflow_label);
+
+  // Check for a stack underflow.
+  asm_.cmp(edx, dword_ptr(esi, offsetof(AMX, stp)));
+  asm_.jg(stack_underflow_label);
+
+  // Check for a heap underflow.
+  asm_.cmp(ecx, dword_ptr(esi, offsetof(AMX, hlw)));
+  asm_.jl(heap_underflow_label);
+}
+
 // cell AMXJIT_CDECL ExecHelper(void *address);
 void CompilerAsmjit::EmitExecHelper() {
   asm_.bind(exec_helper_label_);
@@ -1504,24 +3526,25 @@ void CompilerAsmjit::EmitExecHelper() {
     asm_.push(edi);
 
     // Store the old ebp and esp on the stack.
-    asm_.push(dword_ptr(ebp_label_));
-    asm_.push(dword_ptr(esp_label_));
+    asm_.mov(edi, AbsPtr(&current_rib));
+    asm_.push(RibPtr(edi, offsetof(RuntimeInfoBlock, ebp)));
+    asm_.push(RibPtr(edi, offsetof(RuntimeInfoBlock, esp)));
 
     // The most recent ebp and esp are stored in RIB.
-    asm_.mov(dword_ptr(ebp_label_), ebp);
-    asm_.mov(dword_ptr(esp_label_), esp);
+    asm_.mov(RibPtr(edi, offsetof(RuntimeInfoBlock, ebp)), ebp);
+    asm_.mov(RibPtr(edi, offsetof(RuntimeInfoBlock, esp)), esp);
 
     // Switch from the native stack to the AMX stack.
-    asm_.mov(ecx, dword_ptr(amx_ptr_label_));
-    asm_.mov(edx, dword_ptr(esi, offsetof(AMX, frm)));
+    asm_.mov(ecx, RibPtr(edi, offsetof(RuntimeInfoBlock, amx)));
+    asm_.mov(edx, dword_ptr(ecx, offsetof(AMX, frm)));
     asm_.lea(ebp, dword_ptr(ebx, edx)); // ebp = data + amx->frm
     asm_.mov(edx, dword_ptr(ecx, offsetof(AMX, stk)));
     asm_.lea(esp, dword_ptr(ebx, edx)); // esp = data + amx->stk
 
     // In order to make halt() work we must able to return to this place.
     asm_.lea(ecx, dword_ptr(esp, - 4));
-    asm_.mov(dword_ptr(reset_esp_label_), ecx);
-    asm_.mov(dword_ptr(reset_ebp_label_), ebp);
+    asm_.mov(RibPtr(edi, offsetof(RuntimeInfoBlock, reset_esp)), ecx);
+    asm_.mov(RibPtr(edi, offsetof(RuntimeInfoBlock, reset_ebp)), ebp);
 
     // Call the function. Prior to this point ebx should point to the
     // AMX data and the both stack pointers should point to somewhere
@@ -1530,7 +3553,8 @@ void CompilerAsmjit::EmitExecHelper() {
 
     // Keep the AMX stack registers up-to-date. This wouldn't be necessary
     // if RETN didn't modify them (it pops all arguments off the stack).
-    asm_.mov(ecx, dword_ptr(amx_ptr_label_));
+    asm_.mov(edi, AbsPtr(&current_rib));
+    asm_.mov(ecx, RibPtr(edi, offsetof(RuntimeInfoBlock, amx)));
     asm_.mov(edx, ebp);
     asm_.sub(edx, ebx);
     asm_.mov(dword_ptr(ecx, offsetof(AMX, frm)), edx); // amx->frm = ebp - data
@@ -1539,33 +3563,66 @@ void CompilerAsmjit::EmitExecHelper() {
     asm_.mov(dword_ptr(ecx, offsetof(AMX, stk)), edx); // amx->stk = esp - data
 
     // Switch back to the native stack.
-    asm_.mov(ebp, dword_ptr(ebp_label_));
-    asm_.mov(esp, dword_ptr(esp_label_));
-
-    asm_.pop(dword_ptr(esp_label_));
-    asm_.pop(dword_ptr(ebp_label_));
+    asm_.mov(ebp, RibPtr(edi, offsetof(RuntimeInfoBlock, ebp)));
+    asm_.mov(esp, RibPtr(edi, offsetof(RuntimeInfoBlock, esp)));
 
+    asm_.pop(RibPtr(edi, offsetof(RuntimeInfoBlock, esp)));
+    asm_.pop(RibPtr(edi, offsetof(RuntimeInfoBlock, ebp)));
     asm_.pop(edi);
     asm_.pop(esi);
     asm_.ret();
 }
 
+// cell AMXJIT_CDECL CallHelper(void *address);
+void CompilerAsmjit::EmitCallHelper() {
+  Label null_data_label = asm_.newLabel();
+
+  asm_.bind(call_helper_label_);
+    asm_.push(ebp);
+    asm_.mov(ebp, esp);
+    asm_.push(ebx);
+    asm_.push(esi);
+
+    // Set ebx to point to the AMX data section (same as in Exec).
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.mov(esi, RibPtr(edx, offsetof(RuntimeInfoBlock, amx)));
+    asm_.mov(ebx, dword_ptr(esi, offsetof(AMX, data)));
+    asm_.test(ebx, ebx);
+    asm_.jnz(null_data_label);
+    asm_.mov(ebx, dword_ptr(esi, offsetof(AMX, base)));
+    asm_.mov(eax, dword_ptr(ebx, offsetof(AMX_HEADER, dat)));
+    asm_.add(ebx, eax);
+  asm_.bind(null_data_label);
+
+    // Unlike Exec this doesn't push the argument size header: the caller
+    // has already set up the stack like CALL would do.
+    asm_.push(RibPtr(edx, offsetof(RuntimeInfoBlock, reset_ebp)));
+    asm_.push(RibPtr(edx, offsetof(RuntimeInfoBlock, reset_esp)));
+    asm_.push(dword_ptr(ebp, 8));
+    asm_.call(exec_helper_label_);
+    asm_.add(esp, 4);
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.pop(RibPtr(edx, offsetof(RuntimeInfoBlock, reset_esp)));
+    asm_.pop(RibPtr(edx, offsetof(RuntimeInfoBlock, reset_ebp)));
+
+    asm_.pop(esi);
+    asm_.pop(ebx);
+    asm_.pop(ebp);
+    asm_.ret();
+}
+
 // void HaltHelper(int error [edi]);
 void CompilerAsmjit::EmitHaltHelper() {
   asm_.bind(halt_helper_label_);
-    asm_.mov(esi, dword_ptr(amx_ptr_label_));
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.mov(esi, RibPtr(edx, offsetof(RuntimeInfoBlock, amx)));
     asm_.mov(dword_ptr(esi, offsetof(AMX, error)), edi); // error code in edi
+    asm_.mov(RibPtr(edx, offsetof(RuntimeInfoBlock, halted)), 1);
 
     // Reset the stack so that we return to the instruction next to CALL.
-    asm_.mov(esp, dword_ptr(reset_esp_label_));
-    asm_.mov(ebp, dword_ptr(reset_ebp_label_));
-
-    // Pop the public function's arguments as it done by RETN.
-    asm_.pop(eax);
-    asm_.add(esp, dword_ptr(esp));
-    asm_.add(esp, 4);
-    asm_.push(eax);
-
+    // The arguments are popped by the caller (Exec).
+    asm_.mov(esp, RibPtr(edx, offsetof(RuntimeInfoBlock, reset_esp)));
+    asm_.mov(ebp, RibPtr(edx, offsetof(RuntimeInfoBlock, reset_ebp)));
     asm_.ret();
 }
 
@@ -1577,19 +3634,28 @@ void CompilerAsmjit::EmitJumpHelper() {
     asm_.push(eax);
     asm_.push(ecx);
 
-    asm_.lea(ecx, dword_ptr(rib_start_label_));
-    asm_.push(ecx);
+    // Switch to the native stack: looking up the address may involve
+    // compiling a function.
+    asm_.mov(edx, AbsPtr(&current_rib));
+    asm_.mov(esi, esp);
+    asm_.mov(edi, ebp);
+    asm_.mov(ebp, RibPtr(edx, offsetof(RuntimeInfoBlock, ebp)));
+    asm_.mov(esp, RibPtr(edx, offsetof(RuntimeInfoBlock, esp)));
+
+    asm_.push(edx);
     asm_.push(eax);
     asm_.call(reinterpret_cast<asmjit::Ptr>(&GetInstrStartPtr));
     asm_.add(esp, 8);
     asm_.mov(edx, eax); // address
 
+    // Switch back to the AMX stack.
+    asm_.mov(esp, esi);
+    asm_.mov(ebp, edi);
+
     asm_.pop(ecx);
     asm_.pop(eax);
-
     asm_.test(edx, edx);
     asm_.jz(invalid_address_label);
-
     asm_.lea(esp, dword_ptr(esp, 4));
     asm_.jmp(edx);
 
@@ -1604,16 +3670,16 @@ void CompilerAsmjit::EmitSysreqCHelper() {
     asm_.mov(esi, dword_ptr(esp));
     asm_.lea(esp, dword_ptr(esp, 4));
     asm_.mov(ecx, esp);
-
-    asm_.mov(edx, dword_ptr(amx_ptr_label_));
+    asm_.mov(edi, AbsPtr(&current_rib));
+    asm_.mov(edx, RibPtr(edi, offsetof(RuntimeInfoBlock, amx)));
 
     // Switch to the native stack.
     asm_.sub(ebp, ebx);
     asm_.mov(dword_ptr(edx, offsetof(AMX, frm)), ebp); // amx->frm = ebp - data
-    asm_.mov(ebp, dword_ptr(ebp_label_));
+    asm_.mov(ebp, RibPtr(edi, offsetof(RuntimeInfoBlock, ebp)));
     asm_.sub(esp, ebx);
     asm_.mov(dword_ptr(edx, offsetof(AMX, stk)), esp); // amx->stk = esp - data
-    asm_.mov(esp, dword_ptr(esp_label_));
+    asm_.mov(esp, RibPtr(edi, offsetof(RuntimeInfoBlock, esp)));
 
     // Call the native function.
     asm_.push(0);
@@ -1630,13 +3696,7 @@ void CompilerAsmjit::EmitSysreqCHelper() {
     asm_.xchg(eax, edi);
 
     // Switch back to the AMX stack.
-    asm_.mov(edx, dword_ptr(amx_ptr_label_));
-    asm_.mov(dword_ptr(ebp_label_), ebp);
-    asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, frm)));
-    asm_.lea(ebp, dword_ptr(ebx, ecx)); // ebp = data + amx->frm
-    asm_.mov(dword_ptr(esp_label_), esp);
-    asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, stk)));
-    asm_.lea(esp, dword_ptr(ebx, ecx)); // ebp = data + amx->stk
+    EmitSwitchToAmxStack();
 
     // Check for errors.
     asm_.cmp(edi, AMX_ERR_NONE);
@@ -1653,16 +3713,16 @@ void CompilerAsmjit::EmitSysreqDHelper() {
     asm_.mov(esi, dword_ptr(esp));
     asm_.lea(esp, dword_ptr(esp, 4));
     asm_.mov(ecx, esp);
-
-    asm_.mov(edx, dword_ptr(amx_ptr_label_));
+    asm_.mov(edi, AbsPtr(&current_rib));
+    asm_.mov(edx, RibPtr(edi, offsetof(RuntimeInfoBlock, amx)));
 
     // Switch to the native stack.
     asm_.sub(ebp, ebx);
     asm_.mov(dword_ptr(edx, offsetof(AMX, frm)), ebp); // amx->frm = ebp - data
-    asm_.mov(ebp, dword_ptr(ebp_label_));
+    asm_.mov(ebp, RibPtr(edi, offsetof(RuntimeInfoBlock, ebp)));
     asm_.sub(esp, ebx);
     asm_.mov(dword_ptr(edx, offsetof(AMX, stk)), esp); // amx->stk = esp - data
-    asm_.mov(esp, dword_ptr(esp_label_));
+    asm_.mov(esp, RibPtr(edi, offsetof(RuntimeInfoBlock, esp)));
 
     // Call the native function.
     asm_.push(ecx); // params
@@ -1671,20 +3731,312 @@ void CompilerAsmjit::EmitSysreqDHelper() {
     asm_.add(esp, 8);
 
     // Switch back to the AMX stack.
-    asm_.mov(edx, dword_ptr(amx_ptr_label_));
-    asm_.mov(dword_ptr(ebp_label_), ebp);
-    asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, frm)));
-    asm_.lea(ebp, dword_ptr(ebx, ecx)); // ebp = data + amx->frm
-    asm_.mov(dword_ptr(esp_label_), esp);
-    asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, stk)));
-    asm_.lea(esp, dword_ptr(ebx, ecx)); // ebp = data + amx->stk
+    EmitSwitchToAmxStack();
 
     // Modify the return address so we return next to the sysreq point.
     asm_.push(esi);
     asm_.ret();
 }
 
+// Switches from the native stack back to the AMX stack after calling a
+// native function. Clobbers ecx and edx.
+void CompilerAsmjit::EmitSwitchToAmxStack() {
+  // The native may have run another script, so the RIB is loaded again.
+  asm_.mov(ecx, AbsPtr(&current_rib));
+  asm_.mov(RibPtr(ecx, offsetof(RuntimeInfoBlock, ebp)), ebp);
+  asm_.mov(RibPtr(ecx, offsetof(RuntimeInfoBlock, esp)), esp);
+  asm_.mov(edx, RibPtr(ecx, offsetof(RuntimeInfoBlock, amx)));
+  asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, frm)));
+  asm_.lea(ebp, dword_ptr(ebx, ecx)); // ebp = data + amx->frm
+  asm_.mov(ecx, dword_ptr(edx, offsetof(AMX, stk)));
+  asm_.lea(esp, dword_ptr(ebx, ecx)); // esp = data + amx->stk
+}
+
+// void InterpHelper(int index [edx]);
+void CompilerAsmjit::EmitInterpHelper() {
+  EmitEnterHelper(interp_helper_label_,
+                  reinterpret_cast<asmjit::Ptr>(&InterpEntry));
+}
+
+// void RecompileHelper(int index [edx]);
+void CompilerAsmjit::EmitRecompileHelper() {
+  EmitEnterHelper(recompile_helper_label_,
+                  reinterpret_cast<asmjit::Ptr>(&RecompileEntry));
+}
+
+// Emits a helper that is jumped to on entry to a function with the index
+// of the function in edx. It calls entry(rib, index) on the native stack
+// and jumps to the address it returns (like EmitTier0Helper()).
+void CompilerAsmjit::EmitEnterHelper(const Label &label, asmjit::Ptr entry) {
+  Label halt_label = asm_.newLabel();
+
+  asm_.bind(label);
+    // Pass the registers to the interpreter via the AMX structure.
+    asm_.mov(edi, AbsPtr(&current_rib));
+    asm_.mov(esi, RibPtr(edi, offsetof(RuntimeInfoBlock, amx)));
+    asm_.mov(dword_ptr(esi, offsetof(AMX, pri)), eax);
+    asm_.mov(dword_ptr(esi, offsetof(AMX, alt)), ecx);
+
+    // Switch to the native stack. The return address stays on top of the
+    // AMX stack unless entry() pops it.
+    asm_.sub(ebp, ebx);
+    asm_.mov(dword_ptr(esi, offsetof(AMX, frm)), ebp); // amx->frm = ebp - data
+    asm_.mov(ebp, RibPtr(edi, offsetof(RuntimeInfoBlock, ebp)));
+    asm_.sub(esp, ebx);
+    asm_.mov(dword_ptr(esi, offsetof(AMX, stk)), esp); // amx->stk = esp - data
+    asm_.mov(esp, RibPtr(edi, offsetof(RuntimeInfoBlock, esp)));
+
+    asm_.push(edx);
+    asm_.push(edi);
+    asm_.call(entry);
+    asm_.add(esp, 8);
+    asm_.mov(edx, eax);
+
+    // Switch back to the AMX stack.
+    asm_.mov(edi, AbsPtr(&current_rib));
+    asm_.mov(esi, RibPtr(edi, offsetof(RuntimeInfoBlock, amx)));
+    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, frm)));
+    asm_.lea(ebp, dword_ptr(ebx, ecx)); // ebp = data + amx->frm
+    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, stk)));
+    asm_.lea(esp, dword_ptr(ebx, ecx)); // esp = data + amx->stk
+    asm_.mov(eax, dword_ptr(esi, offsetof(AMX, pri)));
+    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, alt)));
+
+    // Jump to the return address or to the function's code.
+    asm_.test(edx, edx);
+    asm_.jz(halt_label);
+    asm_.jmp(edx);
+
+  asm_.bind(halt_label);
+    asm_.mov(edi, dword_ptr(esi, offsetof(AMX, error)));
+    asm_.jmp(halt_helper_label_);
+}
+
+// void CodeWriteHelper(cell address [edx], cell size [esi]);
+void CompilerAsmjit::EmitCodeWriteHelper() {
+  asm_.bind(code_write_helper_label_);
+    asm_.push(eax);
+    asm_.push(ecx);
+
+    // Switch to the native stack.
+    asm_.mov(ecx, AbsPtr(&current_rib));
+    asm_.mov(eax, esi);
+    asm_.mov(esi, esp);
+    asm_.mov(edi, ebp);
+    asm_.mov(ebp, RibPtr(ecx, offsetof(RuntimeInfoBlock, ebp)));
+    asm_.mov(esp, RibPtr(ecx, offsetof(RuntimeInfoBlock, esp)));
+
+    asm_.push(eax);
+    asm_.push(edx);
+    asm_.push(ecx);
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&CodeWriteEntry));
+    asm_.add(esp, 12);
+
+    // Switch back to the AMX stack.
+    asm_.mov(esp, esi);
+    asm_.mov(ebp, edi);
+
+    asm_.pop(ecx);
+    asm_.pop(eax);
+    asm_.ret();
+}
+
+// void Tier0Helper(int index [edx]);
+void CompilerAsmjit::EmitTier0Helper() {
+  Label halt_label = asm_.newLabel();
+
+  asm_.bind(tier0_helper_label_);
+    // Pass the registers to the interpreter via the AMX structure.
+    asm_.mov(esi, AbsPtr(&rib_->amx));
+    asm_.mov(dword_ptr(esi, offsetof(AMX, pri)), eax);
+    asm_.mov(dword_ptr(esi, offsetof(AMX, alt)), ecx);
+
+    // Switch to the native stack. The return address stays on top of the
+    // AMX stack and is popped by the interpreter.
+    asm_.sub(ebp, ebx);
+    asm_.mov(dword_ptr(esi, offsetof(AMX, frm)), ebp); // amx->frm = ebp - data
+    asm_.mov(ebp, AbsPtr(&rib_->ebp));
+    asm_.sub(esp, ebx);
+    asm_.mov(dword_ptr(esi, offsetof(AMX, stk)), esp); // amx->stk = esp - data
+    asm_.mov(esp, AbsPtr(&rib_->esp));
+
+    // Run the function in the interpreter (or compile it).
+    asm_.push(edx);
+    asm_.push(asmjit::imm_ptr(rib_));
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&Tier0Entry));
+    asm_.add(esp, 8);
+    asm_.mov(edx, eax);
+
+    // Switch back to the AMX stack.
+    asm_.mov(esi, AbsPtr(&rib_->amx));
+    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, frm)));
+    asm_.lea(ebp, dword_ptr(ebx, ecx)); // ebp = data + amx->frm
+    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, stk)));
+    asm_.lea(esp, dword_ptr(ebx, ecx)); // esp = data + amx->stk
+    asm_.mov(eax, dword_ptr(esi, offsetof(AMX, pri)));
+    asm_.mov(ecx, dword_ptr(esi, offsetof(AMX, alt)));
+
+    // Jump to the return address or to the compiled function.
+    asm_.test(edx, edx);
+    asm_.jz(halt_label);
+    asm_.jmp(edx);
+
+  asm_.bind(halt_label);
+    asm_.mov(edi, dword_ptr(esi, offsetof(AMX, error)));
+    asm_.jmp(CodePtr(rib_->halt_helper));
+}
+
+// void OptimizeHelper(int index [edx]);
+void CompilerAsmjit::EmitOptimizeHelper() {
+  asm_.bind(optimize_helper_label_);
+    asm_.push(eax);
+    asm_.push(ecx);
+
+    // Switch to the native stack.
+    asm_.mov(esi, esp);
+    asm_.mov(edi, ebp);
+    asm_.mov(ebp, AbsPtr(&rib_->ebp));
+    asm_.mov(esp, AbsPtr(&rib_->esp));
+
+    asm_.push(edx);
+    asm_.push(asmjit::imm_ptr(rib_));
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&RequestOptimization));
+    asm_.add(esp, 8);
+
+    // Switch back to the AMX stack.
+    asm_.mov(esp, esi);
+    asm_.mov(ebp, edi);
+
+    asm_.pop(ecx);
+    asm_.pop(eax);
+    asm_.ret();
+}
+
+// void OSRHelper(int index [edx], cell address [edi]);
+void CompilerAsmjit::EmitOSRHelper() {
+  Label no_code_label = asm_.newLabel();
+
+  asm_.bind(osr_helper_label_);
+    asm_.push(eax);
+    asm_.push(ecx);
+    asm_.mov(eax, edi);
+
+    // Switch to the native stack.
+    asm_.mov(esi, esp);
+    asm_.mov(edi, ebp);
+    asm_.mov(ebp, AbsPtr(&rib_->ebp));
+    asm_.mov(esp, AbsPtr(&rib_->esp));
+
+    asm_.push(eax);
+    asm_.push(edx);
+    asm_.push(asmjit::imm_ptr(rib_));
+    asm_.call(reinterpret_cast<asmjit::Ptr>(&EnterOptimizedCode));
+    asm_.add(esp, 12);
+    asm_.mov(edx, eax); // address
+
+    // Switch back to the AMX stack.
+    asm_.mov(esp, esi);
+    asm_.mov(ebp, edi);
+
+    asm_.pop(ecx);
+    asm_.pop(eax);
+    asm_.test(edx, edx);
+    asm_.jz(no_code_label);
+
+    // Both versions of the code use the same registers and stack layout,
+    // so the loop simply continues in the new code.
+    asm_.lea(esp, dword_ptr(esp, 4));
+    asm_.jmp(edx);
+
+  asm_.bind(no_code_label);
+    asm_.ret();
+}
+
+void CompilerAsmjit::EmitOSRCheck() {
+  Label skip_label = asm_.newLabel();
+  asm_.cmp(AbsPtr(&output_->ready_[function_]), 0);
+  asm_.je(skip_label);
+  asm_.mov(edx, function_);
+  asm_.mov(edi, cip_);
+  asm_.call(CodePtr(rib_->osr_helper));
+  asm_.bind(skip_label);
+}
+
+void CompilerAsmjit::EmitCodeWriteCheck(const asmjit::X86GpReg &address,
+                                        cell size) {
+  if (!output_->check_code_writes_) {
+    return;
+  }
+  Label skip_label = asm_.newLabel();
+  asm_.test(address, address);
+  asm_.jns(skip_label);
+  asm_.mov(edx, address);
+  asm_.mov(esi, size);
+  asm_.call(CodePtr(rib_->code_write_helper));
+  asm_.bind(skip_label);
+}
+
+void CompilerAsmjit::EmitCodeWriteCheck(cell address, cell size) {
+  if (!output_->check_code_writes_ || address >= 0) {
+    return;
+  }
+  asm_.mov(edx, address);
+  asm_.mov(esi, size);
+  asm_.call(CodePtr(rib_->code_write_helper));
+}
+
+// Finds the targets of backward jumps: these are the only places where
+// a running loop can be moved to the optimized code.
+void CompilerAsmjit::FindLoopHeaders(const Function &function) {
+  Disassembler disasm(amx_, function.address());
+  Instruction instr;
+
+  while (disasm.Decode(instr) && instr.address() < function.end_address()) {
+    switch (instr.opcode().GetId()) {
+      case OP_JUMP_PRI:
+        break;
+      default:
+        if (instr.opcode().IsJump()) {
+          cell target = GetJumpTarget(amx_, instr);
+          if (target <= instr.address() && function.Contains(target)) {
+            loop_headers_.insert(target);
+          }
+        }
+    }
+  }
+}
+
+void CompilerAsmjit::EmitHotnessCheck() {
+  if (function_ < 0 || optimize_ || output_->hotness_limit_ <= 0) {
+    return;
+  }
+
+  // Flags are not preserved, so this must be emitted before the code of
+  // an instruction, not in the middle of it.
+  Label skip_label = asm_.newLabel();
+  asmjit::X86Mem counter = AbsPtr(&output_->hotness_[function_]);
+  asm_.inc(counter);
+  asm_.cmp(counter, output_->hotness_limit_);
+  asm_.jne(skip_label);
+  asm_.mov(edx, function_);
+  asm_.call(CodePtr(rib_->optimize_helper));
+  asm_.bind(skip_label);
+}
+
+void CompilerAsmjit::EmitLoadAmx(const asmjit::X86GpReg &reg) {
+  asm_.mov(reg, AbsPtr(&rib_->amx));
+  // The address is the last operand of the instruction.
+  data_relocs_.push_back(
+    static_cast<std::ptrdiff_t>(asm_.getCodeSize() - sizeof(intptr_t)));
+}
+
 const Label &CompilerAsmjit::GetLabel(cell address) {
+  if (function_ >= 0
+      && !functions_->GetFunction(function_).Contains(address)) {
+    // Functions compiled separately can't refer to each other's labels.
+    error_ = true;
+  }
+
   Label &label = label_map_[address];
   if (label.getId() == asmjit::kInvalidValue) {
     label = asm_.newLabel();
@@ -26,15 +26,40 @@
 #define AMXJIT_COMPILER_ASMJIT_H
 
 #include <cstddef>
+#include <deque>
 #include <map>
+#include <set>
+#include <string>
+#include <vector>
 #include <asmjit/base.h>
 #include <asmjit/x86.h>
 #include "amxref.h"
+#include "codecache.h"
 #include "compiler.h"
+#include "cstdint.h"
+#include "function.h"
+#include "interp.h"
 #include "macros.h"
+#include "optimizer.h"
+#include "sharedcode.h"
+#include "thread.h"
+#include "threadpool.h"
 
 namespace amxjit {
 
+class CompileOutputAsmjit;
+struct RuntimeInfoBlock;
+
+// The code of a single function compiled in tiered mode.
+struct CompiledFunction {
+  int index;
+  void *code;
+  void *start;
+  std::size_t size;
+  std::map<cell, std::ptrdiff_t> instr_map;
+  std::vector<CallSite> call_sites;
+};
+
 class CompilerAsmjit: public Compiler {
  public:
   typedef void (CompilerAsmjit::*EmitIntrinsicMethod)();
@@ -42,10 +67,37 @@ class CompilerAsmjit: public Compiler {
   CompilerAsmjit();
   virtual ~CompilerAsmjit();
 
+  // Compiles a single function of a script that was compiled in tiered
+  // mode. If optimize is true the function's instructions are passed
+  // through the optimizer first. Returns null on error. This doesn't
+  // modify the output, so optimized code can be compiled in background.
+  CompiledFunction *CompileFunction(CompileOutputAsmjit *output,
+                                    int index,
+                                    bool optimize);
+
+  // Compiles a single function into a relocatable image. Calls to other
+  // functions are left for the caller to link. Index -1 means the code
+  // before the first function.
+  bool CompileImage(CompileOutputAsmjit *output, int index, CodeImage &image);
+
+  // Compiles the script ahead of time and saves the code to the cache
+  // directory (see SetCacheDir()). Returns false on error.
+  bool CompileToCache(AMXRef amx);
+
+  // Checks that the cache contains valid code for the script, identical
+  // to what it would compile now.
+  bool VerifyCache(AMXRef amx);
+
+  // Reserves a block of memory of the specified size for the code of all
+  // scripts, optionally backing hot code by huge pages. This should be done
+  // before anything is compiled. Code that doesn't fit goes elsewhere.
+  static bool SetUpCodeArena(std::size_t size, bool huge_pages);
+
  protected:
-  virtual bool Prepare(AMXRef amx);
+  virtual bool Prepare(AMXRef amx, const FunctionTable &functions);
   virtual bool Process(const Instruction &instr);
   virtual CompileOutput *Finish(bool error);
+  virtual bool CompileScript(AMXRef amx, const FunctionTable &functions);
 
  protected:
   virtual void load_pri(cell address);
@@ -60,6 +112,8 @@ class CompilerAsmjit: public Compiler {
   virtual void lodb_i(cell number);
   virtual void const_pri(cell value);
   virtual void const_alt(cell value);
+  virtual void const_(cell address, cell value);
+  virtual void const_s(cell offset, cell value);
   virtual void addr_pri(cell offset);
   virtual void addr_alt(cell offset);
   virtual void stor_pri(cell address);
@@ -85,6 +139,7 @@ class CompilerAsmjit: public Compiler {
   virtual void xchg();
   virtual void push_pri();
   virtual void push_alt();
+  virtual void push_r(cell value);
   virtual void push_c(cell value);
   virtual void push(cell address) ;
   virtual void push_s(cell offset);
@@ -95,7 +150,9 @@ class CompilerAsmjit: public Compiler {
   virtual void proc();
   virtual void ret();
   virtual void retn();
+  virtual void retn_c(cell num_bytes);
   virtual void call(cell address);
+  virtual void call_pri();
   virtual void jump_pri();
   virtual void jump(cell address);
   virtual void jzer(cell address);
@@ -191,38 +248,99 @@ class CompilerAsmjit: public Compiler {
   void floatcmp();
 
  private:
-  void EmitRuntimeInfo();
-  void EmitInstrTable();
+  bool EmitRuntime();
+  bool EmitSharedRuntime();
   void EmitExec();
+  void EmitExecChecks(const asmjit::Label &stack_heap_overflow_label,
+                      const asmjit::Label &stack_underflow_label,
+                      const asmjit::Label &heap_underflow_label);
   void EmitExecHelper();
+  void EmitCallHelper();
   void EmitHaltHelper();
   void EmitJumpHelper();
   void EmitSysreqCHelper();
   void EmitSysreqDHelper();
+  void EmitSwitchToAmxStack();
+  void EmitEnterHelper(const asmjit::Label &label, asmjit::Ptr entry);
+  void EmitInterpHelper();
+  void EmitRecompileHelper();
+  void EmitCodeWriteHelper();
+  void EmitTier0Helper();
+  void EmitOptimizeHelper();
+  void EmitOSRHelper();
+  void EmitHotnessCheck();
+  void EmitOSRCheck();
+
+  // Makes the code that has just been emitted report writes to the code
+  // section (negative addresses) if the script may modify its code.
+  void EmitCodeWriteCheck(const asmjit::X86GpReg &address, cell size);
+  void EmitCodeWriteCheck(cell address, cell size);
+
+  void FindLoopHeaders(const Function &function);
+
+  // Loads the AMX pointer from the runtime info block into a register.
+  void EmitLoadAmx(const asmjit::X86GpReg &reg);
+
+  // Translates the instructions of a single function into asm_. Index -1
+  // means the code before the first function.
+  void BeginFunction(CompileOutputAsmjit *output, int index, bool optimize);
+  bool EmitFunction(CompileOutputAsmjit *output, int index, bool optimize);
+  bool MakeImage(int index, CodeImage &image);
+
+  // Makes an image that runs the function in the AMX interpreter (see
+  // Compiler::SetFallbackExec()).
+  bool CompileInterpImage(CompileOutputAsmjit *output,
+                          int index,
+                          CodeImage &image);
+
+  // If interp_failed is true functions that fail to compile are run in
+  // the interpreter instead.
+  bool CompileImages(std::vector<CodeImage> &images,
+                     bool interp_failed = false);
+  static void CompileImageTask(void *arg, int thread, int task);
+
+  // Loads the images from the cache, if any, or compiles them.
+  bool GetImages(const CodeCache *cache, std::vector<CodeImage> &images);
+
+  void SetUpLogger();
+  void TearDownLogger();
 
  private:
   const asmjit::Label &GetLabel(cell address);
 
  private:
   AMXRef amx_;
+  const FunctionTable *functions_;
+  CompileOutputAsmjit *output_;
+  RuntimeInfoBlock *rib_;
+
+  // Index of the function being compiled in tiered mode or -1 if the
+  // whole script is compiled at once.
+  int function_;
+  bool optimize_;
+  bool error_;
+  cell cip_;
 
   asmjit::X86Assembler asm_;
-  asmjit::Label rib_start_label_;
-  asmjit::Label exec_ptr_label_;
-  asmjit::Label amx_ptr_label_;
-  asmjit::Label ebp_label_;
-  asmjit::Label esp_label_;
-  asmjit::Label reset_ebp_label_;
-  asmjit::Label reset_esp_label_;
   asmjit::Label exec_label_;
   asmjit::Label exec_helper_label_;
+  asmjit::Label call_helper_label_;
   asmjit::Label halt_helper_label_;
   asmjit::Label jump_helper_label_;
   asmjit::Label sysreq_c_helper_label_;
   asmjit::Label sysreq_d_helper_label_;
+  asmjit::Label interp_helper_label_;
+  asmjit::Label recompile_helper_label_;
+  asmjit::Label code_write_helper_label_;
+  asmjit::Label tier0_helper_label_;
+  asmjit::Label optimize_helper_label_;
+  asmjit::Label osr_helper_label_;
 
   std::map<cell, asmjit::Label> label_map_;
   std::map<cell, std::ptrdiff_t> instr_map_;
+  std::set<cell> loop_headers_;
+  std::vector<CallSite> call_sites_;
+  std::vector<std::ptrdiff_t> data_relocs_;
 
   asmjit::Logger *logger_;
 
@@ -230,23 +348,274 @@ class CompilerAsmjit: public Compiler {
   AMXJIT_DISALLOW_COPY_AND_ASSIGN(CompilerAsmjit);
 };
 
-class CompileOutputAsmjit: public CompileOutput {
+// Instruction table entries map AMX addresses to machine code. Only jump
+// targets, function entries, return addresses and addresses used as
+// constants (e.g. through #emit) are mapped.
+struct InstrTableEntry {
+  InstrTableEntry(): address(), start() {}
+  InstrTableEntry(cell address): address(address), start() {}
+  bool operator<(const InstrTableEntry &other) const {
+    return address < other.address;
+  }
+  cell address;
+  void *start;
+};
+
+class CompileOutputAsmjit: public CompileOutput, private InterpreterHost {
+ friend class CloneOutputAsmjit;
+ friend class CompilerAsmjit;
+
  public:
-  CompileOutputAsmjit(void *code);
+  CompileOutputAsmjit(AMXRef amx, const FunctionTable &functions);
   virtual ~CompileOutputAsmjit();
 
   virtual void *GetCode() const;
+  virtual std::size_t GetCodeSize() const;
   virtual EntryPoint GetEntryPoint() const;
+  virtual bool IsFromCache() const;
+  virtual void GetInstrTableSize(std::size_t &size,
+                                 std::size_t &full_size) const;
+  virtual void GetDedupeStats(int &num_shared,
+                              int &num_functions,
+                              std::size_t &bytes_saved) const;
+  virtual void GetTierStats(int &num_interpreted,
+                            int &num_compiled,
+                            int &num_optimized) const;
+  virtual bool GetConstantResult(int index, cell &value) const;
+  virtual CompileOutput *Clone(AMXRef amx);
 
+  // The output is deleted when it's no longer used by its clones either.
   virtual void Delete();
 
+  // Returns the start of the code of the instruction at the specified
+  // address. In tiered mode this forces compilation of the function
+  // containing the instruction.
+  void *GetInstrStart(cell address);
+
+  // Returns the entry point of the function at the specified address:
+  // either its compiled code or a stub that calls the interpreter.
+  void *GetFunctionStart(cell address);
+
+  // Returns the entry point of a public function (or main). Outside of
+  // tiered mode the result is remembered for the fast path of Exec.
+  void *GetPublicStart(int index);
+
+  // Called when a function is entered through its stub. Returns the
+  // address to which the caller should jump or null if execution was
+  // aborted (the error code is stored in amx->error).
+  void *EnterFunction(int index);
+
+  // Called by compiled code when a function becomes hot. The function is
+  // queued for optimization on a background thread.
+  void RequestOptimization(int index);
+
+  // Called by baseline code at loop headers once the optimized code of the
+  // function is ready. Returns the optimized code of the instruction at the
+  // specified address, which is where the loop continues (on-stack
+  // replacement), or null.
+  void *EnterOptimizedCode(int index, cell address);
+
+  // Called when a function that couldn't be compiled is entered. Runs it
+  // in the AMX interpreter and returns the address to which the caller
+  // should jump or null if execution was aborted.
+  void *RunInInterpreter(AMXRef amx, int index);
+
+  // Called by compiled code after it writes to the code section. The
+  // functions containing the modified code are recompiled the next time
+  // they are called.
+  void OnCodeWrite(cell address, cell size);
+
+  // Called when a function modified by the script is entered. Works like
+  // EnterFunction().
+  void *EnterModifiedFunction(AMXRef amx, int index);
+
  private:
-  void *code_;
+  void EnableTiering(CompilerAsmjit *compiler,
+                     int threshold,
+                     bool background_optimization);
+
+  // Finds the instructions that need an entry in the instruction table:
+  // everything that can be reached other than by falling through or by a
+  // direct jump from compiled code.
+  void FindTableTargets();
+  bool IsTableTarget(cell address) const;
+
+  // Finds the publics whose code is a constant return (see
+  // GetConstantResult()).
+  void FindConstantPublics();
+
+  // Makes every version of the function's code jump to the recompile stub.
+  void InvalidateFunction(int index);
+  void *RecompileFunction(int index);
+
+  void AddCode(void *code,
+               std::size_t size,
+               const std::map<cell, std::ptrdiff_t> &instr_map);
+
+  // Lays out separately compiled code images in the order in which they
+  // appear in the vector and resolves the calls between them. If dedupe is
+  // true functions that are identical to those of other scripts use their
+  // code instead.
+  bool Link(const std::vector<CodeImage> &images, bool dedupe);
+
+  // Same as Link() but places the code in a new shared code segment and
+  // publishes it for other processes.
+  bool LinkShared(const std::vector<CodeImage> &images, SharedCode *shared);
+
+  // Uses code published by another process. On success the output takes
+  // ownership of the segment.
+  bool AttachShared(SharedCode *shared);
+
+  // Images that already have a base address (e.g. from the function pool)
+  // are skipped; the others get one in LinkImages().
+  std::size_t LayOutImages(const std::vector<CodeImage> &images,
+                           const std::vector<unsigned char*> &bases,
+                           std::vector<std::size_t> &offsets) const;
+  void LinkImages(const std::vector<CodeImage> &images,
+                  const std::vector<std::size_t> &offsets,
+                  unsigned char *code,
+                  std::vector<unsigned char*> &bases);
+  bool SetUpLocalArea(SharedCode *shared) const;
+
+  // Finds the images that are identical to functions of other scripts in
+  // the function pool and adds the rest of them to the pool, if possible.
+  void PoolImages(const std::vector<CodeImage> &images,
+                  std::vector<unsigned char*> &bases);
+
+  // Computes the key of the image at the specified index. The key doesn't
+  // depend on where the function is located and includes the hashes of
+  // the keys of the callees, so functions are only considered identical if
+  // they call identical functions. Functions that can't be shared get an
+  // empty key. The order vector receives the images callees first.
+  void GetPoolKey(const std::vector<CodeImage> &images,
+                  const std::vector<int> &image_index,
+                  int index,
+                  std::vector<std::string> &keys,
+                  std::vector<uint64_t> &hashes,
+                  std::vector<int> &state,
+                  std::vector<int> &order) const;
+
+  // Returns the addresses of the helper functions that compiled code may
+  // call (for caching).
+  std::vector<intptr_t> GetSymbols() const;
+  void Install(CompiledFunction *function);
+  void PatchCall(unsigned char *call_end, void *target);
+  void *CompileFunction(int index);
+  bool ShouldCompile(int index) const;
+  void *FindInstrStart(cell address) const;
+
+  // Replaces the baseline code of the functions that have been optimized
+  // since the last call. Must be called only at a safe point (between
+  // Exec calls): the old code stays alive as long as the output.
+  void InstallOptimizedCode();
+
+  static void RunWorker(void *arg);
+  void OptimizeFunctions();
+
+  virtual bool Call(int index, bool &halted);
+  virtual void *GetCompiledCode(cell address);
+
+ private:
+  AMXRef amx_;
+  FunctionTable functions_;
+  RuntimeInfoBlock *rib_;
+  void *runtime_;
+  std::vector<void*> code_;
+  SharedCode *shared_;
+  bool linked_;
+  bool from_cache_;
+  ExecFunction fallback_exec_;
+  std::size_t code_size_;
+  std::vector<void*> public_starts_; // main followed by the publics
+  std::vector<int> constant_publics_; // function indices or -1, same order
+  std::vector<InstrTableEntry> instr_table_;
+  std::vector<bool> table_targets_;
+  bool map_all_instrs_;
+
+  // Self-modifying code support (whole script mode only). Scripts that
+  // read the COD or DAT registers may compute code addresses and write to
+  // them, so their stores are checked.
+  enum {
+    kUnmodified,
+    kModified,
+    kInterpreted
+  };
+  bool reads_code_address_;
+  bool check_code_writes_;
+  std::vector<char> modified_;
+  std::vector<std::vector<unsigned char*> > entries_;
+  std::vector<void*> recompile_stubs_;
+  std::size_t num_instrs_;
+  std::vector<uint64_t> pooled_;
+  int num_shared_;
+  std::size_t bytes_saved_;
+  int refs_;
+
+  // Tiered mode only.
+  CompilerAsmjit *compiler_;
+  Interpreter *interpreter_;
+  int threshold_;
+  std::vector<void*> entry_table_;
+  std::vector<void*> stubs_;
+  std::vector<std::vector<unsigned char*> > call_sites_;
+  std::vector<void*> compiled_;
+  std::vector<int> calls_;
+  std::vector<bool> failed_;
+
+  // Optimizing tier (also tiered mode only).
+  Optimizer *optimizer_;
+  CompilerAsmjit *optimizing_compiler_;
+  std::vector<cell> hotness_;
+  std::vector<cell> ready_;
+  cell hotness_limit_;
+  bool background_optimization_;
+  int num_optimized_;
+  Thread *worker_;
+  Mutex mutex_;
+  Event work_event_;
+  std::deque<int> queue_;
+  std::vector<CompiledFunction*> finished_;
+  bool stop_;
 
  private:
   AMXJIT_DISALLOW_COPY_AND_ASSIGN(CompileOutputAsmjit);
 };
 
+// Runs the code of another output for a clone of its script. Only the
+// runtime info block and the entry point are separate.
+class CloneOutputAsmjit: public CompileOutput {
+ public:
+  CloneOutputAsmjit(CompileOutputAsmjit *output, AMXRef amx);
+  virtual ~CloneOutputAsmjit();
+
+  // Emits the entry point. Returns false on error.
+  bool Init();
+
+  virtual void *GetCode() const;
+  virtual std::size_t GetCodeSize() const;
+  virtual EntryPoint GetEntryPoint() const;
+  virtual bool IsFromCache() const;
+  virtual void GetInstrTableSize(std::size_t &size,
+                                 std::size_t &full_size) const;
+  virtual void GetDedupeStats(int &num_shared,
+                              int &num_functions,
+                              std::size_t &bytes_saved) const;
+  virtual void GetTierStats(int &num_interpreted,
+                            int &num_compiled,
+                            int &num_optimized) const;
+  virtual bool GetConstantResult(int index, cell &value) const;
+  virtual CompileOutput *Clone(AMXRef amx);
+  virtual void Delete();
+
+ private:
+  CompileOutputAsmjit *output_;
+  RuntimeInfoBlock *rib_;
+  void *exec_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(CloneOutputAsmjit);
+};
+
 } // namespace amxjit
 
 #endif // !AMXJIT_COMPILER_ASMJIT_H
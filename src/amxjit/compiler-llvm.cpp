@@ -100,6 +100,14 @@ void CompilerLLVM::const_alt(cell value) {
   // ALT = value
 }
 
+void CompilerLLVM::const_(cell address, cell value) {
+  // [address] = value
+}
+
+void CompilerLLVM::const_s(cell offset, cell value) {
+  // [FRM + offset] = value
+}
+
 void CompilerLLVM::addr_pri(cell offset) {
   // PRI = FRM + offset
 }
@@ -204,6 +212,10 @@ void CompilerLLVM::push_alt() {
   // [STK] = ALT, STK = STK - cell size
 }
 
+void CompilerLLVM::push_r(cell value) {
+  // Repeat value: [STK] = PRI, STK = STK - cell size
+}
+
 void CompilerLLVM::push_c(cell value) {
   // [STK] = value, STK = STK - cell size
 }
@@ -258,6 +270,11 @@ void CompilerLLVM::call(cell address) {
   // but the address on the stack is an absolute address.
 }
 
+void CompilerLLVM::call_pri() {
+  // [STK] = CIP, STK = STK - cell size
+  // CIP = PRI (indirect call)
+}
+
 void CompilerLLVM::jump_pri() {
   // CIP = PRI (indirect jump)
 }
@@ -57,6 +57,8 @@ class CompilerLLVM: public Compiler {
   virtual void lodb_i(cell number);
   virtual void const_pri(cell value);
   virtual void const_alt(cell value);
+  virtual void const_(cell address, cell value);
+  virtual void const_s(cell offset, cell value);
   virtual void addr_pri(cell offset);
   virtual void addr_alt(cell offset);
   virtual void stor_pri(cell address);
@@ -82,6 +84,7 @@ class CompilerLLVM: public Compiler {
   virtual void xchg();
   virtual void push_pri();
   virtual void push_alt();
+  virtual void push_r(cell value);
   virtual void push_c(cell value);
   virtual void push(cell address) ;
   virtual void push_s(cell offset);
@@ -93,6 +96,7 @@ class CompilerLLVM: public Compiler {
   virtual void ret();
   virtual void retn();
   virtual void call(cell address);
+  virtual void call_pri();
   virtual void jump_pri();
   virtual void jump(cell address);
   virtual void jzer(cell address);
@@ -193,10 +197,44 @@ class CompileOutputLLVM: public CompileOutput {
     return 0;
   }
 
+  virtual std::size_t GetCodeSize() const {
+    return 0;
+  }
+
   virtual EntryPoint GetEntryPoint() const {
     return 0;
   }
 
+  virtual bool IsFromCache() const {
+    return false;
+  }
+
+  virtual void GetInstrTableSize(std::size_t &size,
+                                 std::size_t &full_size) const {
+    size = full_size = 0;
+  }
+
+  virtual void GetDedupeStats(int &num_shared,
+                              int &num_functions,
+                              std::size_t &bytes_saved) const {
+    num_shared = num_functions = 0;
+    bytes_saved = 0;
+  }
+
+  virtual void GetTierStats(int &num_interpreted,
+                            int &num_compiled,
+                            int &num_optimized) const {
+    num_interpreted = num_compiled = num_optimized = 0;
+  }
+
+  virtual bool GetConstantResult(int index, cell &value) const {
+    return false;
+  }
+
+  virtual CompileOutput *Clone(AMXRef amx) {
+    return 0;
+  }
+
   virtual void Delete() {
     return;
   }
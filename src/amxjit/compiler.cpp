@@ -24,13 +24,20 @@
 
 #include "compiler.h"
 #include "disasm.h"
+#include "function.h"
 #include "logger.h"
 
 namespace amxjit {
 
 Compiler::Compiler():
   logger_(),
-  error_handler_()
+  error_handler_(),
+  tier_up_threshold_(0),
+  background_optimization_(true),
+  num_threads_(1),
+  share_code_(false),
+  dedupe_(false),
+  fallback_exec_()
 {
 }
 
@@ -38,447 +45,592 @@ Compiler::~Compiler() {
 }
 
 CompileOutput *Compiler::Compile(AMXRef amx) {
-  Prepare(amx);
+  FunctionTable functions(amx);
+  bool error = !Prepare(amx, functions);
 
-  Disassembler disasm(amx);
+  // In tiered mode the backend compiles functions as they get hot.
+  if (!error && tier_up_threshold_ <= 0) {
+    error = !CompileScript(amx, functions);
+  }
+
+  return Finish(error);
+}
+
+bool Compiler::CompileScript(AMXRef amx, const FunctionTable &functions) {
+  return CompileRange(amx, functions, 0, static_cast<cell>(amx.code_size()));
+}
+
+bool Compiler::CompileRange(AMXRef amx, const FunctionTable &functions,
+                            cell start, cell end) {
+  int function = functions.FindFunction(start);
+
+  Disassembler disasm(amx, start);
   Instruction instr;
   bool error = false;
 
   while (!error && disasm.Decode(instr, error)) {
-    if (!Process(instr)) {
-      error = true;
+    if (instr.address() >= end) {
       break;
     }
+    error = !CompileInstruction(amx, functions, function, instr);
+  }
 
-    switch (instr.opcode().GetId()) {
-      case OP_LOAD_PRI:
-        load_pri(instr.operand());
-        break;
-      case OP_LOAD_ALT:
-        load_alt(instr.operand());
-        break;
-      case OP_LOAD_S_PRI:
-        load_s_pri(instr.operand());
-        break;
-      case OP_LOAD_S_ALT:
-        load_s_alt(instr.operand());
-        break;
-      case OP_LREF_PRI:
-        lref_pri(instr.operand());
-        break;
-      case OP_LREF_ALT:
-        lref_alt(instr.operand());
-        break;
-      case OP_LREF_S_PRI:
-        lref_s_pri(instr.operand());
-        break;
-      case OP_LREF_S_ALT:
-        lref_s_alt(instr.operand());
-        break;
-      case OP_LOAD_I:
-        load_i();
-        break;
-      case OP_LODB_I:
-        lodb_i(instr.operand());
-        break;
-      case OP_CONST_PRI:
-        const_pri(instr.operand());
-        break;
-      case OP_CONST_ALT:
-        const_alt(instr.operand());
-        break;
-      case OP_ADDR_PRI:
-        addr_pri(instr.operand());
-        break;
-      case OP_ADDR_ALT:
-        addr_alt(instr.operand());
-        break;
-      case OP_STOR_PRI:
-        stor_pri(instr.operand());
-        break;
-      case OP_STOR_ALT:
-        stor_alt(instr.operand());
-        break;
-      case OP_STOR_S_PRI:
-        stor_s_pri(instr.operand());
-        break;
-      case OP_STOR_S_ALT:
-        stor_s_alt(instr.operand());
-        break;
-      case OP_SREF_PRI:
-        sref_pri(instr.operand());
-        break;
-      case OP_SREF_ALT:
-        sref_alt(instr.operand());
-        break;
-      case OP_SREF_S_PRI:
-        sref_s_pri(instr.operand());
-        break;
-      case OP_SREF_S_ALT:
-        sref_s_alt(instr.operand());
-        break;
-      case OP_STOR_I:
-        stor_i();
-        break;
-      case OP_STRB_I:
-        strb_i(instr.operand());
-        break;
-      case OP_LIDX:
-        lidx();
-        break;
-      case OP_LIDX_B:
-        lidx_b(instr.operand());
-        break;
-      case OP_IDXADDR:
-        idxaddr();
-        break;
-      case OP_IDXADDR_B:
-        idxaddr_b(instr.operand());
-        break;
-      case OP_ALIGN_PRI:
-        align_pri(instr.operand());
-        break;
-      case OP_ALIGN_ALT:
-        align_alt(instr.operand());
-        break;
-      case OP_LCTRL:
-        lctrl(instr.operand(), instr.address() + instr.size());
-        break;
-      case OP_SCTRL:
-        sctrl(instr.operand());
-        break;
-      case OP_MOVE_PRI:
-        move_pri();
-        break;
-      case OP_MOVE_ALT:
-        move_alt();
-        break;
-      case OP_XCHG:
-        xchg();
-        break;
-      case OP_PUSH_PRI:
-        push_pri();
-        break;
-      case OP_PUSH_ALT:
-        push_alt();
-        break;
-      case OP_PUSH_C:
+  if (error && error_handler_ != 0) {
+    error_handler_->Execute(instr);
+  }
+
+  return !error;
+}
+
+bool Compiler::CompileInstructions(AMXRef amx,
+                                   const FunctionTable &functions,
+                                   const std::vector<Instruction> &instrs) {
+  if (instrs.empty()) {
+    return true;
+  }
+
+  int function = functions.FindFunction(instrs.front().address());
+
+  for (std::size_t i = 0; i < instrs.size(); i++) {
+    if (!CompileInstruction(amx, functions, function, instrs[i])) {
+      if (error_handler_ != 0) {
+        error_handler_->Execute(instrs[i]);
+      }
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Compiler::CompileInstruction(AMXRef amx,
+                                  const FunctionTable &functions,
+                                  int &function,
+                                  const Instruction &instr) {
+  if (!Process(instr)) {
+    return false;
+  }
+
+  if (instr.opcode().GetId() == OP_PROC) {
+    function = functions.FindFunction(instr.address());
+  }
+
+  bool error = false;
+
+  switch (instr.opcode().GetId()) {
+    case OP_LOAD_PRI:
+      load_pri(instr.operand());
+      break;
+    case OP_LOAD_ALT:
+      load_alt(instr.operand());
+      break;
+    case OP_LOAD_S_PRI:
+      load_s_pri(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_LOAD_S_ALT:
+      load_s_alt(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_LREF_PRI:
+      lref_pri(instr.operand());
+      break;
+    case OP_LREF_ALT:
+      lref_alt(instr.operand());
+      break;
+    case OP_LREF_S_PRI:
+      lref_s_pri(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_LREF_S_ALT:
+      lref_s_alt(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_LOAD_I:
+      load_i();
+      break;
+    case OP_LODB_I:
+      lodb_i(instr.operand());
+      break;
+    case OP_CONST_PRI:
+      const_pri(instr.operand());
+      break;
+    case OP_CONST_ALT:
+      const_alt(instr.operand());
+      break;
+    case OP_ADDR_PRI:
+      addr_pri(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_ADDR_ALT:
+      addr_alt(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_STOR_PRI:
+      stor_pri(instr.operand());
+      break;
+    case OP_STOR_ALT:
+      stor_alt(instr.operand());
+      break;
+    case OP_STOR_S_PRI:
+      stor_s_pri(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_STOR_S_ALT:
+      stor_s_alt(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_SREF_PRI:
+      sref_pri(instr.operand());
+      break;
+    case OP_SREF_ALT:
+      sref_alt(instr.operand());
+      break;
+    case OP_SREF_S_PRI:
+      sref_s_pri(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_SREF_S_ALT:
+      sref_s_alt(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_STOR_I:
+      stor_i();
+      break;
+    case OP_STRB_I:
+      strb_i(instr.operand());
+      break;
+    case OP_LIDX:
+      lidx();
+      break;
+    case OP_LIDX_B:
+      lidx_b(instr.operand());
+      break;
+    case OP_IDXADDR:
+      idxaddr();
+      break;
+    case OP_IDXADDR_B:
+      idxaddr_b(instr.operand());
+      break;
+    case OP_ALIGN_PRI:
+      align_pri(instr.operand());
+      break;
+    case OP_ALIGN_ALT:
+      align_alt(instr.operand());
+      break;
+    case OP_LCTRL:
+      lctrl(instr.operand(), instr.address() + instr.size());
+      break;
+    case OP_SCTRL:
+      sctrl(instr.operand());
+      break;
+    case OP_MOVE_PRI:
+      move_pri();
+      break;
+    case OP_MOVE_ALT:
+      move_alt();
+      break;
+    case OP_XCHG:
+      xchg();
+      break;
+    case OP_PUSH_PRI:
+      push_pri();
+      break;
+    case OP_PUSH_ALT:
+      push_alt();
+      break;
+    case OP_PUSH_R:
+      push_r(instr.operand());
+      break;
+    case OP_PUSH_C:
+      if (!functions.IsArgSizeHeader(instr.address())) {
         push_c(instr.operand());
-        break;
-      case OP_PUSH:
-        push(instr.operand());
-        break;
-      case OP_PUSH_S:
-        push_s(instr.operand());
-        break;
-      case OP_POP_PRI:
-        pop_pri();
-        break;
-      case OP_POP_ALT:
-        pop_alt();
-        break;
-      case OP_STACK: // value
-        stack(instr.operand());
-        break;
-      case OP_HEAP:
-        heap(instr.operand());
-        break;
-      case OP_PROC:
-        proc();
-        break;
-      case OP_RET:
-        ret();
-        break;
-      case OP_RETN:
+      }
+      break;
+    case OP_PUSH:
+      push(instr.operand());
+      break;
+    case OP_PUSH_S:
+      push_s(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_POP_PRI:
+      pop_pri();
+      break;
+    case OP_POP_ALT:
+      pop_alt();
+      break;
+    case OP_STACK: // value
+      stack(instr.operand());
+      break;
+    case OP_HEAP:
+      heap(instr.operand());
+      break;
+    case OP_PROC:
+      proc();
+      break;
+    case OP_RET:
+      ret();
+      break;
+    case OP_RETN:
+      if (function >= 0 && functions.GetFunction(function).is_private()) {
+        retn_c(functions.GetFunction(function).arg_size());
+      } else {
         retn();
-        break;
-      case OP_JUMP_PRI:
-        jump_pri();
-        break;
-      case OP_CALL:
-      case OP_JUMP:
-      case OP_JZER:
-      case OP_JNZ:
-      case OP_JEQ:
-      case OP_JNEQ:
-      case OP_JLESS:
-      case OP_JLEQ:
-      case OP_JGRTR:
-      case OP_JGEQ:
-      case OP_JSLESS:
-      case OP_JSLEQ:
-      case OP_JSGRTR:
-      case OP_JSGEQ: {
-        cell dest = instr.operand() - reinterpret_cast<cell>(amx.code());
-        switch (instr.opcode().GetId()) {
-          case OP_CALL:
-            call(dest);
-            break;
-          case OP_JUMP:
-            jump(dest);
-            break;
-          case OP_JZER:
-            jzer(dest);
-            break;
-          case OP_JNZ:
-            jnz(dest);
-            break;
-          case OP_JEQ:
-            jeq(dest);
-            break;
-          case OP_JNEQ:
-            jneq(dest);
-            break;
-          case OP_JLESS:
-            jless(dest);
-            break;
-          case OP_JLEQ:
-            jleq(dest);
-            break;
-          case OP_JGRTR:
-            jgrtr(dest);
-            break;
-          case OP_JGEQ:
-            jgeq(dest);
-            break;
-          case OP_JSLESS:
-            jsless(dest);
-            break;
-          case OP_JSLEQ:
-            jsleq(dest);
-            break;
-          case OP_JSGRTR:
-            jsgrtr(dest);
-            break;
-          case OP_JSGEQ:
-            jsgeq(dest);
-            break;
-        }
-        break;
       }
-      case OP_SHL:
-        shl();
-        break;
-      case OP_SHR:
-        shr();
-        break;
-      case OP_SSHR:
-        sshr();
-        break;
-      case OP_SHL_C_PRI:
-        shl_c_pri(instr.operand());
-        break;
-      case OP_SHL_C_ALT:
-        shl_c_alt(instr.operand());
-        break;
-      case OP_SHR_C_PRI:
-        shr_c_pri(instr.operand());
-        break;
-      case OP_SHR_C_ALT:
-        shr_c_alt(instr.operand());
-        break;
-      case OP_SMUL:
-        smul();
-        break;
-      case OP_SDIV:
-        sdiv();
-        break;
-      case OP_SDIV_ALT:
-        sdiv_alt();
-        break;
-      case OP_UMUL:
-        umul();
-        break;
-      case OP_UDIV:
-        udiv();
-        break;
-      case OP_UDIV_ALT:
-        udiv_alt();
-        break;
-      case OP_ADD:
-        add();
-        break;
-      case OP_SUB:
-        sub();
-        break;
-      case OP_SUB_ALT:
-        sub_alt();
-        break;
-      case OP_AND:
-        and_();
-        break;
-      case OP_OR:
-        or_();
-        break;
-      case OP_XOR:
-        xor_();
-        break;
-      case OP_NOT:
-        not_();
-        break;
-      case OP_NEG:
-        neg();
-        break;
-      case OP_INVERT:
-        invert();
-        break;
-      case OP_ADD_C:
-        add_c(instr.operand());
-        break;
-      case OP_SMUL_C:
-        smul_c(instr.operand());
-        break;
-      case OP_ZERO_PRI:
-        zero_pri();
-        break;
-      case OP_ZERO_ALT:
-        zero_alt();
-        break;
-      case OP_ZERO:
-        zero(instr.operand());
-        break;
-      case OP_ZERO_S:
-        zero_s(instr.operand());
-        break;
-      case OP_SIGN_PRI:
-        sign_pri();
-        break;
-      case OP_SIGN_ALT:
-        sign_alt();
-        break;
-      case OP_EQ:
-        eq();
-        break;
-      case OP_NEQ:
-        neq();
-        break;
-      case OP_LESS:
-        less();
-        break;
-      case OP_LEQ:
-        leq();
-        break;
-      case OP_GRTR:
-        grtr();
-        break;
-      case OP_GEQ:
-        geq();
-        break;
-      case OP_SLESS:
-        sless();
-        break;
-      case OP_SLEQ:
-        sleq();
-        break;
-      case OP_SGRTR:
-        sgrtr();
-        break;
-      case OP_SGEQ:
-        sgeq();
-        break;
-      case OP_EQ_C_PRI:
-        eq_c_pri(instr.operand());
-        break;
-      case OP_EQ_C_ALT:
-        eq_c_alt(instr.operand());
-        break;
-      case OP_INC_PRI:
-        inc_pri();
-        break;
-      case OP_INC_ALT:
-        inc_alt();
-        break;
-      case OP_INC:
-        inc(instr.operand());
-        break;
-      case OP_INC_S:
-        inc_s(instr.operand());
-        break;
-      case OP_INC_I:
-        inc_i();
-        break;
-      case OP_DEC_PRI:
-        dec_pri();
-        break;
-      case OP_DEC_ALT:
-        dec_alt();
-        break;
-      case OP_DEC:
-        dec(instr.operand());
-        break;
-      case OP_DEC_S:
-        dec_s(instr.operand());
-        break;
-      case OP_DEC_I:
-        dec_i();
-        break;
-      case OP_MOVS:
-        movs(instr.operand());
-        break;
-      case OP_CMPS:
-        cmps(instr.operand());
-        break;
-      case OP_FILL:
-        fill(instr.operand());
-        break;
-      case OP_HALT:
-        halt(instr.operand());
-        break;
-      case OP_BOUNDS:
-        bounds(instr.operand());
-        break;
-      case OP_SYSREQ_PRI:
-        sysreq_pri();
-        break;
-      case OP_SYSREQ_C: {
-        const char *name = amx.GetNativeName(instr.operand());
-        if (name == 0) {
-          error = true;
-        } else {
-          sysreq_c(instr.operand(), name);
-        }
-        break;
+      break;
+    case OP_CALL_PRI:
+      call_pri();
+      break;
+    case OP_JUMP_PRI:
+      jump_pri();
+      break;
+    case OP_CALL:
+    case OP_JUMP:
+    case OP_JREL:
+    case OP_JZER:
+    case OP_JNZ:
+    case OP_JEQ:
+    case OP_JNEQ:
+    case OP_JLESS:
+    case OP_JLEQ:
+    case OP_JGRTR:
+    case OP_JGEQ:
+    case OP_JSLESS:
+    case OP_JSLEQ:
+    case OP_JSGRTR:
+    case OP_JSGEQ: {
+      cell dest = instr.opcode().GetId() == OP_CALL
+        ? instr.operand() - reinterpret_cast<cell>(amx.code())
+        : GetJumpTarget(amx, instr);
+      switch (instr.opcode().GetId()) {
+        case OP_CALL:
+          call(dest);
+          break;
+        case OP_JUMP:
+        case OP_JREL:
+          jump(dest);
+          break;
+        case OP_JZER:
+          jzer(dest);
+          break;
+        case OP_JNZ:
+          jnz(dest);
+          break;
+        case OP_JEQ:
+          jeq(dest);
+          break;
+        case OP_JNEQ:
+          jneq(dest);
+          break;
+        case OP_JLESS:
+          jless(dest);
+          break;
+        case OP_JLEQ:
+          jleq(dest);
+          break;
+        case OP_JGRTR:
+          jgrtr(dest);
+          break;
+        case OP_JGEQ:
+          jgeq(dest);
+          break;
+        case OP_JSLESS:
+          jsless(dest);
+          break;
+        case OP_JSLEQ:
+          jsleq(dest);
+          break;
+        case OP_JSGRTR:
+          jsgrtr(dest);
+          break;
+        case OP_JSGEQ:
+          jsgeq(dest);
+          break;
       }
-      case OP_SYSREQ_D: {
-        const char *name = amx.GetNativeName(amx.FindNative(instr.operand()));
-        if (name == 0) {
-          error = true;
-        } else {
-          sysreq_d(instr.operand(), name);
-        }
-        break;
+      break;
+    }
+    case OP_SHL:
+      shl();
+      break;
+    case OP_SHR:
+      shr();
+      break;
+    case OP_SSHR:
+      sshr();
+      break;
+    case OP_SHL_C_PRI:
+      shl_c_pri(instr.operand());
+      break;
+    case OP_SHL_C_ALT:
+      shl_c_alt(instr.operand());
+      break;
+    case OP_SHR_C_PRI:
+      shr_c_pri(instr.operand());
+      break;
+    case OP_SHR_C_ALT:
+      shr_c_alt(instr.operand());
+      break;
+    case OP_SMUL:
+      smul();
+      break;
+    case OP_SDIV:
+      sdiv();
+      break;
+    case OP_SDIV_ALT:
+      sdiv_alt();
+      break;
+    case OP_UMUL:
+      umul();
+      break;
+    case OP_UDIV:
+      udiv();
+      break;
+    case OP_UDIV_ALT:
+      udiv_alt();
+      break;
+    case OP_ADD:
+      add();
+      break;
+    case OP_SUB:
+      sub();
+      break;
+    case OP_SUB_ALT:
+      sub_alt();
+      break;
+    case OP_AND:
+      and_();
+      break;
+    case OP_OR:
+      or_();
+      break;
+    case OP_XOR:
+      xor_();
+      break;
+    case OP_NOT:
+      not_();
+      break;
+    case OP_NEG:
+      neg();
+      break;
+    case OP_INVERT:
+      invert();
+      break;
+    case OP_ADD_C:
+      add_c(instr.operand());
+      break;
+    case OP_SMUL_C:
+      smul_c(instr.operand());
+      break;
+    case OP_ZERO_PRI:
+      zero_pri();
+      break;
+    case OP_ZERO_ALT:
+      zero_alt();
+      break;
+    case OP_ZERO:
+      zero(instr.operand());
+      break;
+    case OP_ZERO_S:
+      zero_s(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_SIGN_PRI:
+      sign_pri();
+      break;
+    case OP_SIGN_ALT:
+      sign_alt();
+      break;
+    case OP_EQ:
+      eq();
+      break;
+    case OP_NEQ:
+      neq();
+      break;
+    case OP_LESS:
+      less();
+      break;
+    case OP_LEQ:
+      leq();
+      break;
+    case OP_GRTR:
+      grtr();
+      break;
+    case OP_GEQ:
+      geq();
+      break;
+    case OP_SLESS:
+      sless();
+      break;
+    case OP_SLEQ:
+      sleq();
+      break;
+    case OP_SGRTR:
+      sgrtr();
+      break;
+    case OP_SGEQ:
+      sgeq();
+      break;
+    case OP_EQ_C_PRI:
+      eq_c_pri(instr.operand());
+      break;
+    case OP_EQ_C_ALT:
+      eq_c_alt(instr.operand());
+      break;
+    case OP_INC_PRI:
+      inc_pri();
+      break;
+    case OP_INC_ALT:
+      inc_alt();
+      break;
+    case OP_INC:
+      inc(instr.operand());
+      break;
+    case OP_INC_S:
+      inc_s(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_INC_I:
+      inc_i();
+      break;
+    case OP_DEC_PRI:
+      dec_pri();
+      break;
+    case OP_DEC_ALT:
+      dec_alt();
+      break;
+    case OP_DEC:
+      dec(instr.operand());
+      break;
+    case OP_DEC_S:
+      dec_s(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_DEC_I:
+      dec_i();
+      break;
+    case OP_MOVS:
+      movs(instr.operand());
+      break;
+    case OP_CMPS:
+      cmps(instr.operand());
+      break;
+    case OP_FILL:
+      fill(instr.operand());
+      break;
+    case OP_HALT:
+      halt(instr.operand());
+      break;
+    case OP_BOUNDS:
+      bounds(instr.operand());
+      break;
+    case OP_SYSREQ_PRI:
+      sysreq_pri();
+      break;
+    case OP_SYSREQ_C: {
+      const char *name = amx.GetNativeName(instr.operand());
+      if (name == 0) {
+        error = true;
+      } else {
+        sysreq_c(instr.operand(), name);
       }
-      case OP_SWITCH:
-        switch_(CaseTable(amx, instr.operand()));
-        break;
-      case OP_CASETBL:
-        casetbl();
-        break;
-      case OP_SWAP_PRI:
-        swap_pri();
-        break;
-      case OP_SWAP_ALT:
-        swap_alt();
-        break;
-      case OP_PUSH_ADR:
-        push_adr(instr.operand());
-        break;
-      case OP_NOP:
-        nop();
-        break;
-      case OP_BREAK:
-        break_();
+      break;
+    }
+    case OP_SYSREQ_D: {
+      const char *name = amx.GetNativeName(amx.FindNative(instr.operand()));
+      if (name == 0) {
+        error = true;
+      } else {
+        sysreq_d(instr.operand(), name);
+      }
+      break;
+    }
+    case OP_SWITCH:
+      switch_(CaseTable(amx, instr.operand()));
+      break;
+    case OP_CASETBL:
+      casetbl();
+      break;
+    case OP_SWAP_PRI:
+      swap_pri();
+      break;
+    case OP_SWAP_ALT:
+      swap_alt();
+      break;
+    case OP_PUSH_ADR:
+      push_adr(functions.GetFrameOffset(function, instr.operand()));
+      break;
+    case OP_NOP:
+      nop();
+      break;
+    case OP_BREAK:
+      break_();
+      break;
+    case OP_PUSH2_C:
+    case OP_PUSH3_C:
+    case OP_PUSH4_C:
+    case OP_PUSH5_C:
+      for (std::size_t i = 0; i < instr.operands().size(); i++) {
+        push_c(instr.operand(i));
+      }
+      break;
+    case OP_PUSH2:
+    case OP_PUSH3:
+    case OP_PUSH4:
+    case OP_PUSH5:
+      for (std::size_t i = 0; i < instr.operands().size(); i++) {
+        push(instr.operand(i));
+      }
+      break;
+    case OP_PUSH2_S:
+    case OP_PUSH3_S:
+    case OP_PUSH4_S:
+    case OP_PUSH5_S:
+      for (std::size_t i = 0; i < instr.operands().size(); i++) {
+        push_s(functions.GetFrameOffset(function, instr.operand(i)));
+      }
+      break;
+    case OP_PUSH2_ADR:
+    case OP_PUSH3_ADR:
+    case OP_PUSH4_ADR:
+    case OP_PUSH5_ADR:
+      for (std::size_t i = 0; i < instr.operands().size(); i++) {
+        push_adr(functions.GetFrameOffset(function, instr.operand(i)));
+      }
+      break;
+    case OP_LOAD_BOTH:
+      load_pri(instr.operand(0));
+      load_alt(instr.operand(1));
+      break;
+    case OP_LOAD_S_BOTH:
+      load_s_pri(functions.GetFrameOffset(function, instr.operand(0)));
+      load_s_alt(functions.GetFrameOffset(function, instr.operand(1)));
+      break;
+    case OP_CONST:
+      const_(instr.operand(0), instr.operand(1));
+      break;
+    case OP_CONST_S:
+      const_s(functions.GetFrameOffset(function, instr.operand(0)),
+              instr.operand(1));
+      break;
+    case OP_SYSREQ_N:
+    case OP_SYSREQ_ND: {
+      // Same as push.c <num_bytes>; sysreq.c/d <native>; stack <...>.
+      cell num_bytes = instr.operand(1);
+      const char *name = instr.opcode().GetId() == OP_SYSREQ_N
+        ? amx.GetNativeName(instr.operand(0))
+        : amx.GetNativeName(amx.FindNative(instr.operand(0)));
+      if (name == 0) {
+        error = true;
         break;
-    default:
-      error = true;
+      }
+      push_c(num_bytes);
+      if (instr.opcode().GetId() == OP_SYSREQ_N) {
+        sysreq_c(instr.operand(0), name);
+      } else {
+        sysreq_d(instr.operand(0), name);
+      }
+      stack(num_bytes + sizeof(cell));
+      break;
     }
+    case OP_FILE:
+    case OP_LINE:
+    case OP_SYMBOL:
+    case OP_SRANGE:
+    case OP_SYMTAG:
+      // Debug information, nothing to execute.
+      break;
+  default:
+    error = true;
   }
 
-  if (error && error_handler_ != 0) {
-    error_handler_->Execute(instr);
-  }
-
-  return Finish(error);
+  return !error;
 }
 
 } // namespace amxjit
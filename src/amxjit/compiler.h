@@ -27,16 +27,20 @@
 
 #include <cassert>
 #include <cstddef>
+#include <string>
+#include <vector>
 #include "amxref.h"
 #include "macros.h"
 
 namespace amxjit {
 
 class CaseTable;
+class FunctionTable;
 class Instruction;
 class Logger;
 
 typedef int (AMXAPI *EntryPoint)(cell index, cell *retval);
+typedef int (AMXAPI *ExecFunction)(AMX *amx, cell *retval, int index);
 
 class CompileErrorHandler {
 public:
@@ -51,9 +55,48 @@ class CompileOutput {
   // Returns a pointer to the code buffer.
   virtual void *GetCode() const = 0;
 
+  // Returns the total size of the generated code in bytes. If functions
+  // are compiled on demand this grows over time.
+  virtual std::size_t GetCodeSize() const = 0;
+
   // Returns a pointer to the entry point function.
   virtual EntryPoint GetEntryPoint() const = 0;
 
+  // Returns true if the code was loaded from the code cache instead of
+  // being compiled.
+  virtual bool IsFromCache() const = 0;
+
+  // Returns the number of bytes used to map AMX addresses to machine code
+  // and the number of bytes it would take to map every instruction.
+  virtual void GetInstrTableSize(std::size_t &size,
+                                 std::size_t &full_size) const = 0;
+
+  // Returns the number of functions whose code is shared with other
+  // scripts, the total number of functions and the number of bytes that
+  // this saves.
+  virtual void GetDedupeStats(int &num_shared,
+                              int &num_functions,
+                              std::size_t &bytes_saved) const = 0;
+
+  // In tiered mode returns the number of functions that have run in the
+  // interpreter, the number of functions compiled to machine code and the
+  // number of those that were later replaced by optimized code, so far.
+  // All are zero when the whole script is compiled at once.
+  virtual void GetTierStats(int &num_interpreted,
+                            int &num_compiled,
+                            int &num_optimized) const = 0;
+
+  // Returns true if the public function with the specified index (or main
+  // if it's AMX_EXEC_MAIN) does nothing but return a constant and stores
+  // the constant in value. Such functions can be "called" without running
+  // any code.
+  virtual bool GetConstantResult(int index, cell &value) const = 0;
+
+  // Returns an output that runs the same code for a copy of the script
+  // made with amx_Clone() (which shares the code but not the data), or
+  // null if this is not possible. Either of them may be deleted first.
+  virtual CompileOutput *Clone(AMXRef amx) = 0;
+
   // Deletes the objeect. After doing this none of its methods
   // should be ever called!
   virtual void Delete() = 0;
@@ -78,13 +121,74 @@ class Compiler {
   // Returns the current error handler or null if the handler was not set.
   CompileErrorHandler *GetErrorHandler() const { return error_handler_; }
 
+  // Sets the number of calls after which a function gets compiled to
+  // machine code. If the threshold is zero (the default) the whole script
+  // is compiled at once, otherwise functions start in the interpreter and
+  // are compiled on demand by the backend (if it supports it).
+  void SetTierUpThreshold(int threshold) { tier_up_threshold_ = threshold; }
+
+  // Returns the current tier-up threshold.
+  int GetTierUpThreshold() const { return tier_up_threshold_; }
+
+  // Sets whether hot functions are optimized on a background thread (the
+  // default) or right away on the thread that runs the script. The latter
+  // makes tier-up deterministic, which is mostly useful for testing.
+  void SetBackgroundOptimization(bool background) {
+    background_optimization_ = background;
+  }
+
+  // Returns true if optimization is done on a background thread.
+  bool GetBackgroundOptimization() const { return background_optimization_; }
+
+  // Sets the number of threads to use for compiling the script. Backends
+  // that don't support parallel compilation ignore this. The default is 1.
+  void SetNumThreads(int num_threads) { num_threads_ = num_threads; }
+
+  // Returns the number of compilation threads.
+  int GetNumThreads() const { return num_threads_; }
+
+  // Enables caching of compiled code in the specified directory. Code is
+  // only reused by a compiler with the same version string. Backends that
+  // don't support caching ignore this.
+  void SetCacheDir(const std::string &dir, const std::string &version) {
+    cache_dir_ = dir;
+    cache_version_ = version;
+  }
+
+  const std::string &GetCacheDir() const { return cache_dir_; }
+  const std::string &GetCacheVersion() const { return cache_version_; }
+
+  // Enables sharing of compiled code with other processes that run the
+  // same script and use a compiler with the same version string. Backends
+  // or platforms that don't support this ignore it.
+  void SetShareCode(bool share, const std::string &version) {
+    share_code_ = share;
+    cache_version_ = version;
+  }
+
+  bool GetShareCode() const { return share_code_; }
+
+  // Enables sharing of identical functions between scripts loaded in this
+  // process. Backends that don't support this ignore it.
+  void SetDedupe(bool dedupe) { dedupe_ = dedupe; }
+
+  bool GetDedupe() const { return dedupe_; }
+
+  // Sets the function that runs code in the AMX interpreter (normally the
+  // original amx_Exec(); it must support AMX_EXEC_CONT). If set, functions
+  // that can't be compiled run through it instead of failing the whole
+  // script. Backends that don't support this ignore it.
+  void SetFallbackExec(ExecFunction exec) { fallback_exec_ = exec; }
+
+  ExecFunction GetFallbackExec() const { return fallback_exec_; }
+
   // Compiles the specified AMX script.
   CompileOutput *Compile(AMXRef amx);
 
  protected:
   // This method is called just before the compilation begins.
   // Returns false on error.
-  virtual bool Prepare(AMXRef amx) = 0;
+  virtual bool Prepare(AMXRef amx, const FunctionTable &functions) = 0;
 
   // Processes a single instruction. Returns false on error.
   virtual bool Process(const Instruction &instr) = 0;
@@ -93,6 +197,22 @@ class Compiler {
   // CompilerOutput or null which would indicate a fatal error.
   virtual CompileOutput *Finish(bool error) = 0;
 
+  // Compiles the whole script (called between Prepare() and Finish() if
+  // not in tiered mode). The default implementation simply translates all
+  // instructions in order. Returns false on error.
+  virtual bool CompileScript(AMXRef amx, const FunctionTable &functions);
+
+  // Translates the instructions in the range [start, end) by calling
+  // Process() and the per-opcode methods for each of them. Returns false
+  // on error.
+  bool CompileRange(AMXRef amx, const FunctionTable &functions,
+                    cell start, cell end);
+
+  // Same as CompileRange() but takes already decoded (and possibly
+  // transformed) instructions.
+  bool CompileInstructions(AMXRef amx, const FunctionTable &functions,
+                           const std::vector<Instruction> &instrs);
+
   // Per-opcode methods.
   virtual void load_pri(cell address) = 0;
   virtual void load_alt(cell address) = 0;
@@ -106,6 +226,8 @@ class Compiler {
   virtual void lodb_i(cell number) = 0;
   virtual void const_pri(cell value) = 0;
   virtual void const_alt(cell value) = 0;
+  virtual void const_(cell address, cell value) = 0;
+  virtual void const_s(cell offset, cell value) = 0;
   virtual void addr_pri(cell offset) = 0;
   virtual void addr_alt(cell offset) = 0;
   virtual void stor_pri(cell address) = 0;
@@ -131,6 +253,7 @@ class Compiler {
   virtual void xchg() = 0;
   virtual void push_pri() = 0;
   virtual void push_alt() = 0;
+  virtual void push_r(cell value) = 0;
   virtual void push_c(cell value) = 0;
   virtual void push(cell address)  = 0;
   virtual void push_s(cell offset) = 0;
@@ -141,7 +264,9 @@ class Compiler {
   virtual void proc() = 0;
   virtual void ret() = 0;
   virtual void retn() = 0;
+  virtual void retn_c(cell num_bytes) = 0;
   virtual void call(cell address) = 0;
+  virtual void call_pri() = 0;
   virtual void jump_pri() = 0;
   virtual void jump(cell address) = 0;
   virtual void jzer(cell address) = 0;
@@ -224,9 +349,21 @@ class Compiler {
   virtual void nop() = 0;
   virtual void break_() = 0;
 
+ private:
+  bool CompileInstruction(AMXRef amx, const FunctionTable &functions,
+                          int &function, const Instruction &instr);
+
  private:
   Logger *logger_;
   CompileErrorHandler *error_handler_;
+  int tier_up_threshold_;
+  bool background_optimization_;
+  int num_threads_;
+  std::string cache_dir_;
+  std::string cache_version_;
+  bool share_code_;
+  bool dedupe_;
+  ExecFunction fallback_exec_;
 };
 
 } // namespace amxjit
@@ -23,6 +23,7 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 #include <cassert>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
 #include "disasm.h"
@@ -72,7 +73,7 @@ const Instruction::StaticInstrInfo Instruction::info[NUM_OPCODES] = {
   {"xchg",           REG_PRI | REG_ALT,    REG_PRI | REG_ALT},
   {"push.pri",       REG_PRI | REG_STK,    REG_STK},
   {"push.alt",       REG_ALT | REG_STK,    REG_STK},
-  {"push.r",         REG_NONE,             REG_NONE},
+  {"push.r",         REG_PRI | REG_STK,    REG_STK},
   {"push.c",         REG_STK,              REG_STK},
   {"push",           REG_STK,              REG_STK},
   {"push.s",         REG_STK | REG_FRM,    REG_STK},
@@ -90,7 +91,7 @@ const Instruction::StaticInstrInfo Instruction::info[NUM_OPCODES] = {
   {"call.pri",       REG_PRI | REG_STK |
                      REG_CIP,              REG_STK | REG_CIP},
   {"jump",           REG_NONE,             REG_CIP},
-  {"jrel",           REG_NONE,             REG_NONE},
+  {"jrel",           REG_NONE,             REG_CIP},
   {"jzer",           REG_PRI,              REG_CIP},
   {"jnz",            REG_PRI,              REG_CIP},
   {"jeq",            REG_PRI | REG_ALT,    REG_CIP},
@@ -128,7 +129,7 @@ const Instruction::StaticInstrInfo Instruction::info[NUM_OPCODES] = {
   {"add.c",          REG_PRI,              REG_PRI},
   {"smul.c",         REG_PRI,              REG_PRI},
   {"zero.pri",       REG_NONE,             REG_PRI},
-  {"zero.alt",       REG_NONE,             REG_PRI},
+  {"zero.alt",       REG_NONE,             REG_ALT},
   {"zero",           REG_NONE,             REG_NONE},
   {"zero.s",         REG_FRM,              REG_NONE},
   {"sign.pri",       REG_PRI,              REG_PRI},
@@ -187,7 +188,37 @@ const Instruction::StaticInstrInfo Instruction::info[NUM_OPCODES] = {
                                            REG_STK | REG_FRM |
                                            REG_CIP},
   {"symtag",         REG_NONE,             REG_NONE},
-  {"break",          REG_NONE,             REG_NONE}
+  {"break",          REG_NONE,             REG_NONE},
+  {"push2.c",        REG_STK,              REG_STK},
+  {"push2",          REG_STK,              REG_STK},
+  {"push2.s",        REG_STK | REG_FRM,    REG_STK},
+  {"push2.adr",      REG_STK | REG_FRM,    REG_STK},
+  {"push3.c",        REG_STK,              REG_STK},
+  {"push3",          REG_STK,              REG_STK},
+  {"push3.s",        REG_STK | REG_FRM,    REG_STK},
+  {"push3.adr",      REG_STK | REG_FRM,    REG_STK},
+  {"push4.c",        REG_STK,              REG_STK},
+  {"push4",          REG_STK,              REG_STK},
+  {"push4.s",        REG_STK | REG_FRM,    REG_STK},
+  {"push4.adr",      REG_STK | REG_FRM,    REG_STK},
+  {"push5.c",        REG_STK,              REG_STK},
+  {"push5",          REG_STK,              REG_STK},
+  {"push5.s",        REG_STK | REG_FRM,    REG_STK},
+  {"push5.adr",      REG_STK | REG_FRM,    REG_STK},
+  {"load.both",      REG_NONE,             REG_PRI | REG_ALT},
+  {"load.s.both",    REG_FRM,              REG_PRI | REG_ALT},
+  {"const",          REG_NONE,             REG_NONE},
+  {"const.s",        REG_FRM,              REG_NONE},
+  {"sysreq.n",       REG_STK,              REG_PRI | REG_ALT |
+                                           REG_COD | REG_DAT |
+                                           REG_HEA | REG_STP |
+                                           REG_STK | REG_FRM |
+                                           REG_CIP},
+  {"sysreq.nd",      REG_STK,              REG_PRI | REG_ALT |
+                                           REG_COD | REG_DAT |
+                                           REG_HEA | REG_STP |
+                                           REG_STK | REG_FRM |
+                                           REG_CIP}
 };
 
 Instruction::Instruction():
@@ -205,6 +236,20 @@ cell Instruction::operand(std::size_t index) const {
   return operands_[index];
 }
 
+int Instruction::src_regs() const {
+  if (opcode_.GetId() >= 0 && opcode_.GetId() < NUM_OPCODES) {
+    return info[opcode_.GetId()].src_regs;
+  }
+  return REG_NONE;
+}
+
+int Instruction::dst_regs() const {
+  if (opcode_.GetId() >= 0 && opcode_.GetId() < NUM_OPCODES) {
+    return info[opcode_.GetId()].dst_regs;
+  }
+  return REG_NONE;
+}
+
 const char *Instruction::name() const {
   if (opcode_.GetId() >= 0 && opcode_.GetId() < NUM_OPCODES) {
     return info[opcode_.GetId()].name;
@@ -352,6 +397,52 @@ bool DecodeInstruction(AMXRef amx, cell address, Instruction &instr) {
     case OP_JUMP_PRI:   case OP_SWAP_PRI:   case OP_SWAP_ALT:
     case OP_NOP:        case OP_BREAK:
       break;
+    case OP_PUSH5_C:    case OP_PUSH5:      case OP_PUSH5_S:
+    case OP_PUSH5_ADR:
+      instr.AppendOperand(*reinterpret_cast<cell*>(amx.code() + address));
+      address += sizeof(cell);
+      // fall through
+    case OP_PUSH4_C:    case OP_PUSH4:      case OP_PUSH4_S:
+    case OP_PUSH4_ADR:
+      instr.AppendOperand(*reinterpret_cast<cell*>(amx.code() + address));
+      address += sizeof(cell);
+      // fall through
+    case OP_PUSH3_C:    case OP_PUSH3:      case OP_PUSH3_S:
+    case OP_PUSH3_ADR:
+      instr.AppendOperand(*reinterpret_cast<cell*>(amx.code() + address));
+      address += sizeof(cell);
+      // fall through
+    case OP_PUSH2_C:    case OP_PUSH2:      case OP_PUSH2_S:
+    case OP_PUSH2_ADR:  case OP_LOAD_BOTH:  case OP_LOAD_S_BOTH:
+    case OP_CONST:      case OP_CONST_S:    case OP_SYSREQ_N:
+    case OP_SYSREQ_ND:
+    case OP_LINE:
+    case OP_SRANGE:
+      for (int i = 0; i < 2; i++) {
+        instr.AppendOperand(*reinterpret_cast<cell*>(amx.code() + address));
+        address += sizeof(cell);
+      }
+      break;
+    case OP_SYMTAG:
+      instr.AppendOperand(*reinterpret_cast<cell*>(amx.code() + address));
+      address += sizeof(cell);
+      break;
+    case OP_FILE:
+    case OP_SYMBOL: {
+      // The first operand is the size of the data that follows, in bytes.
+      cell num_bytes = *reinterpret_cast<cell*>(amx.code() + address);
+      if (num_bytes < 0
+          || static_cast<std::size_t>(num_bytes) > amx.code_size()) {
+        return false;
+      }
+      int num_cells =
+        static_cast<int>((num_bytes + sizeof(cell) - 1) / sizeof(cell));
+      for (int i = 0; i < num_cells + 1; i++) {
+        instr.AppendOperand(*reinterpret_cast<cell*>(amx.code() + address));
+        address += sizeof(cell);
+      }
+      break;
+    }
     case OP_CASETBL: {
       int num_cases = *reinterpret_cast<cell*>(amx.code() + address) + 1;
       for (int i = 0; i < num_cases * 2; i++) {
@@ -367,6 +458,91 @@ bool DecodeInstruction(AMXRef amx, cell address, Instruction &instr) {
   return true;
 }
 
+cell GetJumpTarget(AMXRef amx, const Instruction &instr) {
+  if (instr.opcode().GetId() == OP_JREL) {
+    // JREL is not relocated: the offset is relative to the next instruction.
+    return instr.address() + static_cast<cell>(instr.size())
+                           + instr.operand();
+  }
+  return instr.operand() - reinterpret_cast<cell>(amx.code());
+}
+
+bool ExpandCompactCode(const std::vector<unsigned char> &file,
+                       std::vector<unsigned char> &image) {
+  if (file.size() < sizeof(AMX_HEADER)) {
+    return false;
+  }
+
+  const AMX_HEADER *hdr = reinterpret_cast<const AMX_HEADER*>(&file[0]);
+  if (hdr->cod < static_cast<int32_t>(sizeof(AMX_HEADER))
+      || hdr->cod > hdr->hea
+      || hdr->size < hdr->cod
+      || static_cast<std::size_t>(hdr->size) > file.size()) {
+    return false;
+  }
+
+  image.assign(hdr->hea, 0);
+  std::memcpy(&image[0], &file[0], hdr->cod);
+
+  // Each cell is encoded as a sequence of 7-bit groups, the most
+  // significant first. The high bit of a byte is set if more bytes
+  // follow and bit 6 of the first byte is the sign.
+  std::size_t in = hdr->cod;
+  std::size_t out = hdr->cod;
+  while (in < static_cast<std::size_t>(hdr->size)) {
+    ucell value = (file[in] & 0x40) != 0 ? ~static_cast<ucell>(0) : 0;
+    unsigned char byte;
+    do {
+      if (in >= static_cast<std::size_t>(hdr->size)) {
+        return false;
+      }
+      byte = file[in++];
+      value = (value << 7) | (byte & 0x7f);
+    } while ((byte & 0x80) != 0);
+
+    if (out + sizeof(cell) > image.size()) {
+      return false;
+    }
+    std::memcpy(&image[out], &value, sizeof(value));
+    out += sizeof(cell);
+  }
+
+  AMX_HEADER *image_hdr = reinterpret_cast<AMX_HEADER*>(&image[0]);
+  image_hdr->flags &= ~AMX_FLAG_COMPACT;
+
+  return out == image.size();
+}
+
+void RelocateCode(AMXRef amx) {
+  unsigned char *code = amx.code();
+  bool relative = amx.header()->file_version >= 7;
+
+  Disassembler disasm(amx);
+  Instruction instr;
+
+  while (disasm.Decode(instr)) {
+    OpcodeID id = instr.opcode().GetId();
+    cell *operands = reinterpret_cast<cell*>(code + instr.address()) + 1;
+    if ((instr.opcode().IsJump() && id != OP_JREL && id != OP_JUMP_PRI)
+        || id == OP_CALL
+        || id == OP_SWITCH) {
+      if (relative) {
+        operands[0] += instr.address();
+      }
+      operands[0] += reinterpret_cast<cell>(code);
+    } else if (id == OP_CASETBL) {
+      int num_records = operands[0] + 1;
+      for (int i = 0; i < num_records; i++) {
+        cell *address = &operands[i * 2 + 1];
+        if (relative) {
+          *address += reinterpret_cast<unsigned char*>(address - 1) - code;
+        }
+        *address += reinterpret_cast<cell>(code);
+      }
+    }
+  }
+}
+
 bool Disassembler::Decode(Instruction &instr) {
   if (cur_address_ >= 0 &&
       amx_.header()->cod + cur_address_ < amx_.header()->dat) {
@@ -65,6 +65,11 @@ class Instruction {
 
   cell operand(std::size_t index = 0) const;
 
+  // Returns the registers read and written by the instruction (a bitwise
+  // combination of Register values).
+  int src_regs() const;
+  int dst_regs() const;
+
   const std::vector<cell> &operands() const {
     return operands_;
   }
@@ -118,6 +123,23 @@ class CaseTable {
 bool DecodeInstruction(AMXRef amx, cell address);
 bool DecodeInstruction(AMXRef amx, cell address, Instruction &instr);
 
+// Returns the code address that a direct jump instruction transfers
+// control to.
+cell GetJumpTarget(AMXRef amx, const Instruction &instr);
+
+// Unpacks a script stored in the compact encoding (AMX_FLAG_COMPACT) to
+// one cell per opcode, operand or data value, the way amx_Init() does it,
+// so addresses match the server's copy of the script. The image is resized
+// to the memory size of the script (up to the heap) and has the compact
+// flag cleared. Returns false if the encoding is broken.
+bool ExpandCompactCode(const std::vector<unsigned char> &file,
+                       std::vector<unsigned char> &image);
+
+// Converts jump targets and case table addresses of a loaded script to
+// absolute addresses, like amx_Init() does. This is what the compiler
+// expects to see.
+void RelocateCode(AMXRef amx);
+
 // Disassembler is merely a convenience wrapper around
 // DecodeInstruction. It's well suited for whlie loops
 // like the following:
@@ -133,7 +155,8 @@ bool DecodeInstruction(AMXRef amx, cell address, Instruction &instr);
 // an error (usually means an invalid instruction).
 class Disassembler {
  public:
-  Disassembler(AMXRef amx): amx_(amx), cur_address_() {}
+  Disassembler(AMXRef amx, cell address = 0):
+    amx_(amx), cur_address_(address) {}
   bool Decode(Instruction &instr);
   bool Decode(Instruction &instr, bool &error);
  private:
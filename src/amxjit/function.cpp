@@ -0,0 +1,368 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <map>
+#include "disasm.h"
+#include "function.h"
+
+namespace amxjit {
+namespace {
+
+const cell kArgSizeOffset = 2 * sizeof(cell);
+const cell kFirstArgOffset = 3 * sizeof(cell);
+
+// Returns true if the instruction accesses a local variable or an argument
+// relative to the frame pointer.
+bool IsFrameAccess(const Instruction &instr) {
+  switch (instr.opcode().GetId()) {
+    case OP_LOAD_S_PRI:
+    case OP_LOAD_S_ALT:
+    case OP_LREF_S_PRI:
+    case OP_LREF_S_ALT:
+    case OP_ADDR_PRI:
+    case OP_ADDR_ALT:
+    case OP_STOR_S_PRI:
+    case OP_STOR_S_ALT:
+    case OP_SREF_S_PRI:
+    case OP_SREF_S_ALT:
+    case OP_PUSH_S:
+    case OP_PUSH_ADR:
+    case OP_ZERO_S:
+    case OP_INC_S:
+    case OP_DEC_S:
+    case OP_PUSH2_S:
+    case OP_PUSH2_ADR:
+    case OP_PUSH3_S:
+    case OP_PUSH3_ADR:
+    case OP_PUSH4_S:
+    case OP_PUSH4_ADR:
+    case OP_PUSH5_S:
+    case OP_PUSH5_ADR:
+    case OP_LOAD_S_BOTH:
+    case OP_CONST_S:
+      return true;
+  }
+  return false;
+}
+
+// Returns the number of leading operands that are frame offsets.
+std::size_t GetNumFrameOperands(const Instruction &instr) {
+  if (!IsFrameAccess(instr)) {
+    return 0;
+  }
+  if (instr.opcode().GetId() == OP_CONST_S) {
+    return 1;
+  }
+  return instr.operands().size();
+}
+
+// Returns true if the instruction reveals the layout of the stack frame
+// to the code in a way that can't be tracked at compile time.
+bool IsFrameEscape(AMXRef amx, const Instruction &instr) {
+  switch (instr.opcode().GetId()) {
+    case OP_LCTRL:
+    case OP_SCTRL:
+      return instr.operand() == 4 || instr.operand() == 5;
+    case OP_RET:
+      return true;
+    case OP_SYSREQ_C:
+    case OP_SYSREQ_D:
+    case OP_SYSREQ_N:
+    case OP_SYSREQ_ND: {
+      // These natives read the argument count from the caller's frame.
+      OpcodeID id = instr.opcode().GetId();
+      const char *name = id == OP_SYSREQ_C || id == OP_SYSREQ_N
+        ? amx.GetNativeName(instr.operand())
+        : amx.GetNativeName(amx.FindNative(instr.operand()));
+      return name != 0 && (std::strcmp(name, "numargs") == 0 ||
+                           std::strcmp(name, "getarg") == 0 ||
+                           std::strcmp(name, "setarg") == 0);
+    }
+  }
+  for (std::size_t i = 0; i < GetNumFrameOperands(instr); i++) {
+    if (instr.operand(i) >= kArgSizeOffset
+        && instr.operand(i) < kFirstArgOffset) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns true if the instruction transfers control to an address that is
+// computed at run time.
+bool IsIndirectJump(const Instruction &instr) {
+  switch (instr.opcode().GetId()) {
+    case OP_CALL_PRI:
+    case OP_JUMP_PRI:
+      return true;
+    case OP_SCTRL:
+      return instr.operand() == 6;
+  }
+  return false;
+}
+
+struct CallSite {
+  cell address;
+  cell target;
+  cell header_address;
+  cell arg_size;
+};
+
+bool CompareAddress(const Function &function, cell address) {
+  return function.address() < address;
+}
+
+} // anonymous namespace
+
+Function::Function(cell address):
+  address_(address),
+  end_address_(address),
+  public_(false),
+  private_(false),
+  arg_size_(0),
+  returns_constant_(false),
+  constant_value_(0)
+{
+}
+
+FunctionTable::FunctionTable(AMXRef amx):
+  indirect_jumps_(false)
+{
+  Analyze(amx);
+}
+
+int FunctionTable::num_functions() const {
+  return static_cast<int>(functions_.size());
+}
+
+const Function &FunctionTable::GetFunction(int index) const {
+  assert(index >= 0 && index < num_functions());
+  return functions_[index];
+}
+
+int FunctionTable::FindFunction(cell address) const {
+  std::vector<Function>::const_iterator it =
+    std::lower_bound(functions_.begin(), functions_.end(), address + 1,
+                     CompareAddress);
+  if (it == functions_.begin()) {
+    return -1;
+  }
+  --it;
+  if (!it->Contains(address)) {
+    return -1;
+  }
+  return static_cast<int>(it - functions_.begin());
+}
+
+bool FunctionTable::IsArgSizeHeader(cell address) const {
+  return arg_size_headers_.find(address) != arg_size_headers_.end();
+}
+
+cell FunctionTable::GetFrameOffset(int function_index, cell offset) const {
+  if (function_index >= 0
+      && functions_[function_index].is_private()
+      && offset >= kFirstArgOffset) {
+    return offset - sizeof(cell);
+  }
+  return offset;
+}
+
+void FunctionTable::Analyze(AMXRef amx) {
+  Disassembler disasm(amx);
+  Instruction instr;
+  Instruction prev_instr;
+  bool error = false;
+
+  std::vector<bool> eligible;
+  std::vector<CallSite> calls;
+  std::vector<std::pair<int, cell> > jumps;
+
+  // Set while the current function may still turn out to be a constant
+  // return. Breakpoints and NOPs in between are ignored.
+  bool in_prologue = false;
+  bool have_value = false;
+
+  while (disasm.Decode(instr, error)) {
+    if (instr.opcode().GetId() == OP_PROC) {
+      if (!functions_.empty()) {
+        functions_.back().end_address_ = instr.address();
+      }
+      functions_.push_back(Function(instr.address()));
+      eligible.push_back(true);
+      in_prologue = true;
+      have_value = false;
+    } else if (in_prologue) {
+      Function &function = functions_.back();
+      switch (instr.opcode().GetId()) {
+        case OP_BREAK:
+        case OP_NOP:
+          break;
+        case OP_ZERO_PRI:
+        case OP_CONST_PRI:
+          function.constant_value_ =
+            instr.opcode().GetId() == OP_CONST_PRI ? instr.operand() : 0;
+          in_prologue = !have_value;
+          have_value = true;
+          break;
+        case OP_RETN:
+          function.returns_constant_ = have_value;
+          in_prologue = false;
+          break;
+        default:
+          in_prologue = false;
+      }
+    }
+
+    int index = static_cast<int>(functions_.size()) - 1;
+    cell code = reinterpret_cast<cell>(amx.code());
+
+    if (index >= 0 && IsFrameEscape(amx, instr)) {
+      eligible[index] = false;
+    }
+    if (IsIndirectJump(instr)) {
+      indirect_jumps_ = true;
+    }
+
+    switch (instr.opcode().GetId()) {
+      case OP_CALL: {
+        CallSite call;
+        call.address = instr.address();
+        call.target = instr.operand() - code;
+        call.header_address = -1;
+        call.arg_size = 0;
+        if (prev_instr.opcode().GetId() == OP_PUSH_C) {
+          call.header_address = prev_instr.address();
+          call.arg_size = prev_instr.operand();
+        }
+        calls.push_back(call);
+        break;
+      }
+      case OP_JUMP:
+      case OP_JREL:
+      case OP_JZER:
+      case OP_JNZ:
+      case OP_JEQ:
+      case OP_JNEQ:
+      case OP_JLESS:
+      case OP_JLEQ:
+      case OP_JGRTR:
+      case OP_JGEQ:
+      case OP_JSLESS:
+      case OP_JSLEQ:
+      case OP_JSGRTR:
+      case OP_JSGEQ:
+        jumps.push_back(std::make_pair(index, GetJumpTarget(amx, instr)));
+        break;
+      case OP_SWITCH: {
+        CaseTable case_table(amx, instr.operand());
+        jumps.push_back(std::make_pair(index,
+                                       case_table.GetDefaultAddress()));
+        for (int i = 0; i < case_table.num_cases(); i++) {
+          jumps.push_back(std::make_pair(index,
+                                         case_table.GetCaseAddress(i)));
+        }
+        break;
+      }
+    }
+
+    prev_instr = instr;
+  }
+
+  if (!functions_.empty()) {
+    functions_.back().end_address_ = static_cast<cell>(amx.code_size());
+  }
+
+  // Something is seriously wrong with the code, or it jumps to addresses
+  // computed at run time. Either way we can't be sure that we see all
+  // call sites.
+  if (error || indirect_jumps_) {
+    return;
+  }
+
+  int num_publics = amx.num_publics();
+  for (int i = 0; i <= num_publics; i++) {
+    cell address = (i < num_publics) ? amx.GetPublicAddress(i)
+                                     : amx.GetPublicAddress(AMX_EXEC_MAIN);
+    int index = FindFunction(address);
+    if (index >= 0) {
+      functions_[index].public_ = true;
+    }
+  }
+
+  // Jumping into the middle of another function is something that
+  // the Pawn compiler would never do.
+  std::set<cell> jump_targets;
+  for (std::size_t i = 0; i < jumps.size(); i++) {
+    int index = FindFunction(jumps[i].second);
+    if (index >= 0 && index != jumps[i].first) {
+      eligible[index] = false;
+    }
+    jump_targets.insert(jumps[i].second);
+  }
+
+  std::map<int, cell> arg_sizes;
+  for (std::size_t i = 0; i < calls.size(); i++) {
+    const CallSite &call = calls[i];
+    int index = FindFunction(call.target);
+    if (index < 0) {
+      continue;
+    }
+    if (functions_[index].address() != call.target
+        || call.header_address < 0
+        || call.arg_size < 0
+        || call.arg_size % sizeof(cell) != 0
+        || call.arg_size > 0xFFFF
+        || jump_targets.find(call.address) != jump_targets.end()) {
+      eligible[index] = false;
+      continue;
+    }
+    std::map<int, cell>::const_iterator it = arg_sizes.find(index);
+    if (it != arg_sizes.end() && it->second != call.arg_size) {
+      eligible[index] = false;
+      continue;
+    }
+    arg_sizes[index] = call.arg_size;
+  }
+
+  for (std::size_t i = 0; i < functions_.size(); i++) {
+    Function &function = functions_[i];
+    std::map<int, cell>::const_iterator it = arg_sizes.find(i);
+    if (eligible[i] && !function.public_ && it != arg_sizes.end()) {
+      function.private_ = true;
+      function.arg_size_ = it->second;
+    }
+  }
+
+  for (std::size_t i = 0; i < calls.size(); i++) {
+    int index = FindFunction(calls[i].target);
+    if (index >= 0 && functions_[index].private_) {
+      arg_size_headers_.insert(calls[i].header_address);
+    }
+  }
+}
+
+} // namespace amxjit
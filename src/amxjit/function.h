@@ -0,0 +1,118 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_FUNCTION_H
+#define AMXJIT_FUNCTION_H
+
+#include <cstddef>
+#include <set>
+#include <vector>
+#include "amxref.h"
+
+namespace amxjit {
+
+class Function {
+ friend class FunctionTable;
+
+ public:
+  Function(cell address);
+
+  // Returns the address of the first instruction (PROC).
+  cell address() const { return address_; }
+
+  // Returns the address of the first instruction that doesn't belong
+  // to this function.
+  cell end_address() const { return end_address_; }
+
+  bool Contains(cell address) const {
+    return address >= address_ && address < end_address_;
+  }
+
+  // Returns true if this function is an entry point: a public or main().
+  bool is_public() const { return public_; }
+
+  // Returns true if this function uses the private calling convention.
+  // Private functions are called without the argument size header and
+  // pop their arguments themselves, as their size is known in advance.
+  bool is_private() const { return private_; }
+
+  // Returns the size of the arguments in bytes (only for private functions).
+  cell arg_size() const { return arg_size_; }
+
+  // Returns true if the function does nothing but return a constant, i.e.
+  // its code is PROC followed by CONST.PRI (or ZERO.PRI) and RETN.
+  bool returns_constant() const { return returns_constant_; }
+
+  // Returns the value returned by such a function.
+  cell constant_value() const { return constant_value_; }
+
+ private:
+  cell address_;
+  cell end_address_;
+  bool public_;
+  bool private_;
+  cell arg_size_;
+  bool returns_constant_;
+  cell constant_value_;
+};
+
+// FunctionTable splits the code section into functions (at PROC boundaries)
+// and figures out which of them can use the private calling convention:
+// functions that aren't entry points and whose address never escapes can
+// be called without pushing the argument size header.
+class FunctionTable {
+ public:
+  FunctionTable(AMXRef amx);
+
+  int num_functions() const;
+  const Function &GetFunction(int index) const;
+
+  // Returns the index of the function that contains the specified address
+  // or -1 if the address doesn't belong to any function.
+  int FindFunction(cell address) const;
+
+  // Returns true if the instruction at the specified address pushes the
+  // argument size header of a call to a private function. Such instructions
+  // must be skipped by the compiler.
+  bool IsArgSizeHeader(cell address) const;
+
+  // Converts a frame offset within the specified function to the actual
+  // offset (arguments of private functions are shifted by one cell).
+  cell GetFrameOffset(int function_index, cell offset) const;
+
+  // Returns true if the code jumps to addresses computed at run time.
+  bool has_indirect_jumps() const { return indirect_jumps_; }
+
+ private:
+  void Analyze(AMXRef amx);
+
+ private:
+  std::vector<Function> functions_;
+  std::set<cell> arg_size_headers_;
+  bool indirect_jumps_;
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_FUNCTION_H
@@ -0,0 +1,1333 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <utility>
+#include "compiler.h"
+#include "cstdint.h"
+#include "disasm.h"
+#include "function.h"
+#include "interp.h"
+
+// GCC supports taking addresses of labels, which allows each instruction
+// to store the address of its handler (direct threading). Other compilers
+// fall back to a switch over opcodes.
+#if defined __GNUC__ && !defined AMXJIT_NO_DIRECT_THREADING
+  #define AMXJIT_DIRECT_THREADING 1
+#else
+  #define AMXJIT_DIRECT_THREADING 0
+#endif
+
+namespace amxjit {
+namespace {
+
+// Additional opcodes that exist only in threaded code.
+enum {
+  OP_RETN_C = NUM_OPCODES, // RETN of a private function
+  OP_END,                  // fall through to the next function
+  NUM_INTERP_OPCODES
+};
+
+} // anonymous namespace
+
+#define AMXJIT_INTERP_OPCODES(X) \
+  X(OP_LOAD_PRI)   X(OP_LOAD_ALT)   X(OP_LOAD_S_PRI) X(OP_LOAD_S_ALT) \
+  X(OP_LREF_PRI)   X(OP_LREF_ALT)   X(OP_LREF_S_PRI) X(OP_LREF_S_ALT) \
+  X(OP_LOAD_I)     X(OP_LODB_I)     X(OP_CONST_PRI)  X(OP_CONST_ALT)  \
+  X(OP_ADDR_PRI)   X(OP_ADDR_ALT)   X(OP_STOR_PRI)   X(OP_STOR_ALT)   \
+  X(OP_STOR_S_PRI) X(OP_STOR_S_ALT) X(OP_SREF_PRI)   X(OP_SREF_ALT)   \
+  X(OP_SREF_S_PRI) X(OP_SREF_S_ALT) X(OP_STOR_I)     X(OP_STRB_I)     \
+  X(OP_LIDX)       X(OP_LIDX_B)     X(OP_IDXADDR)    X(OP_IDXADDR_B)  \
+  X(OP_ALIGN_PRI)  X(OP_ALIGN_ALT)  X(OP_LCTRL)      X(OP_SCTRL)      \
+  X(OP_MOVE_PRI)   X(OP_MOVE_ALT)   X(OP_XCHG)       X(OP_PUSH_PRI)   \
+  X(OP_PUSH_ALT)   X(OP_PUSH_C)     X(OP_PUSH)       X(OP_PUSH_S)     \
+  X(OP_POP_PRI)    X(OP_POP_ALT)    X(OP_STACK)      X(OP_HEAP)       \
+  X(OP_PROC)       X(OP_RET)        X(OP_RETN)       X(OP_RETN_C)     \
+  X(OP_CALL)       X(OP_JUMP_PRI)   X(OP_JUMP)       X(OP_JZER)       \
+  X(OP_JNZ)        X(OP_JEQ)        X(OP_JNEQ)       X(OP_JLESS)      \
+  X(OP_JLEQ)       X(OP_JGRTR)      X(OP_JGEQ)       X(OP_JSLESS)     \
+  X(OP_JSLEQ)      X(OP_JSGRTR)     X(OP_JSGEQ)      X(OP_SHL)        \
+  X(OP_SHR)        X(OP_SSHR)       X(OP_SHL_C_PRI)  X(OP_SHL_C_ALT)  \
+  X(OP_SHR_C_PRI)  X(OP_SHR_C_ALT)  X(OP_SMUL)       X(OP_SDIV)       \
+  X(OP_SDIV_ALT)   X(OP_UMUL)       X(OP_UDIV)       X(OP_UDIV_ALT)   \
+  X(OP_ADD)        X(OP_SUB)        X(OP_SUB_ALT)    X(OP_AND)        \
+  X(OP_OR)         X(OP_XOR)        X(OP_NOT)        X(OP_NEG)        \
+  X(OP_INVERT)     X(OP_ADD_C)      X(OP_SMUL_C)     X(OP_ZERO_PRI)   \
+  X(OP_ZERO_ALT)   X(OP_ZERO)       X(OP_ZERO_S)     X(OP_SIGN_PRI)   \
+  X(OP_SIGN_ALT)   X(OP_EQ)         X(OP_NEQ)        X(OP_LESS)       \
+  X(OP_LEQ)        X(OP_GRTR)       X(OP_GEQ)        X(OP_SLESS)      \
+  X(OP_SLEQ)       X(OP_SGRTR)      X(OP_SGEQ)       X(OP_EQ_C_PRI)   \
+  X(OP_EQ_C_ALT)   X(OP_INC_PRI)    X(OP_INC_ALT)    X(OP_INC)        \
+  X(OP_INC_S)      X(OP_INC_I)      X(OP_DEC_PRI)    X(OP_DEC_ALT)    \
+  X(OP_DEC)        X(OP_DEC_S)      X(OP_DEC_I)      X(OP_MOVS)       \
+  X(OP_CMPS)       X(OP_FILL)       X(OP_HALT)       X(OP_BOUNDS)     \
+  X(OP_SYSREQ_PRI) X(OP_SYSREQ_C)   X(OP_SYSREQ_D)   X(OP_SWITCH)     \
+  X(OP_SWAP_PRI)   X(OP_SWAP_ALT)   X(OP_PUSH_ADR)   X(OP_PUSH_R)     \
+  X(OP_CALL_PRI)   X(OP_CONST)      X(OP_CONST_S)    X(OP_END)
+
+struct Interpreter::Op {
+  const void *handler; // handler address or opcode (before linking)
+  cell operand;
+};
+
+struct Interpreter::Code {
+  Code(int index):
+    index(index), valid(false), back_edges(0), osr_back_edges(INT_MAX) {}
+
+  int index;
+  bool valid;
+  int back_edges;
+  int osr_back_edges;
+  std::vector<Op> ops;
+  std::vector<cell> addresses;   // address of each op
+  std::vector<cell> switch_data; // case tables: count, default, records
+};
+
+// Translator converts a function to threaded code. Jump targets are resolved
+// to op indices and calls to function indices; everything else maps
+// directly to the per-opcode methods of Compiler.
+class Interpreter::Translator: public Compiler {
+ public:
+  Translator(Code *code):
+    code_(code),
+    functions_(),
+    address_(0),
+    error_(false)
+  {
+  }
+
+  bool Translate(AMXRef amx, const FunctionTable &functions);
+
+ protected:
+  virtual bool Prepare(AMXRef amx, const FunctionTable &functions) {
+    return true;
+  }
+  virtual bool Process(const Instruction &instr) {
+    address_ = instr.address();
+    return true;
+  }
+  virtual CompileOutput *Finish(bool error) {
+    return 0;
+  }
+
+  virtual void load_pri(cell address) { Emit(OP_LOAD_PRI, address); }
+  virtual void load_alt(cell address) { Emit(OP_LOAD_ALT, address); }
+  virtual void load_s_pri(cell offset) { Emit(OP_LOAD_S_PRI, offset); }
+  virtual void load_s_alt(cell offset) { Emit(OP_LOAD_S_ALT, offset); }
+  virtual void lref_pri(cell address) { Emit(OP_LREF_PRI, address); }
+  virtual void lref_alt(cell address) { Emit(OP_LREF_ALT, address); }
+  virtual void lref_s_pri(cell offset) { Emit(OP_LREF_S_PRI, offset); }
+  virtual void lref_s_alt(cell offset) { Emit(OP_LREF_S_ALT, offset); }
+  virtual void load_i() { Emit(OP_LOAD_I); }
+  virtual void lodb_i(cell number) { Emit(OP_LODB_I, number); }
+  virtual void const_pri(cell value) { Emit(OP_CONST_PRI, value); }
+  virtual void const_alt(cell value) { Emit(OP_CONST_ALT, value); }
+  virtual void const_(cell address, cell value) {
+    Emit(OP_CONST, address);
+    Emit(OP_CONST, value);
+  }
+  virtual void const_s(cell offset, cell value) {
+    Emit(OP_CONST_S, offset);
+    Emit(OP_CONST_S, value);
+  }
+  virtual void addr_pri(cell offset) { Emit(OP_ADDR_PRI, offset); }
+  virtual void addr_alt(cell offset) { Emit(OP_ADDR_ALT, offset); }
+  virtual void stor_pri(cell address) { Emit(OP_STOR_PRI, address); }
+  virtual void stor_alt(cell address) { Emit(OP_STOR_ALT, address); }
+  virtual void stor_s_pri(cell offset) { Emit(OP_STOR_S_PRI, offset); }
+  virtual void stor_s_alt(cell offset) { Emit(OP_STOR_S_ALT, offset); }
+  virtual void sref_pri(cell address) { Emit(OP_SREF_PRI, address); }
+  virtual void sref_alt(cell address) { Emit(OP_SREF_ALT, address); }
+  virtual void sref_s_pri(cell offset) { Emit(OP_SREF_S_PRI, offset); }
+  virtual void sref_s_alt(cell offset) { Emit(OP_SREF_S_ALT, offset); }
+  virtual void stor_i() { Emit(OP_STOR_I); }
+  virtual void strb_i(cell number) { Emit(OP_STRB_I, number); }
+  virtual void lidx() { Emit(OP_LIDX); }
+  virtual void lidx_b(cell shift) { Emit(OP_LIDX_B, shift); }
+  virtual void idxaddr() { Emit(OP_IDXADDR); }
+  virtual void idxaddr_b(cell shift) { Emit(OP_IDXADDR_B, shift); }
+  virtual void align_pri(cell number) { Emit(OP_ALIGN_PRI, number); }
+  virtual void align_alt(cell number) { Emit(OP_ALIGN_ALT, number); }
+  virtual void lctrl(cell index, cell cip) {
+    switch (index) {
+      case 6:
+        Emit(OP_CONST_PRI, cip);
+        break;
+      case 7:
+        Emit(OP_CONST_PRI, 1);
+        break;
+      default:
+        Emit(OP_LCTRL, index);
+    }
+  }
+  virtual void sctrl(cell index) {
+    if (index == 6) {
+      Emit(OP_JUMP_PRI);
+    } else {
+      Emit(OP_SCTRL, index);
+    }
+  }
+  virtual void move_pri() { Emit(OP_MOVE_PRI); }
+  virtual void move_alt() { Emit(OP_MOVE_ALT); }
+  virtual void xchg() { Emit(OP_XCHG); }
+  virtual void push_pri() { Emit(OP_PUSH_PRI); }
+  virtual void push_alt() { Emit(OP_PUSH_ALT); }
+  virtual void push_r(cell value) { Emit(OP_PUSH_R, value); }
+  virtual void push_c(cell value) { Emit(OP_PUSH_C, value); }
+  virtual void push(cell address) { Emit(OP_PUSH, address); }
+  virtual void push_s(cell offset) { Emit(OP_PUSH_S, offset); }
+  virtual void pop_pri() { Emit(OP_POP_PRI); }
+  virtual void pop_alt() { Emit(OP_POP_ALT); }
+  virtual void stack(cell value) { Emit(OP_STACK, value); }
+  virtual void heap(cell value) { Emit(OP_HEAP, value); }
+  virtual void proc() { Emit(OP_PROC); }
+  virtual void ret() { Emit(OP_RET); }
+  virtual void retn() { Emit(OP_RETN); }
+  virtual void retn_c(cell num_bytes) { Emit(OP_RETN_C, num_bytes); }
+  virtual void call(cell address) {
+    int index = functions_->FindFunction(address);
+    if (index < 0 || functions_->GetFunction(index).address() != address) {
+      error_ = true;
+    } else {
+      Emit(OP_CALL, index);
+    }
+  }
+  virtual void call_pri() { Emit(OP_CALL_PRI); }
+  virtual void jump_pri() { Emit(OP_JUMP_PRI); }
+  virtual void jump(cell address) { EmitJump(OP_JUMP, address); }
+  virtual void jzer(cell address) { EmitJump(OP_JZER, address); }
+  virtual void jnz(cell address) { EmitJump(OP_JNZ, address); }
+  virtual void jeq(cell address) { EmitJump(OP_JEQ, address); }
+  virtual void jneq(cell address) { EmitJump(OP_JNEQ, address); }
+  virtual void jless(cell address) { EmitJump(OP_JLESS, address); }
+  virtual void jleq(cell address) { EmitJump(OP_JLEQ, address); }
+  virtual void jgrtr(cell address) { EmitJump(OP_JGRTR, address); }
+  virtual void jgeq(cell address) { EmitJump(OP_JGEQ, address); }
+  virtual void jsless(cell address) { EmitJump(OP_JSLESS, address); }
+  virtual void jsleq(cell address) { EmitJump(OP_JSLEQ, address); }
+  virtual void jsgrtr(cell address) { EmitJump(OP_JSGRTR, address); }
+  virtual void jsgeq(cell address) { EmitJump(OP_JSGEQ, address); }
+  virtual void shl() { Emit(OP_SHL); }
+  virtual void shr() { Emit(OP_SHR); }
+  virtual void sshr() { Emit(OP_SSHR); }
+  virtual void shl_c_pri(cell value) { Emit(OP_SHL_C_PRI, value); }
+  virtual void shl_c_alt(cell value) { Emit(OP_SHL_C_ALT, value); }
+  virtual void shr_c_pri(cell value) { Emit(OP_SHR_C_PRI, value); }
+  virtual void shr_c_alt(cell value) { Emit(OP_SHR_C_ALT, value); }
+  virtual void smul() { Emit(OP_SMUL); }
+  virtual void sdiv() { Emit(OP_SDIV); }
+  virtual void sdiv_alt() { Emit(OP_SDIV_ALT); }
+  virtual void umul() { Emit(OP_UMUL); }
+  virtual void udiv() { Emit(OP_UDIV); }
+  virtual void udiv_alt() { Emit(OP_UDIV_ALT); }
+  virtual void add() { Emit(OP_ADD); }
+  virtual void sub() { Emit(OP_SUB); }
+  virtual void sub_alt() { Emit(OP_SUB_ALT); }
+  virtual void and_() { Emit(OP_AND); }
+  virtual void or_() { Emit(OP_OR); }
+  virtual void xor_() { Emit(OP_XOR); }
+  virtual void not_() { Emit(OP_NOT); }
+  virtual void neg() { Emit(OP_NEG); }
+  virtual void invert() { Emit(OP_INVERT); }
+  virtual void add_c(cell value) { Emit(OP_ADD_C, value); }
+  virtual void smul_c(cell value) { Emit(OP_SMUL_C, value); }
+  virtual void zero_pri() { Emit(OP_ZERO_PRI); }
+  virtual void zero_alt() { Emit(OP_ZERO_ALT); }
+  virtual void zero(cell address) { Emit(OP_ZERO, address); }
+  virtual void zero_s(cell offset) { Emit(OP_ZERO_S, offset); }
+  virtual void sign_pri() { Emit(OP_SIGN_PRI); }
+  virtual void sign_alt() { Emit(OP_SIGN_ALT); }
+  virtual void eq() { Emit(OP_EQ); }
+  virtual void neq() { Emit(OP_NEQ); }
+  virtual void less() { Emit(OP_LESS); }
+  virtual void leq() { Emit(OP_LEQ); }
+  virtual void grtr() { Emit(OP_GRTR); }
+  virtual void geq() { Emit(OP_GEQ); }
+  virtual void sless() { Emit(OP_SLESS); }
+  virtual void sleq() { Emit(OP_SLEQ); }
+  virtual void sgrtr() { Emit(OP_SGRTR); }
+  virtual void sgeq() { Emit(OP_SGEQ); }
+  virtual void eq_c_pri(cell value) { Emit(OP_EQ_C_PRI, value); }
+  virtual void eq_c_alt(cell value) { Emit(OP_EQ_C_ALT, value); }
+  virtual void inc_pri() { Emit(OP_INC_PRI); }
+  virtual void inc_alt() { Emit(OP_INC_ALT); }
+  virtual void inc(cell address) { Emit(OP_INC, address); }
+  virtual void inc_s(cell offset) { Emit(OP_INC_S, offset); }
+  virtual void inc_i() { Emit(OP_INC_I); }
+  virtual void dec_pri() { Emit(OP_DEC_PRI); }
+  virtual void dec_alt() { Emit(OP_DEC_ALT); }
+  virtual void dec(cell address) { Emit(OP_DEC, address); }
+  virtual void dec_s(cell offset) { Emit(OP_DEC_S, offset); }
+  virtual void dec_i() { Emit(OP_DEC_I); }
+  virtual void movs(cell num_bytes) { Emit(OP_MOVS, num_bytes); }
+  virtual void cmps(cell num_bytes) { Emit(OP_CMPS, num_bytes); }
+  virtual void fill(cell num_bytes) { Emit(OP_FILL, num_bytes); }
+  virtual void halt(cell error_code) { Emit(OP_HALT, error_code); }
+  virtual void bounds(cell value) { Emit(OP_BOUNDS, value); }
+  virtual void sysreq_pri() { Emit(OP_SYSREQ_PRI); }
+  virtual void sysreq_c(cell index, const char *name) {
+    Emit(OP_SYSREQ_C, index);
+  }
+  virtual void sysreq_d(cell address, const char *name) {
+    Emit(OP_SYSREQ_D, address);
+  }
+  virtual void switch_(const CaseTable &case_table);
+  virtual void casetbl() {}
+  virtual void swap_pri() { Emit(OP_SWAP_PRI); }
+  virtual void swap_alt() { Emit(OP_SWAP_ALT); }
+  virtual void push_adr(cell offset) { Emit(OP_PUSH_ADR, offset); }
+  virtual void nop() {}
+  virtual void break_() {}
+
+ private:
+  void Emit(int opcode, cell operand = 0);
+  void EmitJump(int opcode, cell address);
+
+ private:
+  struct Fixup {
+    bool in_switch;     // patch switch_data instead of an op
+    std::size_t index;  // index of the patched op or switch_data item
+    cell address;       // target address
+  };
+
+  Code *code_;
+  const FunctionTable *functions_;
+  cell address_;
+  bool error_;
+  std::vector<Fixup> fixups_;
+};
+
+bool Interpreter::Translator::Translate(AMXRef amx,
+                                        const FunctionTable &functions) {
+  const Function &function = functions.GetFunction(code_->index);
+  functions_ = &functions;
+
+  if (!CompileRange(amx, functions, function.address(),
+                    function.end_address()) || error_) {
+    return false;
+  }
+
+  address_ = function.end_address();
+  Emit(OP_END);
+
+  const std::vector<cell> &addresses = code_->addresses;
+  for (std::size_t i = 0; i < fixups_.size(); i++) {
+    const Fixup &fixup = fixups_[i];
+    if (!function.Contains(fixup.address)) {
+      // Jumps between functions can't be expressed in threaded code.
+      return false;
+    }
+    cell index = static_cast<cell>(
+      std::lower_bound(addresses.begin(), addresses.end(), fixup.address)
+        - addresses.begin());
+    if (fixup.in_switch) {
+      code_->switch_data[fixup.index] = index;
+    } else {
+      code_->ops[fixup.index].operand = index;
+    }
+  }
+
+  return true;
+}
+
+void Interpreter::Translator::switch_(const CaseTable &case_table) {
+  std::vector<cell> &data = code_->switch_data;
+  cell offset = static_cast<cell>(data.size());
+
+  data.push_back(case_table.num_cases());
+  Fixup fixup = {true, data.size(), case_table.GetDefaultAddress()};
+  fixups_.push_back(fixup);
+  data.push_back(0);
+
+  for (int i = 0; i < case_table.num_cases(); i++) {
+    data.push_back(case_table.GetCaseValue(i));
+    Fixup fixup = {true, data.size(), case_table.GetCaseAddress(i)};
+    fixups_.push_back(fixup);
+    data.push_back(0);
+  }
+
+  Emit(OP_SWITCH, offset);
+}
+
+void Interpreter::Translator::Emit(int opcode, cell operand) {
+  Op op;
+  op.handler = reinterpret_cast<const void*>(static_cast<intptr_t>(opcode));
+  op.operand = operand;
+  code_->ops.push_back(op);
+  code_->addresses.push_back(address_);
+}
+
+void Interpreter::Translator::EmitJump(int opcode, cell address) {
+  Fixup fixup = {false, code_->ops.size(), address};
+  fixups_.push_back(fixup);
+  Emit(opcode);
+}
+
+Interpreter::Interpreter(AMXRef amx, const FunctionTable &functions,
+                         InterpreterHost *host):
+  amx_(amx),
+  functions_(functions),
+  host_(host),
+  error_handler_(),
+  osr_threshold_(0),
+  code_(functions.num_functions()),
+  handlers_()
+{
+}
+
+Interpreter::~Interpreter() {
+  for (std::size_t i = 0; i < code_.size(); i++) {
+    delete code_[i];
+  }
+}
+
+int Interpreter::GetBackEdgeCount(int index) const {
+  assert(index >= 0 && index < static_cast<int>(code_.size()));
+  return code_[index] != 0 ? code_[index]->back_edges : 0;
+}
+
+int Interpreter::GetNumInterpreted() const {
+  int count = 0;
+  for (std::size_t i = 0; i < code_.size(); i++) {
+    if (code_[i] != 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+Interpreter::Code *Interpreter::GetCode(int index) {
+  assert(index >= 0 && index < static_cast<int>(code_.size()));
+  Code *&code = code_[index];
+
+  if (code == 0) {
+    code = new Code(index);
+    Translator translator(code);
+    translator.SetErrorHandler(error_handler_);
+    code->valid = translator.Translate(amx_, functions_);
+    if (osr_threshold_ > 0) {
+      code->osr_back_edges = osr_threshold_;
+    }
+    #if AMXJIT_DIRECT_THREADING
+      for (std::size_t i = 0; i < code->ops.size(); i++) {
+        Op &op = code->ops[i];
+        op.handler = handlers_[reinterpret_cast<intptr_t>(op.handler)];
+      }
+    #endif
+  }
+
+  return code->valid ? code : 0;
+}
+
+// Replaces the return addresses of the interpreted frames of the current
+// call with the corresponding addresses in compiled code, so that the
+// rest of the call can run as compiled code. Returns the compiled code of
+// the instruction at the specified address or null if the call can't be
+// moved, in which case nothing is changed.
+void *Interpreter::EnterCompiledCode(cell address, cell frm, int depth) {
+  unsigned char *data = amx_.data();
+  std::vector<std::pair<cell, void*> > return_addresses;
+
+  for (int i = 0; i < depth; i++) {
+    cell slot = frm + static_cast<cell>(sizeof(cell));
+    void *target = host_->GetCompiledCode(
+      *reinterpret_cast<cell*>(data + slot));
+    if (target == 0) {
+      return 0;
+    }
+    return_addresses.push_back(std::make_pair(slot, target));
+    frm = *reinterpret_cast<cell*>(data + frm);
+  }
+
+  void *start = host_->GetCompiledCode(address);
+  if (start == 0) {
+    return 0;
+  }
+
+  for (std::size_t i = 0; i < return_addresses.size(); i++) {
+    *reinterpret_cast<cell*>(data + return_addresses[i].first) =
+      reinterpret_cast<cell>(return_addresses[i].second);
+  }
+  return start;
+}
+
+const Interpreter::Op *Interpreter::FindOp(cell address, Code *&code) {
+  int index = functions_.FindFunction(address);
+  if (index < 0) {
+    return 0;
+  }
+  Code *target = GetCode(index);
+  if (target == 0) {
+    return 0;
+  }
+  std::vector<cell>::const_iterator it =
+    std::lower_bound(target->addresses.begin(),
+                     target->addresses.end(),
+                     address);
+  if (it == target->addresses.end()) {
+    return 0;
+  }
+  code = target;
+  return &target->ops[it - target->addresses.begin()];
+}
+
+#if AMXJIT_DIRECT_THREADING
+  #define TARGET(opcode) L_##opcode:
+  #define DISPATCH() goto *ip->handler
+#else
+  #define TARGET(opcode) case opcode:
+  #define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() ip++; DISPATCH()
+
+#define MEM(address) (*reinterpret_cast<cell*>(data + (address)))
+
+#define SAVE_REGISTERS() \
+  amx->pri = pri; \
+  amx->alt = alt; \
+  amx->frm = frm; \
+  amx->stk = stk
+
+#define LOAD_REGISTERS() \
+  pri = amx->pri; \
+  alt = amx->alt; \
+  frm = amx->frm; \
+  stk = amx->stk
+
+#define JUMP_IF(condition) \
+  if (condition) { \
+    const Op *target = ops + ip->operand; \
+    if (target <= ip \
+        && ++code->back_edges >= code->osr_back_edges) { \
+      ip = target; \
+      goto osr; \
+    } \
+    ip = target; \
+    DISPATCH(); \
+  } \
+  NEXT()
+
+#define CALL_FUNCTION(index) \
+  bool halted = false; \
+  SAVE_REGISTERS(); \
+  if (host_->Call((index), halted)) { \
+    if (halted) { \
+      error = amx->error; \
+      goto abort; \
+    } \
+    LOAD_REGISTERS(); \
+    NEXT(); \
+  } \
+  Code *callee = GetCode(index); \
+  if (callee == 0) { \
+    error = AMX_ERR_INVINSTR; \
+    goto abort; \
+  } \
+  stk -= sizeof(cell); \
+  MEM(stk) = code->addresses[ip - ops + 1]; \
+  depth++; \
+  code = callee; \
+  ops = &code->ops[0]; \
+  ip = ops; \
+  DISPATCH()
+
+#define RETURN_TO(address) \
+  if (depth == 0) { \
+    return_address = (address); \
+    goto exit; \
+  } \
+  depth--; \
+  if ((ip = FindOp((address), code)) == 0) { \
+    error = AMX_ERR_MEMACCESS; \
+    goto abort; \
+  } \
+  ops = &code->ops[0]; \
+  DISPATCH()
+
+int Interpreter::Call(int index, cell &return_address) {
+  #if AMXJIT_DIRECT_THREADING
+    static const void *handlers[NUM_INTERP_OPCODES];
+    if (handlers_ == 0) {
+      for (int i = 0; i < NUM_INTERP_OPCODES; i++) {
+        handlers[i] = &&invalid;
+      }
+      #define SET_HANDLER(opcode) handlers[opcode] = &&L_##opcode;
+      AMXJIT_INTERP_OPCODES(SET_HANDLER)
+      #undef SET_HANDLER
+      handlers_ = handlers;
+    }
+  #endif
+
+  AMX *amx = amx_.raw();
+  unsigned char *data = amx_.data();
+
+  cell pri = amx->pri;
+  cell alt = amx->alt;
+  cell frm = amx->frm;
+  cell stk = amx->stk;
+
+  int depth = 0;
+  int error = AMX_ERR_NONE;
+  return_address = 0;
+
+  Code *code = GetCode(index);
+  if (code == 0) {
+    return AMX_ERR_INVINSTR;
+  }
+
+  const Op *ops = &code->ops[0];
+  const Op *ip = ops;
+
+  DISPATCH();
+
+#if !AMXJIT_DIRECT_THREADING
+dispatch:
+  switch (reinterpret_cast<intptr_t>(ip->handler)) {
+#endif
+
+  TARGET(OP_LOAD_PRI) {
+    pri = MEM(ip->operand);
+    NEXT();
+  }
+  TARGET(OP_LOAD_ALT) {
+    alt = MEM(ip->operand);
+    NEXT();
+  }
+  TARGET(OP_LOAD_S_PRI) {
+    pri = MEM(frm + ip->operand);
+    NEXT();
+  }
+  TARGET(OP_LOAD_S_ALT) {
+    alt = MEM(frm + ip->operand);
+    NEXT();
+  }
+  TARGET(OP_LREF_PRI) {
+    pri = MEM(MEM(ip->operand));
+    NEXT();
+  }
+  TARGET(OP_LREF_ALT) {
+    alt = MEM(MEM(ip->operand));
+    NEXT();
+  }
+  TARGET(OP_LREF_S_PRI) {
+    pri = MEM(MEM(frm + ip->operand));
+    NEXT();
+  }
+  TARGET(OP_LREF_S_ALT) {
+    alt = MEM(MEM(frm + ip->operand));
+    NEXT();
+  }
+  TARGET(OP_LOAD_I) {
+    pri = MEM(pri);
+    NEXT();
+  }
+  TARGET(OP_LODB_I) {
+    switch (ip->operand) {
+      case 1:
+        pri = *reinterpret_cast<unsigned char*>(data + pri);
+        break;
+      case 2:
+        pri = *reinterpret_cast<unsigned short*>(data + pri);
+        break;
+      case 4:
+        pri = MEM(pri);
+        break;
+    }
+    NEXT();
+  }
+  TARGET(OP_CONST_PRI) {
+    pri = ip->operand;
+    NEXT();
+  }
+  TARGET(OP_CONST_ALT) {
+    alt = ip->operand;
+    NEXT();
+  }
+  TARGET(OP_CONST) {
+    // The value is in the operand of the next op, which is skipped.
+    MEM(ip->operand) = ip[1].operand;
+    ip += 2;
+    DISPATCH();
+  }
+  TARGET(OP_CONST_S) {
+    MEM(frm + ip->operand) = ip[1].operand;
+    ip += 2;
+    DISPATCH();
+  }
+  TARGET(OP_ADDR_PRI) {
+    pri = frm + ip->operand;
+    NEXT();
+  }
+  TARGET(OP_ADDR_ALT) {
+    alt = frm + ip->operand;
+    NEXT();
+  }
+  TARGET(OP_STOR_PRI) {
+    MEM(ip->operand) = pri;
+    NEXT();
+  }
+  TARGET(OP_STOR_ALT) {
+    MEM(ip->operand) = alt;
+    NEXT();
+  }
+  TARGET(OP_STOR_S_PRI) {
+    MEM(frm + ip->operand) = pri;
+    NEXT();
+  }
+  TARGET(OP_STOR_S_ALT) {
+    MEM(frm + ip->operand) = alt;
+    NEXT();
+  }
+  TARGET(OP_SREF_PRI) {
+    MEM(MEM(ip->operand)) = pri;
+    NEXT();
+  }
+  TARGET(OP_SREF_ALT) {
+    MEM(MEM(ip->operand)) = alt;
+    NEXT();
+  }
+  TARGET(OP_SREF_S_PRI) {
+    MEM(MEM(frm + ip->operand)) = pri;
+    NEXT();
+  }
+  TARGET(OP_SREF_S_ALT) {
+    MEM(MEM(frm + ip->operand)) = alt;
+    NEXT();
+  }
+  TARGET(OP_STOR_I) {
+    MEM(alt) = pri;
+    NEXT();
+  }
+  TARGET(OP_STRB_I) {
+    switch (ip->operand) {
+      case 1:
+        *reinterpret_cast<unsigned char*>(data + alt) =
+          static_cast<unsigned char>(pri);
+        break;
+      case 2:
+        *reinterpret_cast<unsigned short*>(data + alt) =
+          static_cast<unsigned short>(pri);
+        break;
+      case 4:
+        MEM(alt) = pri;
+        break;
+    }
+    NEXT();
+  }
+  TARGET(OP_LIDX) {
+    pri = MEM(alt + pri * sizeof(cell));
+    NEXT();
+  }
+  TARGET(OP_LIDX_B) {
+    pri = MEM(alt + (pri << ip->operand));
+    NEXT();
+  }
+  TARGET(OP_IDXADDR) {
+    pri = alt + pri * sizeof(cell);
+    NEXT();
+  }
+  TARGET(OP_IDXADDR_B) {
+    pri = alt + (pri << ip->operand);
+    NEXT();
+  }
+  TARGET(OP_ALIGN_PRI) {
+    #if BYTE_ORDER == LITTLE_ENDIAN
+      if (static_cast<std::size_t>(ip->operand) < sizeof(cell)) {
+        pri ^= sizeof(cell) - ip->operand;
+      }
+    #endif
+    NEXT();
+  }
+  TARGET(OP_ALIGN_ALT) {
+    #if BYTE_ORDER == LITTLE_ENDIAN
+      if (static_cast<std::size_t>(ip->operand) < sizeof(cell)) {
+        alt ^= sizeof(cell) - ip->operand;
+      }
+    #endif
+    NEXT();
+  }
+  TARGET(OP_LCTRL) {
+    switch (ip->operand) {
+      case 0:
+        pri = amx_.header()->cod;
+        break;
+      case 1:
+        pri = amx_.header()->dat;
+        break;
+      case 2:
+        pri = amx->hea;
+        break;
+      case 3:
+        pri = amx->stp;
+        break;
+      case 4:
+        pri = stk;
+        break;
+      case 5:
+        pri = frm;
+        break;
+    }
+    NEXT();
+  }
+  TARGET(OP_SCTRL) {
+    switch (ip->operand) {
+      case 2:
+        amx->hea = pri;
+        break;
+      case 4:
+        stk = pri;
+        break;
+      case 5:
+        frm = pri;
+        break;
+    }
+    NEXT();
+  }
+  TARGET(OP_MOVE_PRI) {
+    pri = alt;
+    NEXT();
+  }
+  TARGET(OP_MOVE_ALT) {
+    alt = pri;
+    NEXT();
+  }
+  TARGET(OP_XCHG) {
+    std::swap(pri, alt);
+    NEXT();
+  }
+  TARGET(OP_PUSH_PRI) {
+    stk -= sizeof(cell);
+    MEM(stk) = pri;
+    NEXT();
+  }
+  TARGET(OP_PUSH_ALT) {
+    stk -= sizeof(cell);
+    MEM(stk) = alt;
+    NEXT();
+  }
+  TARGET(OP_PUSH_R) {
+    for (cell i = 0; i < ip->operand; i++) {
+      stk -= sizeof(cell);
+      MEM(stk) = pri;
+    }
+    NEXT();
+  }
+  TARGET(OP_PUSH_C) {
+    stk -= sizeof(cell);
+    MEM(stk) = ip->operand;
+    NEXT();
+  }
+  TARGET(OP_PUSH) {
+    stk -= sizeof(cell);
+    MEM(stk) = MEM(ip->operand);
+    NEXT();
+  }
+  TARGET(OP_PUSH_S) {
+    stk -= sizeof(cell);
+    MEM(stk) = MEM(frm + ip->operand);
+    NEXT();
+  }
+  TARGET(OP_POP_PRI) {
+    pri = MEM(stk);
+    stk += sizeof(cell);
+    NEXT();
+  }
+  TARGET(OP_POP_ALT) {
+    alt = MEM(stk);
+    stk += sizeof(cell);
+    NEXT();
+  }
+  TARGET(OP_STACK) {
+    alt = stk;
+    stk += ip->operand;
+    NEXT();
+  }
+  TARGET(OP_HEAP) {
+    alt = amx->hea;
+    amx->hea += ip->operand;
+    NEXT();
+  }
+  TARGET(OP_PROC) {
+    stk -= sizeof(cell);
+    MEM(stk) = frm;
+    frm = stk;
+    NEXT();
+  }
+  TARGET(OP_RET) {
+    frm = MEM(stk);
+    stk += sizeof(cell);
+    cell address = MEM(stk);
+    stk += sizeof(cell);
+    RETURN_TO(address);
+  }
+  TARGET(OP_RETN) {
+    frm = MEM(stk);
+    stk += sizeof(cell);
+    cell address = MEM(stk);
+    stk += sizeof(cell);
+    stk += MEM(stk) + sizeof(cell);
+    RETURN_TO(address);
+  }
+  TARGET(OP_RETN_C) {
+    frm = MEM(stk);
+    stk += sizeof(cell);
+    cell address = MEM(stk);
+    stk += sizeof(cell) + ip->operand;
+    RETURN_TO(address);
+  }
+  TARGET(OP_CALL) {
+    CALL_FUNCTION(ip->operand);
+  }
+  TARGET(OP_CALL_PRI) {
+    int index = functions_.FindFunction(pri);
+    if (index < 0 || functions_.GetFunction(index).address() != pri) {
+      error = AMX_ERR_MEMACCESS;
+      goto abort;
+    }
+    CALL_FUNCTION(index);
+  }
+  TARGET(OP_JUMP_PRI) {
+    Code *target_code = code;
+    const Op *target = FindOp(pri, target_code);
+    if (target == 0) {
+      // Continue execution as if there was no jump at all.
+      NEXT();
+    }
+    code = target_code;
+    ops = &code->ops[0];
+    ip = target;
+    DISPATCH();
+  }
+  TARGET(OP_JUMP) {
+    JUMP_IF(true);
+  }
+  TARGET(OP_JZER) {
+    JUMP_IF(pri == 0);
+  }
+  TARGET(OP_JNZ) {
+    JUMP_IF(pri != 0);
+  }
+  TARGET(OP_JEQ) {
+    JUMP_IF(pri == alt);
+  }
+  TARGET(OP_JNEQ) {
+    JUMP_IF(pri != alt);
+  }
+  TARGET(OP_JLESS) {
+    JUMP_IF(static_cast<ucell>(pri) < static_cast<ucell>(alt));
+  }
+  TARGET(OP_JLEQ) {
+    JUMP_IF(static_cast<ucell>(pri) <= static_cast<ucell>(alt));
+  }
+  TARGET(OP_JGRTR) {
+    JUMP_IF(static_cast<ucell>(pri) > static_cast<ucell>(alt));
+  }
+  TARGET(OP_JGEQ) {
+    JUMP_IF(static_cast<ucell>(pri) >= static_cast<ucell>(alt));
+  }
+  TARGET(OP_JSLESS) {
+    JUMP_IF(pri < alt);
+  }
+  TARGET(OP_JSLEQ) {
+    JUMP_IF(pri <= alt);
+  }
+  TARGET(OP_JSGRTR) {
+    JUMP_IF(pri > alt);
+  }
+  TARGET(OP_JSGEQ) {
+    JUMP_IF(pri >= alt);
+  }
+  // Shift counts are masked the same way as x86 does it.
+  TARGET(OP_SHL) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) << (alt & 31));
+    NEXT();
+  }
+  TARGET(OP_SHR) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) >> (alt & 31));
+    NEXT();
+  }
+  TARGET(OP_SSHR) {
+    pri >>= (alt & 31);
+    NEXT();
+  }
+  TARGET(OP_SHL_C_PRI) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) << (ip->operand & 31));
+    NEXT();
+  }
+  TARGET(OP_SHL_C_ALT) {
+    alt = static_cast<cell>(static_cast<ucell>(alt) << (ip->operand & 31));
+    NEXT();
+  }
+  TARGET(OP_SHR_C_PRI) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) >> (ip->operand & 31));
+    NEXT();
+  }
+  TARGET(OP_SHR_C_ALT) {
+    alt = static_cast<cell>(static_cast<ucell>(alt) >> (ip->operand & 31));
+    NEXT();
+  }
+  TARGET(OP_SMUL) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) * static_cast<ucell>(alt));
+    NEXT();
+  }
+  TARGET(OP_SDIV_ALT) {
+    std::swap(pri, alt);
+  }
+  // fall through
+  TARGET(OP_SDIV) {
+    if (alt == 0) {
+      error = AMX_ERR_DIVIDE;
+      goto abort;
+    }
+    // Must produce the same results as the compiled code: the quotient is
+    // truncated and the remainder takes the sign of the divisor.
+    if (alt == -1) {
+      pri = static_cast<cell>(0 - static_cast<ucell>(pri));
+      alt = 0;
+    } else {
+      cell quotient = pri / alt;
+      cell remainder = static_cast<cell>(static_cast<ucell>(pri % alt)
+                                         + static_cast<ucell>(alt));
+      pri = quotient;
+      alt = remainder % alt;
+    }
+    NEXT();
+  }
+  TARGET(OP_UMUL) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) * static_cast<ucell>(alt));
+    NEXT();
+  }
+  TARGET(OP_UDIV_ALT) {
+    std::swap(pri, alt);
+  }
+  // fall through
+  TARGET(OP_UDIV) {
+    if (alt == 0) {
+      error = AMX_ERR_DIVIDE;
+      goto abort;
+    }
+    ucell quotient = static_cast<ucell>(pri) / static_cast<ucell>(alt);
+    ucell remainder = static_cast<ucell>(pri) % static_cast<ucell>(alt);
+    pri = static_cast<cell>(quotient);
+    alt = static_cast<cell>(remainder);
+    NEXT();
+  }
+  TARGET(OP_ADD) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) + static_cast<ucell>(alt));
+    NEXT();
+  }
+  TARGET(OP_SUB) {
+    pri = static_cast<cell>(static_cast<ucell>(pri) - static_cast<ucell>(alt));
+    NEXT();
+  }
+  TARGET(OP_SUB_ALT) {
+    pri = static_cast<cell>(static_cast<ucell>(alt) - static_cast<ucell>(pri));
+    NEXT();
+  }
+  TARGET(OP_AND) {
+    pri &= alt;
+    NEXT();
+  }
+  TARGET(OP_OR) {
+    pri |= alt;
+    NEXT();
+  }
+  TARGET(OP_XOR) {
+    pri ^= alt;
+    NEXT();
+  }
+  TARGET(OP_NOT) {
+    pri = !pri;
+    NEXT();
+  }
+  TARGET(OP_NEG) {
+    pri = static_cast<cell>(0 - static_cast<ucell>(pri));
+    NEXT();
+  }
+  TARGET(OP_INVERT) {
+    pri = ~pri;
+    NEXT();
+  }
+  TARGET(OP_ADD_C) {
+    pri = static_cast<cell>(static_cast<ucell>(pri)
+                            + static_cast<ucell>(ip->operand));
+    NEXT();
+  }
+  TARGET(OP_SMUL_C) {
+    pri = static_cast<cell>(static_cast<ucell>(pri)
+                            * static_cast<ucell>(ip->operand));
+    NEXT();
+  }
+  TARGET(OP_ZERO_PRI) {
+    pri = 0;
+    NEXT();
+  }
+  TARGET(OP_ZERO_ALT) {
+    alt = 0;
+    NEXT();
+  }
+  TARGET(OP_ZERO) {
+    MEM(ip->operand) = 0;
+    NEXT();
+  }
+  TARGET(OP_ZERO_S) {
+    MEM(frm + ip->operand) = 0;
+    NEXT();
+  }
+  TARGET(OP_SIGN_PRI) {
+    pri = static_cast<signed char>(pri);
+    NEXT();
+  }
+  TARGET(OP_SIGN_ALT) {
+    alt = static_cast<signed char>(alt);
+    NEXT();
+  }
+  TARGET(OP_EQ) {
+    pri = pri == alt;
+    NEXT();
+  }
+  TARGET(OP_NEQ) {
+    pri = pri != alt;
+    NEXT();
+  }
+  TARGET(OP_LESS) {
+    pri = static_cast<ucell>(pri) < static_cast<ucell>(alt);
+    NEXT();
+  }
+  TARGET(OP_LEQ) {
+    pri = static_cast<ucell>(pri) <= static_cast<ucell>(alt);
+    NEXT();
+  }
+  TARGET(OP_GRTR) {
+    pri = static_cast<ucell>(pri) > static_cast<ucell>(alt);
+    NEXT();
+  }
+  TARGET(OP_GEQ) {
+    pri = static_cast<ucell>(pri) >= static_cast<ucell>(alt);
+    NEXT();
+  }
+  TARGET(OP_SLESS) {
+    pri = pri < alt;
+    NEXT();
+  }
+  TARGET(OP_SLEQ) {
+    pri = pri <= alt;
+    NEXT();
+  }
+  TARGET(OP_SGRTR) {
+    pri = pri > alt;
+    NEXT();
+  }
+  TARGET(OP_SGEQ) {
+    pri = pri >= alt;
+    NEXT();
+  }
+  TARGET(OP_EQ_C_PRI) {
+    pri = pri == ip->operand;
+    NEXT();
+  }
+  TARGET(OP_EQ_C_ALT) {
+    pri = alt == ip->operand;
+    NEXT();
+  }
+  TARGET(OP_INC_PRI) {
+    pri++;
+    NEXT();
+  }
+  TARGET(OP_INC_ALT) {
+    alt++;
+    NEXT();
+  }
+  TARGET(OP_INC) {
+    MEM(ip->operand)++;
+    NEXT();
+  }
+  TARGET(OP_INC_S) {
+    MEM(frm + ip->operand)++;
+    NEXT();
+  }
+  TARGET(OP_INC_I) {
+    MEM(pri)++;
+    NEXT();
+  }
+  TARGET(OP_DEC_PRI) {
+    pri--;
+    NEXT();
+  }
+  TARGET(OP_DEC_ALT) {
+    alt--;
+    NEXT();
+  }
+  TARGET(OP_DEC) {
+    MEM(ip->operand)--;
+    NEXT();
+  }
+  TARGET(OP_DEC_S) {
+    MEM(frm + ip->operand)--;
+    NEXT();
+  }
+  TARGET(OP_DEC_I) {
+    MEM(pri)--;
+    NEXT();
+  }
+  TARGET(OP_MOVS) {
+    std::memmove(data + alt, data + pri, ip->operand);
+    NEXT();
+  }
+  TARGET(OP_CMPS) {
+    int result = std::memcmp(data + alt, data + pri, ip->operand);
+    pri = (result > 0) - (result < 0);
+    NEXT();
+  }
+  TARGET(OP_FILL) {
+    for (cell i = 0; i < ip->operand / cell(sizeof(cell)); i++) {
+      MEM(alt + i * sizeof(cell)) = pri;
+    }
+    NEXT();
+  }
+  TARGET(OP_HALT) {
+    error = ip->operand;
+    goto abort;
+  }
+  TARGET(OP_BOUNDS) {
+    if (static_cast<ucell>(pri) > static_cast<ucell>(ip->operand)) {
+      error = AMX_ERR_BOUNDS;
+      goto abort;
+    }
+    NEXT();
+  }
+  TARGET(OP_SYSREQ_PRI) {
+    cell result = 0;
+    SAVE_REGISTERS();
+    error = amx->callback(amx, pri, &result,
+                          reinterpret_cast<cell*>(data + stk));
+    if (error != AMX_ERR_NONE) {
+      goto abort;
+    }
+    frm = amx->frm;
+    stk = amx->stk;
+    pri = result;
+    NEXT();
+  }
+  TARGET(OP_SYSREQ_C) {
+    cell result = 0;
+    SAVE_REGISTERS();
+    error = amx->callback(amx, ip->operand, &result,
+                          reinterpret_cast<cell*>(data + stk));
+    if (error != AMX_ERR_NONE) {
+      goto abort;
+    }
+    frm = amx->frm;
+    stk = amx->stk;
+    pri = result;
+    NEXT();
+  }
+  TARGET(OP_SYSREQ_D) {
+    AMX_NATIVE native = reinterpret_cast<AMX_NATIVE>(ip->operand);
+    SAVE_REGISTERS();
+    pri = native(amx, reinterpret_cast<cell*>(data + stk));
+    frm = amx->frm;
+    stk = amx->stk;
+    NEXT();
+  }
+  TARGET(OP_SWITCH) {
+    const cell *table = &code->switch_data[ip->operand];
+    cell target = table[1];
+    for (cell i = 0; i < table[0]; i++) {
+      if (table[2 + i * 2] == pri) {
+        target = table[2 + i * 2 + 1];
+        break;
+      }
+    }
+    if (ops + target <= ip
+        && ++code->back_edges >= code->osr_back_edges) {
+      ip = ops + target;
+      goto osr;
+    }
+    ip = ops + target;
+    DISPATCH();
+  }
+  TARGET(OP_SWAP_PRI) {
+    std::swap(MEM(stk), pri);
+    NEXT();
+  }
+  TARGET(OP_SWAP_ALT) {
+    std::swap(MEM(stk), alt);
+    NEXT();
+  }
+  TARGET(OP_PUSH_ADR) {
+    stk -= sizeof(cell);
+    MEM(stk) = frm + ip->operand;
+    NEXT();
+  }
+  TARGET(OP_END) {
+    // The function doesn't return, execution continues in the next one
+    // just like in compiled code.
+    if (code->index + 1 >= functions_.num_functions()
+        || (code = GetCode(code->index + 1)) == 0) {
+      error = AMX_ERR_INVINSTR;
+      goto abort;
+    }
+    ops = &code->ops[0];
+    ip = ops;
+    DISPATCH();
+  }
+
+#if !AMXJIT_DIRECT_THREADING
+    default:
+      goto invalid;
+  }
+#endif
+
+osr:
+  {
+    // The function has been looping for long enough, continue in compiled
+    // code. The AMX registers and the stack are the same for both tiers.
+    void *start = EnterCompiledCode(code->addresses[ip - ops], frm, depth);
+    if (start != 0) {
+      return_address = reinterpret_cast<cell>(start);
+      goto exit;
+    }
+    code->osr_back_edges = INT_MAX;
+    DISPATCH();
+  }
+
+invalid:
+  error = AMX_ERR_INVINSTR;
+
+abort:
+  SAVE_REGISTERS();
+  return_address = 0;
+  return error;
+
+exit:
+  SAVE_REGISTERS();
+  return AMX_ERR_NONE;
+}
+
+} // namespace amxjit
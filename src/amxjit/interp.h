@@ -0,0 +1,118 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_INTERP_H
+#define AMXJIT_INTERP_H
+
+#include <vector>
+#include "amxref.h"
+#include "macros.h"
+
+namespace amxjit {
+
+class CompileErrorHandler;
+class FunctionTable;
+
+// InterpreterHost lets the interpreter hand calls over to compiled code.
+class InterpreterHost {
+ public:
+  virtual ~InterpreterHost() {}
+
+  // Called whenever interpreted code calls a function. If the host decides
+  // to run the function by itself it should do so and return true. The AMX
+  // registers are passed in the AMX structure in both directions: on entry
+  // STK points to the function's arguments (the return address is not
+  // pushed) and on return PRI holds the return value and STK points past
+  // the arguments. If the function was aborted by HALT or a run time error
+  // the host sets halted to true and stores the error code in amx->error.
+  virtual bool Call(int index, bool &halted) = 0;
+
+  // Returns the compiled code of the instruction at the specified address,
+  // compiling the function that contains it if necessary, or null if this
+  // is not possible. Used for on-stack replacement.
+  virtual void *GetCompiledCode(cell address) = 0;
+};
+
+// Interpreter runs functions that haven't been compiled to machine code.
+// Functions are translated to direct-threaded code on first use (using the
+// same Compiler interface as the backends) and follow the same calling
+// conventions as compiled code, so that interpreted and compiled functions
+// can call each other.
+class Interpreter {
+ public:
+  Interpreter(AMXRef amx, const FunctionTable &functions,
+              InterpreterHost *host);
+  ~Interpreter();
+
+  // Sets the error handler that will be called if a function can't be
+  // translated.
+  void SetErrorHandler(CompileErrorHandler *error_handler) {
+    error_handler_ = error_handler;
+  }
+
+  // Sets the number of backward jumps in a function after which a running
+  // call is moved to compiled code (on-stack replacement). Zero disables
+  // this.
+  void SetOSRThreshold(int threshold) { osr_threshold_ = threshold; }
+
+  // Runs a function as if it was called by CALL from native code, i.e. the
+  // native return address must be already pushed onto the AMX stack. The
+  // AMX registers are taken from and written back to the AMX structure.
+  // On return return_address is set to the address popped off the stack
+  // by RET or RETN, or to the compiled code with which execution should
+  // continue after on-stack replacement, or to zero if execution was
+  // aborted by HALT or a run time error. Returns an AMX error code.
+  int Call(int index, cell &return_address);
+
+  // Returns the number of backward jumps taken in the specified function.
+  int GetBackEdgeCount(int index) const;
+
+  // Returns the number of functions that have been run by the interpreter.
+  int GetNumInterpreted() const;
+
+ private:
+  struct Op;
+  struct Code;
+  class Translator;
+
+  Code *GetCode(int index);
+  const Op *FindOp(cell address, Code *&code);
+  void *EnterCompiledCode(cell address, cell frm, int depth);
+
+ private:
+  AMXRef amx_;
+  const FunctionTable &functions_;
+  InterpreterHost *host_;
+  CompileErrorHandler *error_handler_;
+  int osr_threshold_;
+  std::vector<Code*> code_;
+  const void *const *handlers_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Interpreter);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_INTERP_H
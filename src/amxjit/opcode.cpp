@@ -44,7 +44,7 @@ cell *GetOpcodeTable() {
 cell FindOpcode(cell *opcode_table, cell opcode) {
   #ifdef AMXJIT_RELOCATE_OPCODES
     assert(opcode_table != 0);
-    for (int i = 0; i < NUM_OPCODES; i++) {
+    for (int i = 0; i < NUM_BASIC_OPCODES; i++) {
       if (opcode_table[i] == opcode) {
         return i;
       }
@@ -76,11 +76,24 @@ enum OpcodeID {
   OP_SWITCH,       OP_CASETBL,      OP_SWAP_PRI,
   OP_SWAP_ALT,     OP_PUSH_ADR,     OP_NOP,
   OP_SYSREQ_D,     OP_SYMTAG,       OP_BREAK,
+  // Macro instructions emitted by newer compilers.
+  OP_PUSH2_C,      OP_PUSH2,        OP_PUSH2_S,
+  OP_PUSH2_ADR,    OP_PUSH3_C,      OP_PUSH3,
+  OP_PUSH3_S,      OP_PUSH3_ADR,    OP_PUSH4_C,
+  OP_PUSH4,        OP_PUSH4_S,      OP_PUSH4_ADR,
+  OP_PUSH5_C,      OP_PUSH5,        OP_PUSH5_S,
+  OP_PUSH5_ADR,    OP_LOAD_BOTH,    OP_LOAD_S_BOTH,
+  OP_CONST,        OP_CONST_S,      OP_SYSREQ_N,
+  OP_SYSREQ_ND,
   OP_LAST_
 };
 
 const int NUM_OPCODES = OP_LAST_;
 
+// The number of opcodes known to the server's AMX. Macro instructions
+// are not in its opcode table.
+const int NUM_BASIC_OPCODES = OP_BREAK + 1;
+
 OpcodeID RelocateOpcode(cell opcode);
 
 class Opcode {
@@ -0,0 +1,317 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstddef>
+#include <map>
+#include "function.h"
+#include "optimizer.h"
+
+namespace amxjit {
+
+namespace {
+
+// Limits the number of jumps followed when threading a jump chain (which
+// also protects against jumps that form a cycle).
+const int kMaxJumpChainLength = 8;
+
+bool IsTarget(const std::set<cell> &targets, const Instruction &instr) {
+  return targets.find(instr.address()) != targets.end();
+}
+
+// Returns true if the value of PRI at the specified instruction may be used
+// later. The scan stops at the first jump target or control transfer, so
+// this is a conservative estimate.
+bool IsPriLive(const std::vector<Instruction> &instrs,
+               std::size_t index,
+               const std::set<cell> &targets) {
+  for (std::size_t i = index; i < instrs.size(); i++) {
+    const Instruction &instr = instrs[i];
+    if (IsTarget(targets, instr) || (instr.src_regs() & REG_PRI) != 0) {
+      return true;
+    }
+    if (instr.opcode().IsJump() || instr.opcode().IsCall()) {
+      return true;
+    }
+    switch (instr.opcode().GetId()) {
+      case OP_RET:
+      case OP_RETN:
+      case OP_SWITCH:
+        return true;
+    }
+    if ((instr.dst_regs() & REG_PRI) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Instruction MakeInstruction(cell address, OpcodeID id) {
+  Instruction instr;
+  instr.set_address(address);
+  instr.set_opcode(Opcode(id));
+  return instr;
+}
+
+Instruction MakeInstruction(cell address, OpcodeID id, cell operand) {
+  Instruction instr = MakeInstruction(address, id);
+  instr.AppendOperand(operand);
+  return instr;
+}
+
+// Tries to replace the instructions starting at the specified index with
+// a single instruction. On success stores the number of replaced
+// instructions in length.
+bool Combine(const std::vector<Instruction> &instrs,
+             std::size_t index,
+             const std::set<cell> &targets,
+             Instruction &result,
+             std::size_t &length) {
+  if (index + 1 >= instrs.size() || IsTarget(targets, instrs[index + 1])) {
+    return false;
+  }
+
+  const Instruction &first = instrs[index];
+  const Instruction &second = instrs[index + 1];
+  cell address = first.address();
+
+  // X; push.pri => push.X
+  if (second.opcode().GetId() == OP_PUSH_PRI) {
+    OpcodeID push_id = OP_NONE;
+    switch (first.opcode().GetId()) {
+      case OP_LOAD_PRI:
+        push_id = OP_PUSH;
+        break;
+      case OP_LOAD_S_PRI:
+        push_id = OP_PUSH_S;
+        break;
+      case OP_CONST_PRI:
+        push_id = OP_PUSH_C;
+        break;
+      case OP_ADDR_PRI:
+        push_id = OP_PUSH_ADR;
+        break;
+    }
+    if (push_id != OP_NONE && !IsPriLive(instrs, index + 2, targets)) {
+      result = MakeInstruction(address, push_id, first.operand());
+      length = 2;
+      return true;
+    }
+  }
+
+  // push.pri; pop.alt => move.alt
+  if (first.opcode().GetId() == OP_PUSH_PRI
+      && second.opcode().GetId() == OP_POP_ALT) {
+    result = MakeInstruction(address, OP_MOVE_ALT);
+    length = 2;
+    return true;
+  }
+
+  // zero.pri; stor.pri X => zero X
+  if (first.opcode().GetId() == OP_ZERO_PRI) {
+    OpcodeID zero_id = OP_NONE;
+    switch (second.opcode().GetId()) {
+      case OP_STOR_PRI:
+        zero_id = OP_ZERO;
+        break;
+      case OP_STOR_S_PRI:
+        zero_id = OP_ZERO_S;
+        break;
+    }
+    if (zero_id != OP_NONE && !IsPriLive(instrs, index + 2, targets)) {
+      result = MakeInstruction(address, zero_id, second.operand());
+      length = 2;
+      return true;
+    }
+  }
+
+  // load.pri X; inc.pri; stor.pri X => inc X (same for dec and locals)
+  if (index + 2 < instrs.size() && !IsTarget(targets, instrs[index + 2])) {
+    const Instruction &third = instrs[index + 2];
+    OpcodeID stor_id = OP_NONE;
+    bool local = false;
+    switch (first.opcode().GetId()) {
+      case OP_LOAD_PRI:
+        stor_id = OP_STOR_PRI;
+        break;
+      case OP_LOAD_S_PRI:
+        stor_id = OP_STOR_S_PRI;
+        local = true;
+        break;
+    }
+    OpcodeID id = OP_NONE;
+    switch (second.opcode().GetId()) {
+      case OP_INC_PRI:
+        id = local ? OP_INC_S : OP_INC;
+        break;
+      case OP_DEC_PRI:
+        id = local ? OP_DEC_S : OP_DEC;
+        break;
+    }
+    if (stor_id != OP_NONE
+        && id != OP_NONE
+        && third.opcode().GetId() == stor_id
+        && third.operand() == first.operand()
+        && !IsPriLive(instrs, index + 3, targets)) {
+      result = MakeInstruction(address, id, first.operand());
+      length = 3;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+} // anonymous namespace
+
+Optimizer::Optimizer(AMXRef amx, const FunctionTable &functions):
+  amx_(amx),
+  functions_(functions),
+  can_optimize_(!functions.has_indirect_jumps())
+{
+}
+
+bool Optimizer::Optimize(int index, std::vector<Instruction> &instrs) const {
+  const Function &function = functions_.GetFunction(index);
+
+  Disassembler disasm(amx_, function.address());
+  Instruction instr;
+  bool error = false;
+
+  instrs.clear();
+  while (disasm.Decode(instr, error)) {
+    if (instr.address() >= function.end_address()) {
+      break;
+    }
+    instrs.push_back(instr);
+  }
+  if (error) {
+    return false;
+  }
+
+  if (can_optimize_) {
+    ThreadJumps(instrs);
+    RemoveRedundantJumps(instrs);
+    CombineInstructions(instrs);
+  }
+
+  return true;
+}
+
+cell Optimizer::GetJumpTarget(const Instruction &instr) const {
+  return amxjit::GetJumpTarget(amx_, instr);
+}
+
+void Optimizer::FindJumpTargets(const std::vector<Instruction> &instrs,
+                                std::set<cell> &targets) const {
+  for (std::size_t i = 0; i < instrs.size(); i++) {
+    const Instruction &instr = instrs[i];
+    if (instr.opcode().IsJump()) {
+      targets.insert(GetJumpTarget(instr));
+    } else if (instr.opcode().GetId() == OP_SWITCH) {
+      CaseTable case_table(amx_, instr.operand());
+      targets.insert(case_table.GetDefaultAddress());
+      for (int j = 0; j < case_table.num_cases(); j++) {
+        targets.insert(case_table.GetCaseAddress(j));
+      }
+    }
+  }
+}
+
+// Makes jumps that land on an unconditional jump go directly to its
+// destination.
+void Optimizer::ThreadJumps(std::vector<Instruction> &instrs) const {
+  std::map<cell, std::size_t> indices;
+  for (std::size_t i = 0; i < instrs.size(); i++) {
+    indices[instrs[i].address()] = i;
+  }
+
+  for (std::size_t i = 0; i < instrs.size(); i++) {
+    Instruction &instr = instrs[i];
+    if (!instr.opcode().IsJump() || instr.opcode().GetId() == OP_JREL) {
+      // JREL can't take the absolute operand of the jump it lands on.
+      continue;
+    }
+
+    const Instruction *target = &instr;
+    for (int j = 0; j < kMaxJumpChainLength; j++) {
+      std::map<cell, std::size_t>::const_iterator it =
+        indices.find(GetJumpTarget(*target));
+      if (it == indices.end()
+          || instrs[it->second].opcode().GetId() != OP_JUMP) {
+        break;
+      }
+      target = &instrs[it->second];
+    }
+
+    if (target != &instr) {
+      instr.set_operands(target->operands());
+    }
+  }
+}
+
+// Removes unconditional jumps to the next instruction.
+void Optimizer::RemoveRedundantJumps(std::vector<Instruction> &instrs) const {
+  std::set<cell> targets;
+  FindJumpTargets(instrs, targets);
+
+  std::vector<Instruction> result;
+  result.reserve(instrs.size());
+
+  for (std::size_t i = 0; i < instrs.size(); i++) {
+    const Instruction &instr = instrs[i];
+    if (instr.opcode().GetId() == OP_JUMP
+        && i + 1 < instrs.size()
+        && GetJumpTarget(instr) == instrs[i + 1].address()
+        && !IsTarget(targets, instr)) {
+      continue;
+    }
+    result.push_back(instr);
+  }
+
+  instrs.swap(result);
+}
+
+void Optimizer::CombineInstructions(std::vector<Instruction> &instrs) const {
+  std::set<cell> targets;
+  FindJumpTargets(instrs, targets);
+
+  std::vector<Instruction> result;
+  result.reserve(instrs.size());
+
+  for (std::size_t i = 0; i < instrs.size(); ) {
+    Instruction combined;
+    std::size_t length = 0;
+    if (Combine(instrs, i, targets, combined, length)) {
+      result.push_back(combined);
+      i += length;
+    } else {
+      result.push_back(instrs[i]);
+      i++;
+    }
+  }
+
+  instrs.swap(result);
+}
+
+} // namespace amxjit
@@ -0,0 +1,73 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_OPTIMIZER_H
+#define AMXJIT_OPTIMIZER_H
+
+#include <set>
+#include <vector>
+#include "amxref.h"
+#include "disasm.h"
+#include "macros.h"
+
+namespace amxjit {
+
+class FunctionTable;
+
+// Optimizer rewrites the instructions of a single function before they are
+// compiled by the optimizing tier: it threads jumps, removes redundant ones
+// and combines common instruction sequences into cheaper equivalents.
+// It only reads the script so it's safe to use from a background thread.
+class Optimizer {
+ public:
+  Optimizer(AMXRef amx, const FunctionTable &functions);
+
+  // Returns false if the script contains computed jumps. In this case
+  // the set of jump targets is not known and nothing can be optimized.
+  bool CanOptimize() const { return can_optimize_; }
+
+  // Decodes the specified function and optimizes it. Returns false on
+  // error.
+  bool Optimize(int index, std::vector<Instruction> &instrs) const;
+
+ private:
+  cell GetJumpTarget(const Instruction &instr) const;
+  void FindJumpTargets(const std::vector<Instruction> &instrs,
+                       std::set<cell> &targets) const;
+  void ThreadJumps(std::vector<Instruction> &instrs) const;
+  void RemoveRedundantJumps(std::vector<Instruction> &instrs) const;
+  void CombineInstructions(std::vector<Instruction> &instrs) const;
+
+ private:
+  AMXRef amx_;
+  const FunctionTable &functions_;
+  bool can_optimize_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Optimizer);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_OPTIMIZER_H
@@ -0,0 +1,327 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cstdint.h"
+#include "sharedcode.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+  #define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+namespace amxjit {
+
+namespace {
+
+// Segments live in tmpfs, so they never touch the disk and go away on
+// reboot.
+const char kSharedDir[] = "/dev/shm/";
+
+const uint32_t kMagic = 0x444a4d41; // "AMJD"
+const uint32_t kFormatVersion = 1;
+
+// The segment file starts with a page holding this header, followed by
+// the code and then the metadata.
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t address;
+  uint32_t size;
+  uint32_t metadata_size;
+};
+
+std::size_t GetPageSize() {
+  return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+std::size_t RoundUpToPage(std::size_t size) {
+  std::size_t page_size = GetPageSize();
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+bool ReadAll(int fd, void *buffer, std::size_t size, off_t offset) {
+  unsigned char *ptr = static_cast<unsigned char*>(buffer);
+  while (size > 0) {
+    ssize_t n = pread(fd, ptr, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    ptr += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const void *buffer, std::size_t size, off_t offset) {
+  const unsigned char *ptr = static_cast<const unsigned char*>(buffer);
+  while (size > 0) {
+    ssize_t n = pwrite(fd, ptr, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    ptr += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+struct SharedCode::Impl {
+  std::string path;
+  std::string temp_path;
+  int lock_fd;
+  int fd;
+  unsigned char *base;
+  std::size_t size;
+  std::size_t mapped_size;
+  std::size_t local_size;
+
+  // Reserves address space for the code and the local area. If address
+  // is not null the reservation must start exactly there.
+  bool Reserve(void *address, std::size_t code_size);
+};
+
+bool SharedCode::Impl::Reserve(void *address, std::size_t code_size) {
+  std::size_t total_size = RoundUpToPage(code_size) + local_size;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (address != 0) {
+    flags |= MAP_FIXED_NOREPLACE;
+  }
+  void *result =
+    mmap(address, total_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (result == MAP_FAILED) {
+    return false;
+  }
+  // Older kernels treat the address as a hint.
+  if (address != 0 && result != address) {
+    munmap(result, total_size);
+    return false;
+  }
+  base = static_cast<unsigned char*>(result);
+  size = code_size;
+  mapped_size = total_size;
+  return true;
+}
+
+SharedCode::SharedCode(const std::string &name): impl_(new Impl) {
+  impl_->path = std::string(kSharedDir) + "amxjit-" + name;
+  impl_->lock_fd = -1;
+  impl_->fd = -1;
+  impl_->base = 0;
+  impl_->size = 0;
+  impl_->mapped_size = 0;
+  impl_->local_size = RoundUpToPage(kLocalSize);
+}
+
+SharedCode::~SharedCode() {
+  if (impl_->base != 0) {
+    munmap(impl_->base, impl_->mapped_size);
+  }
+  if (impl_->fd >= 0) {
+    // Never published.
+    close(impl_->fd);
+    unlink(impl_->temp_path.c_str());
+  }
+  Unlock();
+  delete impl_;
+}
+
+bool SharedCode::Lock() {
+  std::string lock_path = impl_->path + ".lock";
+  impl_->lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (impl_->lock_fd < 0) {
+    return false;
+  }
+  while (flock(impl_->lock_fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      Unlock();
+      return false;
+    }
+  }
+  return true;
+}
+
+void SharedCode::Unlock() {
+  if (impl_->lock_fd >= 0) {
+    flock(impl_->lock_fd, LOCK_UN);
+    close(impl_->lock_fd);
+    impl_->lock_fd = -1;
+  }
+}
+
+bool SharedCode::Attach(std::vector<unsigned char> &metadata) {
+  if (impl_->base != 0) {
+    return false;
+  }
+
+  int fd = open(impl_->path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  struct stat st;
+  bool ok = ReadAll(fd, &header, sizeof(header), 0)
+         && header.magic == kMagic
+         && header.version == kFormatVersion
+         && header.address != 0
+         && header.size != 0
+         && fstat(fd, &st) == 0;
+
+  std::size_t code_offset = GetPageSize();
+  std::size_t metadata_offset = code_offset + RoundUpToPage(header.size);
+  ok = ok
+    && static_cast<uint64_t>(st.st_size)
+         >= static_cast<uint64_t>(metadata_offset) + header.metadata_size
+    && header.address == reinterpret_cast<uintptr_t>(
+         reinterpret_cast<void*>(static_cast<uintptr_t>(header.address)))
+    && impl_->Reserve(reinterpret_cast<void*>(
+         static_cast<uintptr_t>(header.address)), header.size);
+
+  if (ok) {
+    void *code = mmap(impl_->base,
+                      RoundUpToPage(header.size),
+                      PROT_READ | PROT_EXEC,
+                      MAP_SHARED | MAP_FIXED,
+                      fd,
+                      static_cast<off_t>(code_offset));
+    metadata.resize(header.metadata_size);
+    ok = code != MAP_FAILED
+      && (metadata.empty()
+          || ReadAll(fd, &metadata[0], metadata.size(),
+                     static_cast<off_t>(metadata_offset)));
+    if (!ok) {
+      munmap(impl_->base, impl_->mapped_size);
+      impl_->base = 0;
+    }
+  }
+
+  close(fd);
+  return ok;
+}
+
+bool SharedCode::Create(std::size_t size) {
+  if (impl_->base != 0 || size == 0 || !impl_->Reserve(0, size)) {
+    return false;
+  }
+
+  char pid[16];
+  std::sprintf(pid, ".%d", static_cast<int>(getpid()));
+  impl_->temp_path = impl_->path + pid;
+
+  std::size_t code_offset = GetPageSize();
+  std::size_t code_size = RoundUpToPage(size);
+  int fd = open(impl_->temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0
+         && ftruncate(fd, static_cast<off_t>(code_offset + code_size)) == 0
+         && mmap(impl_->base,
+                 code_size,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED,
+                 fd,
+                 static_cast<off_t>(code_offset)) != MAP_FAILED;
+  if (!ok) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(impl_->temp_path.c_str());
+    }
+    munmap(impl_->base, impl_->mapped_size);
+    impl_->base = 0;
+    return false;
+  }
+
+  impl_->fd = fd;
+  return true;
+}
+
+bool SharedCode::Publish(const std::vector<unsigned char> &metadata) {
+  if (impl_->fd < 0) {
+    return false;
+  }
+
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = kMagic;
+  header.version = kFormatVersion;
+  header.address = reinterpret_cast<uintptr_t>(impl_->base);
+  header.size = static_cast<uint32_t>(impl_->size);
+  header.metadata_size = static_cast<uint32_t>(metadata.size());
+
+  std::size_t code_size = RoundUpToPage(impl_->size);
+  std::size_t metadata_offset = GetPageSize() + code_size;
+
+  // The code must never change once it's visible to other processes.
+  bool ok = mprotect(impl_->base, code_size, PROT_READ | PROT_EXEC) == 0
+         && WriteAll(impl_->fd, &header, sizeof(header), 0)
+         && (metadata.empty()
+             || WriteAll(impl_->fd, &metadata[0], metadata.size(),
+                         static_cast<off_t>(metadata_offset)))
+         && rename(impl_->temp_path.c_str(), impl_->path.c_str()) == 0;
+  if (!ok) {
+    return false;
+  }
+
+  close(impl_->fd);
+  impl_->fd = -1;
+  return true;
+}
+
+bool SharedCode::ProtectLocal() {
+  return impl_->base != 0
+      && mprotect(local(), impl_->local_size, PROT_READ | PROT_EXEC) == 0;
+}
+
+unsigned char *SharedCode::code() const {
+  return impl_->base;
+}
+
+std::size_t SharedCode::size() const {
+  return impl_->size;
+}
+
+unsigned char *SharedCode::local() const {
+  if (impl_->base == 0) {
+    return 0;
+  }
+  return impl_->base + RoundUpToPage(impl_->size);
+}
+
+} // namespace amxjit
@@ -0,0 +1,72 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "sharedcode.h"
+
+namespace amxjit {
+
+// Not implemented: code is never shared on Windows.
+
+SharedCode::SharedCode(const std::string &name): impl_() {
+}
+
+SharedCode::~SharedCode() {
+}
+
+bool SharedCode::Lock() {
+  return false;
+}
+
+void SharedCode::Unlock() {
+}
+
+bool SharedCode::Attach(std::vector<unsigned char> &metadata) {
+  return false;
+}
+
+bool SharedCode::Create(std::size_t size) {
+  return false;
+}
+
+bool SharedCode::Publish(const std::vector<unsigned char> &metadata) {
+  return false;
+}
+
+bool SharedCode::ProtectLocal() {
+  return false;
+}
+
+unsigned char *SharedCode::code() const {
+  return 0;
+}
+
+std::size_t SharedCode::size() const {
+  return 0;
+}
+
+unsigned char *SharedCode::local() const {
+  return 0;
+}
+
+} // namespace amxjit
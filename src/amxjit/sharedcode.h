@@ -0,0 +1,86 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_SHAREDCODE_H
+#define AMXJIT_SHAREDCODE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "macros.h"
+
+namespace amxjit {
+
+// SharedCode is a segment of machine code shared between processes that
+// run the same script: the first process to load it compiles the code and
+// publishes it under a name derived from the script's hash, the rest map
+// the same physical pages instead of compiling their own copy.
+//
+// Because the code is identical in all processes it has to be mapped at
+// the same address everywhere. Anything process-specific that it refers to
+// goes to the local area, a private page placed right after the code.
+//
+// This is only supported on Linux; elsewhere all methods fail.
+class SharedCode {
+ public:
+  // Size of the local area.
+  static const std::size_t kLocalSize = 4096;
+
+  explicit SharedCode(const std::string &name);
+  ~SharedCode();
+
+  // Acquires a lock that prevents other processes from publishing code
+  // with the same name. It's held until Unlock() or destruction.
+  bool Lock();
+  void Unlock();
+
+  // Maps previously published code. Returns false if there's none or it
+  // couldn't be mapped at the right address.
+  bool Attach(std::vector<unsigned char> &metadata);
+
+  // Creates a new writable segment of the specified size.
+  bool Create(std::size_t size);
+
+  // Makes the code available to other processes. The metadata is saved
+  // alongside the code and returned by Attach().
+  bool Publish(const std::vector<unsigned char> &metadata);
+
+  // Makes the local area executable and read-only.
+  bool ProtectLocal();
+
+  unsigned char *code() const;
+  std::size_t size() const;
+  unsigned char *local() const;
+
+ private:
+  struct Impl;
+  Impl *impl_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(SharedCode);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_SHAREDCODE_H
@@ -0,0 +1,134 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cassert>
+#include <pthread.h>
+#include "thread.h"
+
+namespace amxjit {
+
+struct Mutex::Impl {
+  pthread_mutex_t mutex;
+};
+
+Mutex::Mutex(): impl_(new Impl) {
+  pthread_mutex_init(&impl_->mutex, 0);
+}
+
+Mutex::~Mutex() {
+  pthread_mutex_destroy(&impl_->mutex);
+  delete impl_;
+}
+
+void Mutex::Lock() {
+  pthread_mutex_lock(&impl_->mutex);
+}
+
+void Mutex::Unlock() {
+  pthread_mutex_unlock(&impl_->mutex);
+}
+
+struct Event::Impl {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool signaled;
+};
+
+Event::Event(): impl_(new Impl) {
+  pthread_mutex_init(&impl_->mutex, 0);
+  pthread_cond_init(&impl_->cond, 0);
+  impl_->signaled = false;
+}
+
+Event::~Event() {
+  pthread_cond_destroy(&impl_->cond);
+  pthread_mutex_destroy(&impl_->mutex);
+  delete impl_;
+}
+
+void Event::Set() {
+  pthread_mutex_lock(&impl_->mutex);
+  impl_->signaled = true;
+  pthread_cond_signal(&impl_->cond);
+  pthread_mutex_unlock(&impl_->mutex);
+}
+
+void Event::Wait() {
+  pthread_mutex_lock(&impl_->mutex);
+  while (!impl_->signaled) {
+    pthread_cond_wait(&impl_->cond, &impl_->mutex);
+  }
+  impl_->signaled = false;
+  pthread_mutex_unlock(&impl_->mutex);
+}
+
+struct Thread::Impl {
+  pthread_t thread;
+  Function function;
+  void *arg;
+  bool joined;
+};
+
+namespace {
+
+void *ThreadProc(void *arg) {
+  Thread::Function function;
+  void *function_arg;
+  {
+    // Impl is private, so it's passed as a pair of values.
+    void **args = static_cast<void**>(arg);
+    function = reinterpret_cast<Thread::Function>(args[0]);
+    function_arg = args[1];
+    delete[] args;
+  }
+  function(function_arg);
+  return 0;
+}
+
+} // anonymous namespace
+
+Thread::Thread(Function function, void *arg): impl_(new Impl) {
+  impl_->function = function;
+  impl_->arg = arg;
+  impl_->joined = false;
+
+  void **args = new void*[2];
+  args[0] = reinterpret_cast<void*>(function);
+  args[1] = arg;
+  pthread_create(&impl_->thread, 0, ThreadProc, args);
+}
+
+Thread::~Thread() {
+  assert(impl_->joined);
+  delete impl_;
+}
+
+void Thread::Join() {
+  if (!impl_->joined) {
+    pthread_join(impl_->thread, 0);
+    impl_->joined = true;
+  }
+}
+
+} // namespace amxjit
@@ -0,0 +1,122 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cassert>
+#include "thread.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+namespace amxjit {
+
+struct Mutex::Impl {
+  CRITICAL_SECTION cs;
+};
+
+Mutex::Mutex(): impl_(new Impl) {
+  InitializeCriticalSection(&impl_->cs);
+}
+
+Mutex::~Mutex() {
+  DeleteCriticalSection(&impl_->cs);
+  delete impl_;
+}
+
+void Mutex::Lock() {
+  EnterCriticalSection(&impl_->cs);
+}
+
+void Mutex::Unlock() {
+  LeaveCriticalSection(&impl_->cs);
+}
+
+struct Event::Impl {
+  HANDLE event;
+};
+
+Event::Event(): impl_(new Impl) {
+  impl_->event = CreateEvent(0, FALSE, FALSE, 0);
+}
+
+Event::~Event() {
+  CloseHandle(impl_->event);
+  delete impl_;
+}
+
+void Event::Set() {
+  SetEvent(impl_->event);
+}
+
+void Event::Wait() {
+  WaitForSingleObject(impl_->event, INFINITE);
+}
+
+struct Thread::Impl {
+  HANDLE thread;
+  Function function;
+  void *arg;
+  bool joined;
+};
+
+namespace {
+
+struct ThreadArgs {
+  Thread::Function function;
+  void *arg;
+};
+
+DWORD WINAPI ThreadProc(LPVOID arg) {
+  ThreadArgs args = *static_cast<ThreadArgs*>(arg);
+  delete static_cast<ThreadArgs*>(arg);
+  args.function(args.arg);
+  return 0;
+}
+
+} // anonymous namespace
+
+Thread::Thread(Function function, void *arg): impl_(new Impl) {
+  impl_->function = function;
+  impl_->arg = arg;
+  impl_->joined = false;
+
+  ThreadArgs *args = new ThreadArgs;
+  args->function = function;
+  args->arg = arg;
+  impl_->thread = CreateThread(0, 0, ThreadProc, args, 0, 0);
+}
+
+Thread::~Thread() {
+  assert(impl_->joined);
+  CloseHandle(impl_->thread);
+  delete impl_;
+}
+
+void Thread::Join() {
+  if (!impl_->joined) {
+    WaitForSingleObject(impl_->thread, INFINITE);
+    impl_->joined = true;
+  }
+}
+
+} // namespace amxjit
@@ -0,0 +1,101 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_THREAD_H
+#define AMXJIT_THREAD_H
+
+#include "macros.h"
+
+namespace amxjit {
+
+class Mutex {
+ public:
+  Mutex();
+  ~Mutex();
+
+  void Lock();
+  void Unlock();
+
+ private:
+  struct Impl;
+  Impl *impl_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Mutex);
+};
+
+class ScopedLock {
+ public:
+  explicit ScopedLock(Mutex &mutex): mutex_(mutex) { mutex_.Lock(); }
+  ~ScopedLock() { mutex_.Unlock(); }
+
+ private:
+  Mutex &mutex_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(ScopedLock);
+};
+
+// An auto-reset event: Wait() blocks until Set() is called and then resets
+// the event.
+class Event {
+ public:
+  Event();
+  ~Event();
+
+  void Set();
+  void Wait();
+
+ private:
+  struct Impl;
+  Impl *impl_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Event);
+};
+
+class Thread {
+ public:
+  typedef void (*Function)(void *arg);
+
+  // Starts a new thread that runs function(arg).
+  Thread(Function function, void *arg);
+
+  // The thread must be joined before it's destroyed.
+  ~Thread();
+
+  // Waits for the thread to finish.
+  void Join();
+
+ private:
+  struct Impl;
+  Impl *impl_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(Thread);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_THREAD_H
@@ -0,0 +1,116 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cassert>
+#include "threadpool.h"
+
+namespace amxjit {
+
+ThreadPool::ThreadPool(int num_threads):
+  task_(),
+  arg_()
+{
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  for (int i = 0; i < num_threads; i++) {
+    queues_.push_back(new Queue);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  for (std::size_t i = 0; i < queues_.size(); i++) {
+    delete queues_[i];
+  }
+}
+
+void ThreadPool::Run(Task task, void *arg, int num_tasks) {
+  int num_threads = this->num_threads();
+
+  task_ = task;
+  arg_ = arg;
+
+  for (int i = 0; i < num_threads; i++) {
+    int first = static_cast<int>(
+      static_cast<long long>(num_tasks) * i / num_threads);
+    int last = static_cast<int>(
+      static_cast<long long>(num_tasks) * (i + 1) / num_threads);
+    for (int j = first; j < last; j++) {
+      queues_[i]->tasks.push_back(j);
+    }
+  }
+
+  std::vector<Worker> workers(num_threads);
+  std::vector<Thread*> threads;
+  for (int i = 0; i < num_threads; i++) {
+    workers[i].pool = this;
+    workers[i].index = i;
+    if (i > 0) {
+      threads.push_back(new Thread(RunWorker, &workers[i]));
+    }
+  }
+
+  RunWorker(&workers[0]);
+
+  for (std::size_t i = 0; i < threads.size(); i++) {
+    threads[i]->Join();
+    delete threads[i];
+  }
+}
+
+void ThreadPool::RunWorker(void *arg) {
+  Worker *worker = static_cast<Worker*>(arg);
+  ThreadPool *pool = worker->pool;
+  int task;
+  while (pool->GetTask(worker->index, task)) {
+    pool->task_(pool->arg_, worker->index, task);
+  }
+}
+
+bool ThreadPool::GetTask(int thread, int &task) {
+  {
+    Queue *queue = queues_[thread];
+    ScopedLock lock(queue->mutex);
+    if (!queue->tasks.empty()) {
+      task = queue->tasks.front();
+      queue->tasks.pop_front();
+      return true;
+    }
+  }
+
+  int num_threads = this->num_threads();
+  for (int i = 1; i < num_threads; i++) {
+    Queue *victim = queues_[(thread + i) % num_threads];
+    ScopedLock lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      task = victim->tasks.back();
+      victim->tasks.pop_back();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+} // namespace amxjit
@@ -0,0 +1,78 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef AMXJIT_THREADPOOL_H
+#define AMXJIT_THREADPOOL_H
+
+#include <deque>
+#include <vector>
+#include "macros.h"
+#include "thread.h"
+
+namespace amxjit {
+
+// ThreadPool runs a batch of independent tasks on several threads (one of
+// which is the calling thread). Each thread starts with its own contiguous
+// range of tasks; once it runs out of them it steals tasks from the end of
+// the other threads' queues.
+class ThreadPool {
+ public:
+  // Task is called with the index of the thread running it (from 0 to
+  // num_threads - 1) and the index of the task.
+  typedef void (*Task)(void *arg, int thread, int task);
+
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  int num_threads() const { return static_cast<int>(queues_.size()); }
+
+  // Runs tasks from 0 to num_tasks - 1 and waits until all of them finish.
+  void Run(Task task, void *arg, int num_tasks);
+
+ private:
+  struct Queue {
+    Mutex mutex;
+    std::deque<int> tasks;
+  };
+
+  struct Worker {
+    ThreadPool *pool;
+    int index;
+  };
+
+  static void RunWorker(void *arg);
+  bool GetTask(int thread, int &task);
+
+ private:
+  std::vector<Queue*> queues_;
+  Task task_;
+  void *arg_;
+
+ private:
+  AMXJIT_DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+} // namespace amxjit
+
+#endif // !AMXJIT_THREADPOOL_H
@@ -0,0 +1,231 @@
+// Copyright (c) 2012-2015 Zeex
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// amxjitc compiles .amx files ahead of time. The output goes to the JIT's
+// code cache directory (plugins/jit-cache by default), from where the
+// plugin loads it instead of compiling the script when jit_cache is on.
+//
+// Usage: amxjitc [--verify] [--time] [-j <threads>] [-o <cache-dir>]
+//                <file.amx>...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <amx/amx.h>
+#include "amxjit/compiler-asmjit.h"
+#include "amxjit/disasm.h"
+#include "amxjit/opcode.h"
+#include "os.h"
+#include "version.h"
+
+namespace {
+
+const char kDefaultCacheDir[] = "plugins/jit-cache";
+
+// A script loaded the same way as the server does it, only without the
+// data and stack (the code is never executed).
+class Script {
+ public:
+  Script() {
+    std::memset(&amx_, 0, sizeof(amx_));
+  }
+
+  bool Load(const char *filename, std::string &error);
+
+  AMX *amx() { return &amx_; }
+
+ private:
+  AMX amx_;
+  std::vector<unsigned char> memory_;
+};
+
+bool Script::Load(const char *filename, std::string &error) {
+  std::FILE *fp = std::fopen(filename, "rb");
+  if (fp == 0) {
+    error = "could not open file";
+    return false;
+  }
+
+  std::vector<unsigned char> file;
+  unsigned char buffer[4096];
+  std::size_t size;
+  while ((size = std::fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    file.insert(file.end(), buffer, buffer + size);
+  }
+  std::fclose(fp);
+
+  AMX_HEADER hdr;
+  if (file.size() < sizeof(hdr)) {
+    error = "file is too small";
+    return false;
+  }
+  std::memcpy(&hdr, &file[0], sizeof(hdr));
+
+  if (hdr.magic != AMX_MAGIC
+      || hdr.file_version < MIN_FILE_VERSION
+      || hdr.file_version > CUR_FILE_VERSION
+      || hdr.size < 0
+      || static_cast<std::size_t>(hdr.size) > file.size()
+      || hdr.cod < static_cast<int32_t>(sizeof(hdr))
+      || hdr.cod > hdr.dat
+      || hdr.dat > hdr.hea
+      || hdr.hea > hdr.stp) {
+    error = "invalid AMX header";
+    return false;
+  }
+
+  if ((hdr.flags & AMX_FLAG_COMPACT) != 0) {
+    if (!amxjit::ExpandCompactCode(file, memory_)) {
+      error = "invalid compact encoding";
+      return false;
+    }
+  } else {
+    if (hdr.size < hdr.hea) {
+      error = "file is truncated";
+      return false;
+    }
+    memory_.assign(file.begin(), file.begin() + hdr.hea);
+  }
+
+  AMX_HEADER *header = reinterpret_cast<AMX_HEADER*>(&memory_[0]);
+  amx_.base = &memory_[0];
+  amx_.flags = header->flags | AMX_FLAG_RELOC;
+  amxjit::RelocateCode(amxjit::AMXRef(&amx_));
+
+  return true;
+}
+
+void PrintUsage() {
+  std::fprintf(stderr,
+    "Usage: amxjitc [--verify] [--time] [-j <threads>] [-o <cache-dir>]\n"
+    "               <file.amx>...\n"
+    "\n"
+    "Compiles AMX scripts ahead of time into the JIT code cache.\n"
+    "\n"
+    "  -o <cache-dir>  output directory (default: %s)\n"
+    "  -j <threads>    number of compilation threads (default: 1)\n"
+    "  --time          print how long each script took to compile\n"
+    "  --verify        check that the cached code matches the scripts\n",
+    kDefaultCacheDir);
+}
+
+} // anonymous namespace
+
+// The opcode table is only needed for scripts loaded by the server. Here
+// opcodes are not relocated, so each opcode maps to itself.
+int AMXAPI amx_Exec(AMX *amx, cell *retval, int index) {
+  static cell opcode_table[amxjit::NUM_OPCODES];
+  if ((amx->flags & AMX_FLAG_BROWSE) == AMX_FLAG_BROWSE) {
+    for (int i = 0; i < amxjit::NUM_OPCODES; i++) {
+      opcode_table[i] = i;
+    }
+    *retval = reinterpret_cast<cell>(opcode_table);
+    return AMX_ERR_NONE;
+  }
+  (void)index;
+  return AMX_ERR_NOTFOUND;
+}
+
+int main(int argc, char **argv) {
+  std::string cache_dir = kDefaultCacheDir;
+  bool verify = false;
+  bool time = false;
+  int num_threads = 1;
+  std::vector<const char*> filenames;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--verify") == 0) {
+      verify = true;
+    } else if (std::strcmp(argv[i], "--time") == 0) {
+      time = true;
+    } else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_threads = std::atoi(argv[++i]);
+      if (num_threads < 1) {
+        PrintUsage();
+        return 2;
+      }
+    } else if (argv[i][0] == '-') {
+      PrintUsage();
+      return 2;
+    } else {
+      filenames.push_back(argv[i]);
+    }
+  }
+
+  if (filenames.empty()) {
+    PrintUsage();
+    return 2;
+  }
+
+  if (!verify && !os::MakeDirectory(cache_dir)) {
+    std::fprintf(stderr, "Could not create directory %s\n", cache_dir.c_str());
+    return 1;
+  }
+
+  int failed = 0;
+
+  for (std::size_t i = 0; i < filenames.size(); i++) {
+    const char *filename = filenames[i];
+
+    Script script;
+    std::string error;
+    if (!script.Load(filename, error)) {
+      std::fprintf(stderr, "%s: %s\n", filename, error.c_str());
+      failed++;
+      continue;
+    }
+
+    amxjit::CompilerAsmjit compiler;
+    compiler.SetCacheDir(cache_dir, PROJECT_VERSION_STRING);
+    compiler.SetNumThreads(num_threads);
+
+    if (verify) {
+      if (compiler.VerifyCache(script.amx())) {
+        std::printf("%s: OK\n", filename);
+      } else {
+        std::fprintf(stderr, "%s: cached code is missing or out of date\n",
+                     filename);
+        failed++;
+      }
+    } else {
+      double start_time = os::GetTime();
+      if (!compiler.CompileToCache(script.amx())) {
+        std::fprintf(stderr, "%s: compilation failed\n", filename);
+        failed++;
+      } else if (time) {
+        std::printf("%s: compiled in %.3f ms using %d thread(s)\n",
+                    filename,
+                    (os::GetTime() - start_time) * 1000.0,
+                    num_threads);
+      }
+    }
+  }
+
+  return failed == 0 ? 0 : 1;
+}
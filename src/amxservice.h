@@ -29,6 +29,11 @@
 
 #include <amx/amx.h>
 
+// AMXService attaches an instance of T to each AMX. The instance is stored
+// in the AMX's user data under the tag T::kUserDataTag. Every AMX uses the
+// same slot (the first one that was free when the first instance was
+// created), so finding the instance doesn't require a search. If that slot
+// is taken by someone else, a map is used instead.
 template<typename T>
 class AMXService {
  public:
@@ -37,8 +42,13 @@ class AMXService {
   AMX *amx() const { return amx_; }
 
  public:
+  // Attaches a new instance to the AMX, replacing the one it may have
+  // inherited from the AMX it was copied from.
   static T *CreateInstance(AMX *amx);
+
+  // Returns the instance attached to the AMX or null if there is none.
   static T *GetInstance(AMX *amx);
+
   static void DestroyInstance(AMX *amx);
 
  private:
@@ -47,15 +57,34 @@ class AMXService {
  private:
   typedef std::map<AMX*, T*> ServiceMap;
   static ServiceMap service_map_;
+  static int slot_;
 };
 
 template<typename T>
 typename AMXService<T>::ServiceMap AMXService<T>::service_map_;
 
+template<typename T>
+int AMXService<T>::slot_ = -1;
+
 // static
 template<typename T>
 T *AMXService<T>::CreateInstance(AMX *amx) {
   T *service = new T(amx);
+  if (slot_ < 0) {
+    for (int i = 0; i < AMX_USERNUM; i++) {
+      if (amx->usertags[i] == 0) {
+        slot_ = i;
+        break;
+      }
+    }
+  }
+  // A copy of another AMX may have inherited the tag with its user data.
+  if (slot_ >= 0 && (amx->usertags[slot_] == 0
+                     || amx->usertags[slot_] == T::kUserDataTag)) {
+    amx->usertags[slot_] = T::kUserDataTag;
+    amx->userdata[slot_] = service;
+    return service;
+  }
   service_map_.insert(std::make_pair(amx, service));
   return service;
 }
@@ -63,16 +92,34 @@ T *AMXService<T>::CreateInstance(AMX *amx) {
 // static
 template<typename T>
 T *AMXService<T>::GetInstance(AMX *amx) {
-  typename ServiceMap::const_iterator iterator = service_map_.find(amx);
-  if (iterator != service_map_.end()) {
-    return iterator->second;
+  if (slot_ >= 0 && amx->usertags[slot_] == T::kUserDataTag) {
+    T *service = static_cast<T*>(amx->userdata[slot_]);
+    // The AMX may be a copy of another one, including its user data.
+    if (service->amx() == amx) {
+      return service;
+    }
   }
-  return CreateInstance(amx);
+  if (!service_map_.empty()) {
+    typename ServiceMap::const_iterator iterator = service_map_.find(amx);
+    if (iterator != service_map_.end()) {
+      return iterator->second;
+    }
+  }
+  return 0;
 }
 
 // static
 template<typename T>
 void AMXService<T>::DestroyInstance(AMX *amx) {
+  if (slot_ >= 0 && amx->usertags[slot_] == T::kUserDataTag) {
+    T *service = static_cast<T*>(amx->userdata[slot_]);
+    if (service->amx() == amx) {
+      amx->usertags[slot_] = 0;
+      amx->userdata[slot_] = 0;
+      delete service;
+      return;
+    }
+  }
   typename ServiceMap::iterator iterator = service_map_.find(amx);
   if (iterator != service_map_.end()) {
     T *service = iterator->second;
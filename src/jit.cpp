@@ -24,12 +24,18 @@
 
 #include <cassert>
 #include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "configreader.h"
 #include "jit.h"
 #include "logprintf.h"
+#include "os.h"
 #include "plugin.h"
+#include "version.h"
 
 #if JIT_ASMJIT
   #include "amxjit/compiler-asmjit.h"
@@ -56,15 +62,112 @@ void Printf(const char *format, ...) {
   va_end(va);
 }
 
+void PrintInstrTableSize(const amxjit::CompileOutput *output) {
+  std::size_t size;
+  std::size_t full_size;
+  output->GetInstrTableSize(size, full_size);
+  if (full_size > 0) {
+    Printf("Instruction table: %lu bytes (%lu bytes saved)",
+           static_cast<unsigned long>(size),
+           static_cast<unsigned long>(full_size > size ? full_size - size : 0));
+  }
+}
+
+void PrintDedupeStats(const amxjit::CompileOutput *output) {
+  int num_shared;
+  int num_functions;
+  std::size_t bytes_saved;
+  output->GetDedupeStats(num_shared, num_functions, bytes_saved);
+  if (num_shared > 0) {
+    Printf("Shared functions: %d of %d (%.1f%%), %lu bytes saved",
+           num_shared,
+           num_functions,
+           num_shared * 100.0 / num_functions,
+           static_cast<unsigned long>(bytes_saved));
+  }
+}
+
+void PrintCacheStats(const amxjit::CompileOutput *output) {
+  if (output->IsFromCache()) {
+    Printf("Code was loaded from the cache");
+  }
+}
+
+void PrintTierStats(const amxjit::CompileOutput *output) {
+  int num_interpreted;
+  int num_compiled;
+  int num_optimized;
+  output->GetTierStats(num_interpreted, num_compiled, num_optimized);
+  if (num_interpreted > 0 || num_compiled > 0) {
+    Printf("Tiered functions: %d interpreted, %d compiled, %d optimized",
+           num_interpreted,
+           num_compiled,
+           num_optimized);
+  }
+}
+
+// Reads the plugin's options from server.cfg. Options from the file named
+// by the JIT_CONFIG environment variable, if it's set, take precedence
+// (the tests use this to run individual scripts with different options).
+void LoadConfig(ConfigReader &config) {
+  const char *filename = std::getenv("JIT_CONFIG");
+  if (filename != 0) {
+    config.LoadFile(filename);
+  }
+  config.LoadFile("server.cfg");
+}
+
 class ErrorHandler: public amxjit::CompileErrorHandler {
  public:
+  ErrorHandler(): deferred_(false) {}
+
   virtual void Execute(const amxjit::Instruction &instr) {
+    if (deferred_) {
+      errors_.push_back(instr);
+    } else {
+      Print(instr);
+    }
+  }
+
+  // Makes the handler save errors instead of printing them. This is used
+  // for compiling on a background thread: the errors are printed later by
+  // the main thread with Flush().
+  void Defer() {
+    deferred_ = true;
+  }
+
+  void Flush() {
+    for (std::size_t i = 0; i < errors_.size(); i++) {
+      Print(errors_[i]);
+    }
+    errors_.clear();
+    deferred_ = false;
+  }
+
+ private:
+  static void Print(const amxjit::Instruction &instr) {
     Printf("Invalid or unsupported instruction at address %08x:",
            instr.address());
     Printf("  => %s", instr.ToString().c_str());
   }
+
+ private:
+  bool deferred_;
+  std::vector<amxjit::Instruction> errors_;
 };
 
+// In tiered mode functions are compiled long after Compile() returns, so
+// the error handler must outlive it.
+ErrorHandler error_handler;
+
+// Scripts made with amx_Clone() share the code section with the original
+// script and can share its compiled code as well. This maps the address of
+// the code section to the code compiled for it.
+typedef std::map<unsigned char*, amxjit::CompileOutput*> CodeMap;
+CodeMap code_map;
+
+amxjit::ExecFunction fallback_exec = 0;
+
 cell OnJITCompile(AMX *amx) {
   int index;
   if (amx_FindPublic(amx, "OnJITCompile", &index) == AMX_ERR_NONE) {
@@ -75,17 +178,15 @@ cell OnJITCompile(AMX *amx) {
   return 1;
 }
 
-amxjit::CompileOutput *Compile(AMX *amx) {
-  if (!OnJITCompile(amx)) {
-    Printf("Compilation was disabled");
-    return 0;
-  }
-
-  amxjit::Logger *logger = 0;
+amxjit::CompileOutput *Compile(AMX *amx,
+                               amxjit::CompileErrorHandler *error_handler,
+                               amxjit::Logger *&logger,
+                               bool &stats) {
   amxjit::Compiler *compiler = 0;
   amxjit::CompileOutput *output = 0;
 
-  ConfigReader server_cfg("server.cfg");
+  ConfigReader server_cfg;
+  LoadConfig(server_cfg);
 
   bool jit_log = false;
   server_cfg.GetOption("jit_log", jit_log);
@@ -94,11 +195,42 @@ amxjit::CompileOutput *Compile(AMX *amx) {
     logger = new amxjit::FileLogger("plugins/jit.log");
   }
 
+  int tier_up = 0;
+  server_cfg.GetOption("jit_tier_up", tier_up);
+
+  bool background_optimize = true;
+  server_cfg.GetOption("jit_background_optimize", background_optimize);
+
+  server_cfg.GetOption("jit_stats", stats);
+
+  int threads = 1;
+  server_cfg.GetOption("jit_threads", threads);
+
+  bool cache = false;
+  server_cfg.GetOption("jit_cache", cache);
+
+  bool share = false;
+  server_cfg.GetOption("jit_share", share);
+
+  bool dedupe = false;
+  server_cfg.GetOption("jit_dedupe", dedupe);
+
+  int arena_size = 64;
+  server_cfg.GetOption("jit_arena_size", arena_size);
+
+  bool huge_pages = false;
+  server_cfg.GetOption("jit_huge_pages", huge_pages);
+
   std::string backend = "asmjit";
   server_cfg.GetOption("jit_backend", backend);
 
   #if JIT_ASMJIT
     if (backend == "asmjit") {
+      // This is done only once, for the first script.
+      if (arena_size > 0) {
+        amxjit::CompilerAsmjit::SetUpCodeArena(
+          static_cast<std::size_t>(arena_size) * 1024 * 1024, huge_pages);
+      }
       compiler = new amxjit::CompilerAsmjit;
     }
   #endif
@@ -109,16 +241,33 @@ amxjit::CompileOutput *Compile(AMX *amx) {
   #endif
 
   if (compiler != 0) {
-    ErrorHandler error_handler;
     compiler->SetLogger(logger);
-    compiler->SetErrorHandler(&error_handler);
+    compiler->SetErrorHandler(error_handler);
+    compiler->SetTierUpThreshold(tier_up);
+    compiler->SetBackgroundOptimization(background_optimize);
+    compiler->SetNumThreads(threads);
+    if (cache && os::MakeDirectory("plugins/jit-cache")) {
+      compiler->SetCacheDir("plugins/jit-cache", PROJECT_VERSION_STRING);
+    }
+    compiler->SetShareCode(share, PROJECT_VERSION_STRING);
+    compiler->SetDedupe(dedupe);
+    compiler->SetFallbackExec(fallback_exec);
     output = compiler->Compile(amx);
+    if (tier_up > 0 && compiler->GetTierUpThreshold() <= 0) {
+      Printf("Self-modifying code detected, jit_tier_up is ignored");
+      tier_up = 0;
+    }
   } else {
     Printf("Unrecognized backend '%s'", backend.c_str());
   }
 
   delete compiler;
-  delete logger;
+
+  // In tiered mode the logger is still needed after compilation.
+  if (output == 0 || tier_up <= 0) {
+    delete logger;
+    logger = 0;
+  }
 
   return output;
 }
@@ -127,33 +276,127 @@ amxjit::CompileOutput *Compile(AMX *amx) {
 
 JIT::JIT(AMX *amx):
   AMXService<JIT>(amx),
-  state_(INIT)
+  state_(INIT),
+  code_(),
+  logger_(),
+  stats_(false),
+  error_handler_(),
+  thread_(),
+  finished_(false),
+  start_time_(),
+  compile_time_(),
+  interp_depth_()
 {
   amx->sysreq_d = 0;
+
+  ConfigReader server_cfg;
+  LoadConfig(server_cfg);
+
+  CodeMap::const_iterator it = code_map.find(amx->base);
+  if (it != code_map.end() && (code_ = it->second->Clone(amx)) != 0) {
+    state_ = COMPILE_SUCCEDED;
+    server_cfg.GetOption("jit_stats", stats_);
+    if (stats_) {
+      Printf("Cloned script shares %lu bytes of code with the original",
+             static_cast<unsigned long>(code_->GetCodeSize()));
+    }
+    return;
+  }
+
+  bool background = false;
+  server_cfg.GetOption("jit_background", background);
+
+  if (background) {
+    ErrorHandler *error_handler = new ErrorHandler;
+    error_handler->Defer();
+    error_handler_ = error_handler;
+    start_time_ = os::GetTime();
+    state_ = COMPILE;
+    thread_ = new amxjit::Thread(CompileInBackground, this);
+  }
 }
 
 JIT::~JIT() {
-  if (state_ == COMPILE_SUCCEDED) {
-    assert(code_ != 0);
+  if (thread_ != 0) {
+    thread_->Join();
+    delete thread_;
+  }
+  if (code_ != 0) {
+    if (stats_ && state_ == COMPILE_SUCCEDED) {
+      Printf("Final code size: %lu bytes",
+             static_cast<unsigned long>(code_->GetCodeSize()));
+    }
+    CodeMap::iterator it = code_map.find(amx()->base);
+    if (it != code_map.end() && it->second == code_) {
+      code_map.erase(it);
+    }
     code_->Delete();
   }
+  delete logger_;
+  delete error_handler_;
+}
+
+// static
+void JIT::SetFallbackExec(int (AMXAPI *exec)(AMX *amx,
+                                             cell *retval,
+                                             int index)) {
+  fallback_exec = exec;
 }
 
 int JIT::Exec(cell *retval, int index) {
   switch (state_) {
-    case INIT:
+    case INIT: {
+      double start_time = os::GetTime();
       state_ = COMPILE;
-      if ((code_ = Compile(amx())) != 0) {
+      if (!OnJITCompile(amx())) {
+        Printf("Compilation was disabled");
+        state_ = COMPILE_FAILED;
+        return AMX_ERR_INIT_JIT;
+      }
+      if ((code_ = Compile(amx(), &error_handler, logger_, stats_)) != 0) {
         state_ = COMPILE_SUCCEDED;
+        code_map.insert(std::make_pair(amx()->base, code_));
       } else {
         state_ = COMPILE_FAILED;
         return AMX_ERR_INIT_JIT;
       }
+      if (stats_) {
+        // With on-demand compilation most of the work is done during
+        // the call itself, so measure both.
+        double compile_time = os::GetTime() - start_time;
+        amxjit::EntryPoint entry_point = code_->GetEntryPoint();
+        int error = entry_point(index, retval);
+        Printf("First callback took %.3f ms (compile: %.3f ms), "
+               "code size: %lu bytes",
+               (os::GetTime() - start_time) * 1000.0,
+               compile_time * 1000.0,
+               static_cast<unsigned long>(code_->GetCodeSize()));
+        PrintInstrTableSize(code_);
+        PrintDedupeStats(code_);
+        PrintCacheStats(code_);
+        PrintTierStats(code_);
+        return error;
+      }
+    }
     case COMPILE_SUCCEDED: {
+      cell value;
+      if (code_->GetConstantResult(index, value)) {
+        return ReturnConstant(retval, value);
+      }
       amxjit::EntryPoint entry_point = code_->GetEntryPoint();
       return entry_point(index, retval);
     }
     case COMPILE:
+      // The script keeps running in the interpreter until the background
+      // thread is done. The switch can't happen in the middle of an
+      // interpreted call because compiled code has its own stack frames.
+      if (thread_ == 0 || interp_depth_ > 0 || !IsCompileFinished()) {
+        return AMX_ERR_INIT_JIT;
+      }
+      if (!FinishBackgroundCompile()) {
+        return AMX_ERR_INIT_JIT;
+      }
+      return code_->GetEntryPoint()(index, retval);
     case COMPILE_FAILED:
       return AMX_ERR_INIT_JIT;
     default:
@@ -161,3 +404,115 @@ int JIT::Exec(cell *retval, int index) {
       return AMX_ERR_NONE;
   }
 }
+
+int JIT::ReturnConstant(cell *retval, cell value) {
+  AMX *amx = this->amx();
+  if (amx->hea >= amx->stk) {
+    return AMX_ERR_STACKERR;
+  }
+  if (amx->stk > amx->stp) {
+    return AMX_ERR_STACKLOW;
+  }
+  if (amx->hea < amx->hlw) {
+    return AMX_ERR_HEAPLOW;
+  }
+  if ((amx->flags & AMX_FLAG_NTVREG) == 0) {
+    return AMX_ERR_NOTFOUND;
+  }
+  amx->stk += amx->paramcount * sizeof(cell);
+  amx->paramcount = 0;
+  amx->error = AMX_ERR_NONE;
+  if (retval != 0) {
+    *retval = value;
+  }
+  return AMX_ERR_NONE;
+}
+
+JITPublic *JIT::GetPublicHandle(int index) {
+  if (public_handles_.empty()) {
+    int num_publics = 0;
+    amx_NumPublics(amx(), &num_publics);
+    public_handles_.resize(num_publics);
+    for (int i = 0; i < num_publics; i++) {
+      public_handles_[i].jit = this;
+      public_handles_[i].index = i;
+    }
+  }
+  if (index < 0 || index >= static_cast<int>(public_handles_.size())) {
+    return 0;
+  }
+  return &public_handles_[index];
+}
+
+int JIT::PushArgs(int argc, const cell *argv) {
+  // Same as STKMARGIN in amx.c.
+  const cell kStackMargin = 16 * sizeof(cell);
+
+  AMX *amx = this->amx();
+  cell size = static_cast<cell>(argc * sizeof(cell));
+  if (argc < 0 || amx->hea + kStackMargin > amx->stk - size) {
+    return AMX_ERR_STACKERR;
+  }
+
+  unsigned char *data = amx->data;
+  if (data == 0) {
+    data = amx->base + reinterpret_cast<AMX_HEADER*>(amx->base)->dat;
+  }
+  amx->stk -= size;
+  amx->paramcount += argc;
+  if (argc > 0) {
+    std::memcpy(data + amx->stk, argv, size);
+  }
+  return AMX_ERR_NONE;
+}
+
+// static
+void JIT::CompileInBackground(void *arg) {
+  JIT *jit = static_cast<JIT*>(arg);
+  jit->code_ = Compile(jit->amx(),
+                       jit->error_handler_,
+                       jit->logger_,
+                       jit->stats_);
+  jit->compile_time_ = os::GetTime() - jit->start_time_;
+
+  amxjit::ScopedLock lock(jit->mutex_);
+  jit->finished_ = true;
+}
+
+bool JIT::IsCompileFinished() {
+  amxjit::ScopedLock lock(mutex_);
+  return finished_;
+}
+
+bool JIT::FinishBackgroundCompile() {
+  // The thread has already finished, so this doesn't block.
+  thread_->Join();
+  delete thread_;
+  thread_ = 0;
+
+  static_cast<ErrorHandler*>(error_handler_)->Flush();
+
+  // OnJITCompile() can only be called from the main thread, so the result
+  // of compilation may be thrown away at this point.
+  if (code_ != 0 && !OnJITCompile(amx())) {
+    Printf("Compilation was disabled");
+    code_->Delete();
+    code_ = 0;
+  }
+  if (code_ == 0) {
+    state_ = COMPILE_FAILED;
+    return false;
+  }
+
+  state_ = COMPILE_SUCCEDED;
+  code_map.insert(std::make_pair(amx()->base, code_));
+  if (stats_) {
+    Printf("Background compilation took %.3f ms, code size: %lu bytes",
+           compile_time_ * 1000.0,
+           static_cast<unsigned long>(code_->GetCodeSize()));
+    PrintInstrTableSize(code_);
+    PrintDedupeStats(code_);
+    PrintCacheStats(code_);
+  }
+  return true;
+}
@@ -25,22 +25,65 @@
 #ifndef JIT_H
 #define JIT_H
 
+#include <vector>
 #include "amxservice.h"
+#include "amxjit/thread.h"
 
 namespace amxjit {
+  class CompileErrorHandler;
   class CompileOutput;
+  class Logger;
 }
 
+class JIT;
+
+// A handle to a public function given out to other plugins (see jitapi.h).
+struct JITPublic {
+  JIT *jit;
+  int index;
+};
+
 class JIT: public AMXService<JIT> {
  friend class AMXService<JIT>;
 
  public:
   int Exec(cell *retval, int index);
 
+  // Returns the handle of the public function with the specified index or
+  // null if the index is invalid. Handles live as long as the JIT instance.
+  JITPublic *GetPublicHandle(int index);
+
+  // Pushes the arguments of a call made through a handle onto the AMX
+  // stack, same as calling amx_Push() for each of them in reverse order.
+  int PushArgs(int argc, const cell *argv);
+
+  // Sets the original amx_Exec(). Functions that can't be compiled are run
+  // through it while the rest of the script runs as machine code.
+  static void SetFallbackExec(int (AMXAPI *exec)(AMX *amx,
+                                                 cell *retval,
+                                                 int index));
+
+  // Must be called around calls that fall back to the AMX interpreter
+  // (i.e. when Exec() returns AMX_ERR_INIT_JIT).
+  void EnterInterpreter() { interp_depth_++; }
+  void LeaveInterpreter() { interp_depth_--; }
+
  private:
   explicit JIT(AMX *amx);
   ~JIT();
 
+  // Identifies the JIT instance in the AMX's user data (see AMXService).
+  static const long kUserDataTag = AMX_USERTAG('J', 'I', 'T', 0);
+
+  // Completes a call to a public function that just returns a constant
+  // without entering the generated code: does the same checks as the
+  // compiled amx_Exec() and pops the arguments.
+  int ReturnConstant(cell *retval, cell value);
+
+  static void CompileInBackground(void *arg);
+  bool IsCompileFinished();
+  bool FinishBackgroundCompile();
+
  private:
   enum State {
     INIT,
@@ -49,6 +92,19 @@ class JIT: public AMXService<JIT> {
     COMPILE_SUCCEDED
   } state_;
   amxjit::CompileOutput *code_;
+  amxjit::Logger *logger_;
+  bool stats_;
+
+  // Background compilation (jit_background).
+  amxjit::CompileErrorHandler *error_handler_;
+  amxjit::Thread *thread_;
+  amxjit::Mutex mutex_;
+  bool finished_;
+  double start_time_;
+  double compile_time_;
+  int interp_depth_;
+
+  std::vector<JITPublic> public_handles_;
 };
 
 #endif // !JIT_H
@@ -24,6 +24,9 @@
 
 #include <string>
 #include <dlfcn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 namespace os {
 
@@ -37,4 +40,14 @@ std::string GetModuleName(void *address) {
   return filename;
 }
 
+double GetTime() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+bool MakeDirectory(const std::string &path) {
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
 } // namespace os
@@ -50,4 +50,17 @@ std::string GetModuleName(void *address) {
   return std::string(&filename[0]);
 }
 
+double GetTime() {
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+}
+
+bool MakeDirectory(const std::string &path) {
+  return CreateDirectoryA(path.c_str(), 0)
+      || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
 } // namespace os
@@ -33,6 +33,13 @@ namespace os {
 // address belongs to, or an empty string if failed.
 std::string GetModuleName(void *address);
 
+// Returns the number of seconds elapsed since some fixed point in the past.
+// Only the difference between two calls is meaningful.
+double GetTime();
+
+// Creates a directory unless it already exists. Returns false on error.
+bool MakeDirectory(const std::string &path);
+
 } // namespace os
 
 #endif // !OS_H
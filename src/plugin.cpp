@@ -26,6 +26,7 @@
 #include <string>
 
 #include "jit.h"
+#include "jitapi.h"
 #include "logprintf.h"
 #include "os.h"
 #include "plugin.h"
@@ -53,6 +54,17 @@ static std::string GetFileName(const std::string &path) {
   return path;
 }
 
+static int Exec(JIT *jit, cell *retval, int index) {
+  int error = jit->Exec(retval, index);
+  if (error == AMX_ERR_INIT_JIT) {
+    AMX_EXEC exec = (AMX_EXEC)exec_hook.GetTrampoline();
+    jit->EnterInterpreter();
+    error = exec(jit->amx(), retval, index);
+    jit->LeaveInterpreter();
+  }
+  return error;
+}
+
 static int AMXAPI amx_Exec_JIT(AMX *amx, cell *retval, int index) {
   #ifdef LINUX
   if ((amx->flags & AMX_FLAG_BROWSE) == AMX_FLAG_BROWSE) {
@@ -61,12 +73,14 @@ static int AMXAPI amx_Exec_JIT(AMX *amx, cell *retval, int index) {
     return AMX_ERR_NONE;
   }
   #endif
-  int error = JIT::GetInstance(amx)->Exec(retval, index);
-  if (error == AMX_ERR_INIT_JIT) {
-    AMX_EXEC exec = (AMX_EXEC)exec_hook.GetTrampoline();
-    return exec(amx, retval, index);
+  JIT *jit = JIT::GetInstance(amx);
+  if (jit == 0) {
+    // AmxLoad() was never called for this AMX: it's a copy made with
+    // amx_Clone() or a script loaded by another plugin. Such instances are
+    // never destroyed because nobody tells us when the AMX goes away.
+    jit = JIT::CreateInstance(amx);
   }
-  return error;
+  return Exec(jit, retval, index);
 }
 
 PLUGIN_EXPORT unsigned int PLUGIN_CALL Supports() {
@@ -98,6 +112,7 @@ PLUGIN_EXPORT bool PLUGIN_CALL Load(void **ppData) {
     amx.flags &= ~AMX_FLAG_BROWSE;
   #endif
   exec_hook.Install(exec_start, (void *)amx_Exec_JIT);
+  JIT::SetFallbackExec((AMX_EXEC)exec_hook.GetTrampoline());
 
   logprintf("  JIT plugin v%s is OK.", PROJECT_VERSION_STRING);
   return true;
@@ -112,3 +127,28 @@ PLUGIN_EXPORT int PLUGIN_CALL AmxUnload(AMX *amx) {
  JIT::DestroyInstance(amx);
  return AMX_ERR_NONE;
 }
+
+PLUGIN_EXPORT JITPublic *PLUGIN_CALL JIT_FindPublic(AMX *amx,
+                                                    const char *name) {
+  // Scripts get an instance in AmxLoad() or on their first amx_Exec().
+  JIT *jit = JIT::GetInstance(amx);
+  int index;
+  if (jit == 0 || amx_FindPublic(amx, name, &index) != AMX_ERR_NONE) {
+    return 0;
+  }
+  return jit->GetPublicHandle(index);
+}
+
+PLUGIN_EXPORT int PLUGIN_CALL JIT_CallPublic(JITPublic *handle,
+                                             cell *retval,
+                                             int argc,
+                                             const cell *argv) {
+  if (handle == 0) {
+    return AMX_ERR_NOTFOUND;
+  }
+  int error = handle->jit->PushArgs(argc, argv);
+  if (error != AMX_ERR_NONE) {
+    return error;
+  }
+  return Exec(handle->jit, retval, handle->index);
+}
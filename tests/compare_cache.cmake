@@ -0,0 +1,32 @@
+# Compiles SCRIPT with amxjitc (AMXJITC) using 1 and 4 threads and checks
+# that the cached code is byte-for-byte the same. WORK_DIR is overwritten.
+
+file(REMOVE_RECURSE ${WORK_DIR})
+
+foreach(num_threads 1 4)
+  file(MAKE_DIRECTORY ${WORK_DIR}/${num_threads})
+  execute_process(
+    COMMAND ${AMXJITC} -j ${num_threads} -o ${WORK_DIR}/${num_threads}
+            ${SCRIPT}
+    RESULT_VARIABLE result
+  )
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "amxjitc -j ${num_threads} failed")
+  endif()
+endforeach()
+
+file(GLOB files RELATIVE ${WORK_DIR}/1 ${WORK_DIR}/1/*)
+if(NOT files)
+  message(FATAL_ERROR "amxjitc didn't write anything to ${WORK_DIR}/1")
+endif()
+
+foreach(file ${files})
+  execute_process(
+    COMMAND ${CMAKE_COMMAND} -E compare_files
+            ${WORK_DIR}/1/${file} ${WORK_DIR}/4/${file}
+    RESULT_VARIABLE result
+  )
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${file} is different with 1 and 4 threads")
+  endif()
+endforeach()